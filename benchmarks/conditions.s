@@ -0,0 +1,24 @@
+; Runs 30 million instructions, most of them conditional data processing, to
+; time how quickly Jimulator checks conditions: see "make bench"
+        B   main
+
+count   DEFW 3000000 ; Times round the loop, of 10 instructions
+
+        ALIGN
+main    LDR R5, count
+        MOV R0, #0
+        MOV R1, #0
+        MOV R3, #0
+
+loop    ANDS R2, R5, #3
+        ADDEQ R0, R0, #1
+        ADDNE R1, R1, #1
+        CMP R2, #2
+        SUBGT R0, R0, #1
+        EORLE R1, R1, R5
+        MOVMI R3, #0
+        ORRCC R3, R3, #1
+        SUBS R5, R5, #1
+        BNE loop
+
+        SWI 2
@@ -10,12 +10,34 @@
  * @todo interrupt enable behaviour on exceptions (etc.)
  */
 
+#include <ctype.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
 #include <sys/poll.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include "jimulator.h"
+
+// Everything but Emulator's methods is private to this file
+namespace {
 
 #define uchar unsigned char
 #define uint unsigned int
@@ -56,6 +78,9 @@ typedef enum {
   BR_CONTINUE = 0x23,
   BR_RTF_SET = 0x24,
   BR_RTF_GET = 0x25,
+  BR_TRACE_GET = 0x26,
+  BR_STEP_BACK = 0x27,
+  BR_REVERSE = 0x28,
   BR_BP_WRITE = 0x30,
   BR_BP_READ = 0x31,
   BR_BP_SET = 0x32,
@@ -66,103 +91,89 @@ typedef enum {
   BR_WP_GET = 0x37,
 } BR_Instruction;
 
-#define NO_OF_BREAKPOINTS 32  // Max 32
-#define NO_OF_WATCHPOINTS 4   // Max 32
+// Max 32 each: the monitor's BR_BP_* and BR_WP_* commands give each a bit of a
+// 32-bit flag word, and Emulator shares the breakpoints' table
+#define NO_OF_BREAKPOINTS 32
+#define NO_OF_WATCHPOINTS 32
 #define RING_BUF_SIZE 64
 
+// Memory is held in ARM (little-endian) byte order; where the host agrees,
+// words and halfwords can be moved whole rather than assembled from bytes.
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define NATIVE_MEMORY
+#endif
+
 typedef struct {
   uint iHead;
   uint iTail;
   uchar buffer[RING_BUF_SIZE];
 } ringBuffer;
 
-struct pollfd pollfd;
-
-// Local prototypes
-
-void step();
-void comm(struct pollfd*);
-
-void emulSetup();
-void saveState(uchar);
-void initialise(uint, int);
-void execute(uint);
-
-// ARM execute
+/**
+ * @brief A predecoded instruction, as held in the decode cache. Fields which
+ * are irrelevant to the instruction's class are left zero.
+ */
+class Machine;
+typedef struct DecodedInstruction DecodedInstruction;
+typedef void (*InstructionHandler)(Machine*, DecodedInstruction*);
+
+struct DecodedInstruction {
+  uint tag;                    // Address | Thumb flag, or decodeInvalid
+  uint opCode;                 // As fetched (16 bits for Thumb)
+  InstructionHandler handler;  // Executes the instruction
+  uchar cond;                  // ARM condition field
+  bool always;                 // Executes regardless of condition (AL, BLX #)
+  bool aluOp;                  // Normal data processing (rather than MUL &c.)
+  uchar operation;             // ALU function code
+  uchar rn, rd, rm, rs;
+  uchar shiftType;             // 0-3 = LSL, LSR, ASR, ROR; 4 = RRX
+  uchar shiftDistance;         // Immediate shift distance, special cases done
+  bool immOperand;             // Operand 2 is `immediate'
+  bool regShift;               // Shift distance held in rs
+  bool setFlags;               // S-bit
+  signed char immCarry;        // Shifter carry out of `immediate'
+  uchar operand;               // Operand 2 form, for the data op. handlers
+  uint immediate;              // Rotated immediate / branch offset
+};
 
-void dataOp(uint);
-void clz(uint);
-void transfer(uint);
-void transferSBHW(uint);
-void multiple(uint);
-void branch(uint);
-void mySystem(uint);
-void undefined();
-void breakpoint();
+/**
+ * @brief A Thumb decode table entry: the handler for a class of op. codes and
+ * which fields to extract for it.
+ */
+typedef struct {
+  InstructionHandler handler;
+  uchar fields;  // One of the thumbFields... layouts
+} ThumbDecoding;
 
-void mrs(uint);
-void msr(uint);
-void bx(uint, int);
-void myMulti(uint);
-void swap(uint);
-void normalDataOp(uint, int);
-void ldm(int, int, int, bool, bool);
-void stm(int, int, int, bool, bool);
+/**
+ * @brief A basic block: a straight-line run of predecoded instructions, up to
+ * and including the first which may alter the flow of control.
+ */
+typedef struct BasicBlock BasicBlock;
+typedef uint (*CompiledBlock)(uchar*);  // Returns instructions executed
 
-int checkWatchpoints(uint, int, int, int);
-int transferOffset(int, int, int, bool);
+struct pollfd pollfd = {0, POLLIN, 0};  // Monitor commands on stdin
 
-int bReg(int, int*);
-int bImmediate(int, int*);
+// Local prototypes; those of the machine itself are in class Machine
 
-int bitCount(uint, int*);
-bool checkCC(int);
+void initTables();
+void initConditionTable();
+bool conditionPasses(uint, uint);
+void initThumbTable();
 
 constexpr const bool zf(const int);
 constexpr const bool cf(const int);
 constexpr const bool nf(const int);
 constexpr const bool vf(const int);
-
-void setFlags(int, int, int, int, int);
-void setNZ(uint);
-void setCF(uint, uint, int);
-void setVF_ADD(int, int, int);
-void setVF_SUB(int, int, int);
-int getRegister(int, int);
-/* Returns PC+4 for ARM & PC+2 for Thumb */
-int getRegisterMonitor(int, int);
-void putRegister(int, int, int);
 constexpr const int instructionLength(const int, const int);
 
-uint fetch();
-void incPC();
-void endianSwap(uint, uint);
-int readMemory(uint, int, bool, bool, int);
-void writeMemory(uint, int, int, bool, int);
-
-/* THUMB execute */
-void data0(uint);
-void data1(uint);
-void dataTransfer(uint);
-void transfer0(uint);
-void transfer1(uint);
-void spPC(uint);
-void lsmB(uint);
-void thumbBranch(uint);
-
-int loadFPE();
-void FPEInstall();
-
 int getNumber(char*);
+int isItSBHW(uint);
 int lsl(int, int, int*);
 int lsr(uint, int, int*);
 int asr(int, int, int*);
 int ror(uint, int, int*);
 
-uint getmem32(int);
-void setmem32(int, uint);
-void executeInstruction();
-
 int getChar(uchar*);
 int sendChar(uchar);
 int sendNBytes(int, int);
@@ -170,23 +181,93 @@ int getNBytes(int*, int);
 int getCharArray(int, uchar*);
 int sendCharArray(int, uchar*);
 
-void boardreset();
+bool parseCount(const char*, uint*);
+bool parseSize(const char*, unsigned long long*);
+bool parseMemSize(const char*, uint*);
+void usage(const char*);
+const char* batchReason(int);
+uint batchInstructions(int, uint);
+bool assemble(const char*, const char*, const char*);
+int runManifest(const char*, const char*, uint, uint);
+int printTrace(const char*, const char*);
 
 void initBuffer(ringBuffer*);
 int countBuffer(ringBuffer*);
 bool putBuffer(ringBuffer*, const uchar);
 bool getBuffer(ringBuffer*, uchar*);
 
-// Why add "RAMSIZE", and then get it wrong?!?!
-// Memory is modulo this to the monitor; excise and use the proper routines
-constexpr const uint memSize = 0X100000;       // 4 MB
-constexpr const uint RAMSIZE = 0X100000;       // 4 MB
-constexpr const uint reserved_mem = 0X002000;  // 32 KB
-constexpr const uint userStack = (memSize - reserved_mem) << 2;
+// Memory size in bytes, set with "--memory"; always 2^N. Addresses wrap
+// modulo this to the monitor, and beyond it are absent to the processor.
+constexpr const uint defaultMemSize = 0X00100000;  // 1 MB
+constexpr const uint minMemSize = 0X00010000;      // 64 KB
+constexpr const uint maxMemSize = 0X40000000;      // 1 GB
 constexpr const uint stackStringAddr = 0X00007000;  // ARM address
 
 constexpr const uint maxInstructions = 10000000;
 
+// Exit codes of a batch ("--batch") run
+constexpr const int batchHalted = 0;   // By the program (SWI 2)
+constexpr const int batchLimit = 1;    // Instruction limit reached
+constexpr const int batchNoInput = 2;  // Terminal input exhausted
+constexpr const int batchFailed = 3;   // Program could not be loaded
+constexpr const int batchDiverged = 4;  // Replayed input was not wanted then
+constexpr const uint pastSize = 0X100;  // Instruction history; must be 2^N
+
+// Execution traces ("--trace"); the version changes whenever the format does
+constexpr const uint traceMagic = 0X544D494A;  // "JIMT"
+constexpr const uint traceVersion = 1;
+constexpr const uint traceBufferSize = 0X100000;  // Bytes written at a time
+constexpr const uint traceBuffers = 4;
+constexpr const uint traceMaxRecord = 0X400;  // Bytes; more than any record
+constexpr const uint traceMaxAccesses = 32;   // Per instruction; LDM is 16
+constexpr const uint traceOpCodes = 0X400;    // Op. codes remembered; 2^N
+// Flags heading each record, saying what follows it
+constexpr const uchar traceJump = 0X01;     // Tag, if not the next in line
+constexpr const uchar traceOpCode = 0X02;   // Op. code, if not remembered
+constexpr const uchar traceWrites = 0X04;   // Registers written
+constexpr const uchar traceAccess = 0X08;   // Loads and stores
+constexpr const uchar traceStore = 0X08;    // In an access's size byte
+
+// Snapshots ("saveSnapshot"); the version changes whenever the layout does
+constexpr const uint snapshotMagic = 0X534D494A;  // "JIMS"
+constexpr const uint snapshotVersion = 3;
+constexpr const uint snapshotPageShift = 12;  // Memory is saved a page at a time
+constexpr const uint snapshotEnd = 0XFFFFFFFF;  // Follows the last page
+
+// Checkpoints for running backwards; pages as snapshots
+constexpr const uint defaultCheckpointInterval = 100000;  // Instructions
+constexpr const size_t defaultCheckpointBudget = 0X4000000;  // 64 MB
+
+/**
+ * @brief The cycles a core takes over each class of instruction, for the
+ * timing model (--timing). Each cost counts cycles of any sort - S, N or I.
+ */
+typedef struct {
+  const char* name;
+  uchar dataOp;           // Data processing, branches and anything not below
+  uchar shiftByRegister;  // ... more, shifting an operand by a register
+  uchar refill;           // More, for any instruction writing the PC
+  uchar multiply;         // MUL, as well as the multiplier's bytes
+  uchar multiplierByte;   // Per significant byte of the multiplier
+  uchar multiplyLong;     // ... more, for a 64 bit result
+  uchar accumulate;       // ... more, for MLA and MLAL
+  uchar load;             // LDR, LDRB, LDRH &c.
+  uchar store;            // STR, STRB, STRH
+  uchar loadMultiple;     // LDM, as well as the registers
+  uchar storeMultiple;    // STM, as well as the registers
+  uchar perRegister;      // Per register transferred by LDM or STM
+  uchar swap;             // SWP, SWPB
+  uchar skipped;          // Any instruction failing its condition
+} Timing;
+
+// From the cores' technical reference manuals, with no memory wait states
+constexpr const Timing timingProfiles[] = {
+    {"arm7tdmi", 1, 1, 2, 1, 1, 1, 1, 3, 2, 2, 1, 1, 4, 1},
+    {"arm9tdmi", 1, 1, 2, 1, 1, 1, 1, 1, 1, 0, 0, 1, 2, 1},
+};
+
+const Timing* findTiming(const char*);
+
 constexpr const uint nfMask = 0X80000000;
 constexpr const uint zfMask = 0X40000000;
 constexpr const uint cfMask = 0X20000000;
@@ -247,8 +328,25 @@ constexpr const int memSystem = 0;  // sources for memory read
 constexpr const int memInstruction = 1;
 constexpr const int memData = 2;
 
+constexpr const int flagNone = 0;  // Kinds of pending flag setting operation
 constexpr const int flagAdd = 1;
 constexpr const int flagSub = 2;
+constexpr const int flagLogical = 3;
+
+constexpr const int carryPrevious = -1;  // Shifter left the carry alone
+
+// Forms of data processing operand 2, each with its own handlers
+constexpr const uint operandImmediate = 0;
+constexpr const uint operandRegister = 1;  // Unshifted
+constexpr const uint operandLSL = 2;       // Shifted by an immediate ...
+constexpr const uint operandLSR = 3;
+constexpr const uint operandASR = 4;
+constexpr const uint operandROR = 5;
+constexpr const uint operandRRX = 6;
+constexpr const uint operandRegShift = 7;  // ... or by a register
+constexpr const uint operandForms = 8;
+
+extern InstructionHandler dataOpTable[16][operandForms][2];
 
 constexpr const uint userMode = 0x00000010;
 constexpr const uint fiqMode = 0x00000011;
@@ -268,6 +366,54 @@ constexpr const uint regUndef = 6;
 
 constexpr const uint REGSIZE = 65536;
 
+constexpr const uint decodeCacheSize = 0X4000;  // Entries; must be 2^N
+constexpr const uint decodeInvalid = 0XFFFFFFFF;  // Tag of an empty entry
+
+// Thumb op. codes are told apart by their top ten bits
+constexpr const uint thumbTableSize = 0X400;
+
+// Field layouts of Thumb op. codes, for decodeThumb
+constexpr const uchar thumbFieldsNone = 0;
+constexpr const uchar thumbFieldsShift = 1;      // Rd, Rm, 5-bit distance
+constexpr const uchar thumbFieldsAddSub = 2;     // Rd, Rn, Rm or 3-bit imm.
+constexpr const uchar thumbFieldsImm8 = 3;       // Rd (bits 10-8), 8-bit imm.
+constexpr const uchar thumbFieldsImm8Word = 4;   // As above, imm. * 4
+constexpr const uchar thumbFieldsLow = 5;        // Rd, Rn, Rm
+constexpr const uchar thumbFieldsAlu = 6;        // Rd, Rm (bits 5-3)
+constexpr const uchar thumbFieldsHigh = 7;       // Rd, Rm including H bits
+constexpr const uchar thumbFieldsImm5Word = 8;   // Rd, Rn, 5-bit offset * 4
+constexpr const uchar thumbFieldsImm5Half = 9;   // Rd, Rn, 5-bit offset * 2
+constexpr const uchar thumbFieldsImm5Byte = 10;  // Rd, Rn, 5-bit offset
+constexpr const uchar thumbFieldsSP = 11;        // Rd, SP, 8-bit offset * 4
+constexpr const uchar thumbFieldsAdjustSP = 12;  // Signed 7-bit offset * 4
+constexpr const uchar thumbFieldsPush = 13;      // Register list (+ LR)
+constexpr const uchar thumbFieldsPop = 14;       // Register list (+ PC)
+constexpr const uchar thumbFieldsMultiple = 15;  // Rn, register list
+constexpr const uchar thumbFieldsBranchCond = 16;  // Condition, offset
+constexpr const uchar thumbFieldsBranch = 17;      // 11-bit offset
+constexpr const uchar thumbFieldsBlPrefix = 18;    // Upper offset
+
+constexpr const uint blockCacheSize = 0X0800;  // Blocks; must be 2^N
+constexpr const uint maxBlockLength = 32;      // Instructions
+constexpr const uint blockBudget = 1024;  // Instructions run between polls
+constexpr const uint codeLineShift = 4;   // Words per code line = 2^N
+
+constexpr const uint jitThreshold = 16;       // Runs before a block is compiled
+constexpr const uint jitBufferSize = 0X400000;  // Bytes of generated code
+constexpr const uint jitMaxBlockCode = 0X4000;  // Worst case for one block
+
+struct BasicBlock {
+  uint tag;         // Start address | Thumb flag, or decodeInvalid
+  uint endAddress;  // Address following the last instruction
+  uint length;      // Number of instructions
+  BasicBlock* chain[2];  // Most recent successors, checked before lookup
+  uint chainNext;        // Which chain entry to replace next
+  uint executions;       // Counts up to jitThreshold
+  CompiledBlock jitCode;  // Native translation of the first jitLength
+  uint jitLength;         //  instructions, or NULL
+  DecodedInstruction instructions[maxBlockLength];
+};
+
 typedef struct {
   int state;
   uchar cond;
@@ -278,6 +424,25 @@ typedef struct {
   int dataB[2];
 } BreakElement;
 
+// Active breakpoints on a single address, hashed on that address
+typedef struct {
+  uint address;
+  uint set;  // One bit per breakpoint; an empty slot has none
+} BreakSlot;
+
+/**
+ * @brief An exit from compiled code, other than at the end of the block.
+ */
+typedef struct {
+  uint patch;  // Position of the rel32 jumping here
+  uint count;  // Instructions executed, including this one
+  bool setPC;  // Compiled code had not yet updated the PC
+  uint pc;
+} JitExit;
+
+constexpr const uint breakHashSize = 0X80;  // Slots; must be 2^N
+constexpr const uint watchPageShift = 12;   // Watchpoint filter granularity
+
 constexpr const uint WOTLEN_FEATURES = 1;
 constexpr const uint WOTLEN_MEM_SEGS = 1;
 constexpr const uint WOTLEN = (8 + 3 * WOTLEN_FEATURES + 8 * WOTLEN_MEM_SEGS);
@@ -301,76 +466,778 @@ uchar whatAreYou[] = {
     0x00,
     0x00,
     0x00,  // Memory segment address (W)
-    memSize & 0xFF,
-    (memSize >> 8) & 0xFF,  // Memory segment
-    (memSize >> 16) & 0xFF,
-    (memSize >> 24) & 0xFF};  //  length (W)
+    0x00,
+    0x00,  // Memory segment
+    0x00,
+    0x00};  //  length (W) - filled in by "main"
+
+// Configuration and the decode tables, shared by every Machine
+
+uint memSize = defaultMemSize;
+
+// Indexed by the top ten bits of a Thumb op. code
+ThumbDecoding thumbTable[thumbTableSize];
+
+bool jitEnabled;  // Machines compile hot blocks to native code (--jit)
+
+// Checkpoints kept for running backwards (--checkpoint-interval and
+// --checkpoint-memory); an interval of 0 keeps none
+uint checkpointInterval = defaultCheckpointInterval;
+size_t checkpointBudget = defaultCheckpointBudget;
+
+const Timing* coreTiming;  // Cycle costs of the core timed (--timing), or NULL
+
+// Whether each condition (first index) passes for each value of NZCV
+bool conditionTable[16][16];
+
+struct pollfd* SWIPoll = &pollfd;  // Lets SWI scan input - YUK!
+
+bool batchMode;  // Run headless (--batch): terminal is stdout & input
+
+/**
+ * @brief One program of a "--manifest" run, and how it went.
+ */
+typedef struct {
+  std::string program;       // .s or .kmd file
+  std::string input;         // Terminal input file; none if empty
+  std::string output;        // Terminal output file, named by "outputNames"
+  uint line = 0;             // Of the manifest
+  int result = batchFailed;  // batchHalted &c.
+  uint instructions = 0;
+  uint64_t cycles = 0;  // Estimated, if timed (--timing)
+  double seconds = 0;   // Wall time, including assembly
+} BatchJob;
 
-BreakElement breakpoints[NO_OF_BREAKPOINTS];
-BreakElement watchpoints[NO_OF_WATCHPOINTS];
+/**
+ * @brief The programs of a manifest, each as a snapshot of a machine just
+ * after loading it, shared by all threads so that a program run many times
+ * (with different input) is only assembled and loaded once. The first
+ * thread to want a program claims it in "loading"; any other wanting it
+ * meanwhile waits on "loadedOne" for its snapshot.
+ */
+typedef struct {
+  std::mutex lock;
+  std::condition_variable loadedOne;
+  std::map<std::string, std::string> snapshots;  // Keyed by program; empty
+                                                 // if it failed to load
+  std::set<std::string> loading;
+} LoadedPrograms;
+
+class Profiler;
+class Tracer;
+
+/**
+ * @brief A point in a run which can be returned to: the processor, and the
+ * memory pages written since the checkpoint before. The oldest checkpoint
+ * holds every page in use.
+ */
+typedef struct {
+  uint steps;             // stepsReset when taken
+  uint inputs;            // Characters of inputHistory read before it
+  std::string processor;  // As "processorFields"
+  std::map<uint, std::string> pages;  // Contents, by page number
+  size_t bytes;                       // Held by the above
+} Checkpoint;
 
-uint emulBPFlag[2];
-uint emulWPFlag[2];
+/**
+ * @brief The state of an emulated machine: the processor, its memory and the
+ * monitor's view of it (breakpoints, terminals and so on).
+ */
+struct MachineState {
+  BreakElement breakpoints[NO_OF_BREAKPOINTS];
+  BreakSlot breakHash[breakHashSize];
+  // Active breakpoints on ranges or masks, one bit each
+  uint breakRanges;
+  BreakElement watchpoints[NO_OF_WATCHPOINTS];
+
+  uint emulBPFlag[2];
+  uint emulWPFlag[2];
+
+  // One bit per page of the address space which an active watchpoint covers
+  uint watchPages[(0X100000000ULL >> watchPageShift) / 32];
+
+  // Reserved whole, but pages are only committed when touched
+  uchar* memory;
+
+  // Direct mapped on (PC >> 1); tagged with the address and the Thumb state
+  DecodedInstruction decodeCache[decodeCacheSize];
+
+  // Direct mapped on (start address >> 1), as above
+  BasicBlock blockCache[blockCacheSize];
+
+  // One bit per line of memory which holds code belonging to a cached block
+  uint* codeLines;
+  uint codeLineWords;  // Length of the above
+
+  // One bit per page of memory written since the last checkpoint
+  uint* dirtyPages;
+  uint dirtyPageWords;  // Length of the above, and of usedPages
+
+  // One bit per page written before that, since memory was last cleared; a
+  // page in neither is all zeros
+  uint* usedPages;
+
+  uint historyInterval;  // Instructions between checkpoints, or 0 for none
+  uint historySpacing;   // The same, doubled each time they are thinned
+  size_t historyBudget;  // Bytes the checkpoints may hold
+  size_t historyBytes;   // Bytes they do hold
+  uint nextCheckpoint;   // stepsReset at which to take the next
+  uint inputNext;     // Next inputHistory entry to be read
+  uint stepsReached;  // Furthest run before going back; output seen to here
+
+  uchar status, oldStatus;
+  // Number of left steps before halting (0 is infinite)
+  int stepsToGo;
+  uint stepsReset;  // Number of steps since last reset
+  uint64_t cycles;  // Estimated by the timing model since last reset
+  char runFlags;
+  uchar rtf;
+  bool breakpointEnable;   // Breakpoints will be checked
+  bool breakpointEnabled;  // Breakpoints will be checked now
+  bool runThroughBL;       // Treat BL as a single step
+  bool runThroughSWI;      // Treat SWI as a single step
+
+  bool jitActive;    // Compiling hot blocks: --jit, unless that has failed
+  uchar* jitBuffer;  // Code space, writable or executable but never both
+  uint jitUsed;      // Bytes of jitBuffer allocated
+
+  uint tubeAddress;
+
+  int r[16];  // Registers of the current mode
+  // Banked registers, while their mode is not the current one
+  int userR[7];
+  int fiqR[7];
+  int irqR[2];
+  int supR[2];
+  int abtR[2];
+  int underR[2];
+  uint cpsr;
+  uint spsr[32];  // Lots of wasted space - safe for any "mode"
+
+  // The last flag setting operation, if its N, Z, C & V are not yet in cpsr
+  int flagPending;  // flagNone, flagAdd, flagSub or flagLogical
+  uint flagA, flagB, flagResult;
+  // Carry in (add/sub) or shifter carry out (logical)
+  int flagCarry;
+
+  bool printOut;
+  // Used to determine when to finish a `stepped' subroutine, SWI, etc.
+  int runUntilPC, runUntilSP, runUntilMode;
+  uchar runUntilStatus;
+
+  uint exceptionPara[9];
+
+  int nextFileHandle;
+  FILE*(fileHandle[20]);
+
+  int count;
+
+  uint lastAddr;
+
+  int glob1, glob2;
+
+  uint pastOpcAddr[pastSize];  // Ring of fetched op. code addresses
+  uint pastOpcPtr;  // Fetches recorded; the ring index is modulo
+
+  // Thumb stuff
+  int PC;
+  int BLPrefix, BLAddress;
+  int ARMFlag;
+
+  FILE* batchInput;   // Terminal input in batch mode, or NULL
+  FILE* batchOutput;  // Terminal output in batch mode
+  bool batchInputEnded;  // Read past the end of batchInput
+
+  FILE* inputLog;     // Terminal input recorded (--record), or NULL
+  FILE* inputReplay;  // Terminal input replayed (--replay), or NULL
+  bool replayDiverged;  // Input was read at a different point from the log
+
+  Profiler* profiler;  // Counting executions (--profile), or NULL
+  Tracer* tracer;      // Recording executions (--trace), or NULL
+  const Timing* timing;  // Costs of the core timed, or NULL if not timed
+
+  bool inProcess;  // Driven through the Emulator interface, not the monitor
+  bool stalled;    // Waiting for terminal input; ends the time slice
+  bool waiting;    // Serving the monitor from within a SWI
+
+  ringBuffer terminal0Tx, terminal0Rx;
+  ringBuffer terminal1Tx, terminal1Rx;
+  ringBuffer* terminalTable[16][2];
+
+  JitExit jitExits[3 * maxBlockLength];  // Of the block being compiled
+  uint jitExitCount;
+};
+
+/**
+ * @brief An emulated machine. Each is independent of any other, so several
+ * may be run at once, on separate threads.
+ */
+class Machine : public MachineState {
+ public:
+  Machine();
+  ~Machine();
+
+  // An Emulator's terminal, in place of terminal0Rx and terminal0Tx
+  std::deque<uchar> terminalIn;
+  std::string terminalOut;
+
+  // Checkpoints, oldest first, and the terminal input read since the first,
+  // to run forwards again exactly
+  std::deque<Checkpoint> checkpoints;
+  std::vector<uchar> inputHistory;
+
+  void runBlocks();
+  uint executeBlock(BasicBlock*);
+  void step(DecodedInstruction*, bool);
+  uint instructionCycles(DecodedInstruction*);
+  uint thumbCycles(uint);
+  uint multiplyCycles(uint, bool);
+  void comm(struct pollfd*);
+
+  void emulSetup();
+  void saveState(uchar);
+  void initialise(uint, int);
+  void execute(DecodedInstruction*);
+
+  // Instruction decode
+
+  void decode(DecodedInstruction*, uint, bool);
+  void decodeARM(DecodedInstruction*, uint);
+  void decodeDataOp(DecodedInstruction*, uint);
+  void decodeThumb(DecodedInstruction*, uint);
+  void invalidateDecoded(uint);
+  void invalidateDecodedRange(uint, uint);
+  DecodedInstruction* lookupDecoded(uint, bool);
+  bool endsBlock(DecodedInstruction*, bool);
+  BasicBlock* lookupBlock(uint);
+  void buildBlock(BasicBlock*, uint);
+  void invalidateBlocks(uint);
+  void flushBlocks();
+
+  // x86-64 translation of hot blocks
+
+  uint runCompiled(BasicBlock*);
+  void jitCompile(BasicBlock*);
+  bool jitProtect(bool);
+  void jitReset();
+  void jitInterpret(DecodedInstruction*, uint);
+
+  // ARM execute
+
+  void clz(uint);
+  void transfer(uint);
+  void transferSBHW(uint);
+  void multiple(uint);
+  void branch(uint);
+  void mySystem(uint);
+  void undefined();
+  void breakpoint();
+
+  void mrs(uint);
+  void msr(uint);
+  void bx(uint, int);
+  void myMulti(uint);
+  void swap(uint);
+  void normalDataOp(DecodedInstruction*);
+  void armBranch(DecodedInstruction*);
+  void ldm(int, int, int, bool, bool);
+  void stm(int, int, int, bool, bool);
+
+  bool checkBreakpoint(uint, uint);
+  bool matchBreakpoint(int, uint, uint);
+  void indexBreakpoints();
+  int checkWatchpoints(uint, int, int, int);
+  void indexWatchpoints();
+  bool watchedPage(uint);
+  int rotatedWord(uint);
+  int transferOffset(int, int, int, bool);
+
+  int bReg(int, int*);
+  int bImmediate(int, int*);
+  int bDecoded(DecodedInstruction*, int*);
+
+  bool directTransfer(uint, int);
+  bool checkCC(int);
+
+  void setFlags(int, int, int, int, int);
+  void setNZ(uint);
+  void setLogicalFlags(uint, int);
+  uint evaluateFlags();
+  void resolveFlags();
+  int getRegister(int, int);
+  /* Returns PC+4 for ARM & PC+2 for Thumb */
+  int getRegisterMonitor(int, int);
+  void putRegister(int, int, int);
+  uint forcedMode(int);
+  int* bankedRegister(uint, int);
+  void writeCPSR(uint);
+
+  DecodedInstruction* fetch();
+  void recordFetch(uint);
+  void sendTrace(uint);
+  void incPC();
+  void endianSwap(uint, uint);
+  int readMemory(uint, int, bool, bool, int);
+  void writeMemory(uint, int, int, bool, int);
+
+  /* THUMB execute */
+  void thumbBranch1(uint, int);
+
+  uint getmem32(int);
+  void setmem32(int, uint);
+  uint getmem16(uint);
+  void setmem16(uint, uint);
+  void setmem8(uint, uint);
+  void executeInstruction(DecodedInstruction*, bool);
+
+  void boardreset();
+  void initMemory();
+
+  // Monitor
+
+  void monitor();
+  void monitorOptionsMisc(uchar);
+  void monitorMemory(uchar);
+  void monitorBreakpoints(uchar);
+  void startRunning(uchar, int);
+  void stopRunning();
+  void continueRunning();
+  void defineBreakpoint(uint);
+  void setBreakpointFlags(uint, uint);
+  uint getTrace(uint, uint*);
+
+  // Batch runs
+
+  bool loadKMD(const char*);
+  int runBatch(uint);
+  void resetMachine();
+  void runJob(BatchJob*, const char*, uint, LoadedPrograms*);
+
+  // Snapshots
+
+  template <typename Visit>
+  void snapshotFields(Visit);
+  template <typename Visit>
+  void processorFields(Visit);
+  bool pageInUse(uint);
+  void clearMemory();
+  void saveSnapshot(std::string*);
+  bool restoreSnapshot(const std::string&);
+
+  // Running backwards
+
+  void keepHistory(uint, size_t);
+  void forgetHistory();
+  void markDirty(uint);
+  void takeCheckpoint();
+  void restoreCheckpoint(uint);
+  void reExecute(uint, std::vector<uint>*);
+  void runTo(uint);
+  bool stepBack(uint);
+  bool reverseContinue();
+
+  // Instruction handlers, called through "handle"
+
+  void armMulti(DecodedInstruction*);
+  void armTransferSBHW(DecodedInstruction*);
+  void armSwap(DecodedInstruction*);
+  void armMrs(DecodedInstruction*);
+  void armMsr(DecodedInstruction*);
+  void armBx(DecodedInstruction*);
+  void armBreakpoint(DecodedInstruction*);
+  void armClz(DecodedInstruction*);
+  void armUndefined(DecodedInstruction*);
+  void armTransfer(DecodedInstruction*);
+  void armMultiple(DecodedInstruction*);
+  void armSystem(DecodedInstruction*);
+
+  template <uint form, bool carryOut>
+  inline int shifterOperand(DecodedInstruction*, int*);
+  template <uint operation, uint form, bool setsFlags>
+  void dataOp(DecodedInstruction*);
+
+  template <uint type>
+  void thumbShiftImm(DecodedInstruction*);
+  template <bool subtract, bool immediate>
+  void thumbAddSub(DecodedInstruction*);
+  template <uint operation>
+  void thumbImm8(DecodedInstruction*);
+  template <uint operation>
+  void thumbAlu(DecodedInstruction*);
+  void thumbHighAdd(DecodedInstruction*);
+  void thumbHighCmp(DecodedInstruction*);
+  void thumbHighMov(DecodedInstruction*);
+  void thumbBx(DecodedInstruction*);
+  void thumbLdrPC(DecodedInstruction*);
+  template <uint operation>
+  void thumbTransferReg(DecodedInstruction*);
+  template <bool load, int size>
+  void thumbTransferImm(DecodedInstruction*);
+  void thumbAddPC(DecodedInstruction*);
+  void thumbAddSP(DecodedInstruction*);
+  void thumbAdjustSP(DecodedInstruction*);
+  void thumbPush(DecodedInstruction*);
+  void thumbPop(DecodedInstruction*);
+  void thumbBreakpoint(DecodedInstruction*);
+  void thumbUndefined(DecodedInstruction*);
+  template <bool load>
+  void thumbMultiple(DecodedInstruction*);
+  void thumbBranchCond(DecodedInstruction*);
+  void thumbSwi(DecodedInstruction*);
+  void thumbBranch(DecodedInstruction*);
+  void thumbBlx(DecodedInstruction*);
+  void thumbBlPrefix(DecodedInstruction*);
+  void thumbBl(DecodedInstruction*);
+
+  bool swiCharacterPrint(char);
+  int swiDecimalPrint(uint);
+
+  // x86-64 code generation
+
+  void jitByte(uchar);
+  void jitWord(uint);
+  void jitPointer(void*);
+  void jitRex(int, int);
+  void jitAddress(int, void*);
+  void jitLoad(int, void*);
+  void jitStore(void*, int);
+  void jitStoreImmediate(void*, uint);
+  void jitCompareImmediate(void*, uint);
+  void jitMoveImmediate(int, uint);
+  void jitOp(uchar, int, int);
+  void jitGroup(uchar, int, int);
+  void jitOpImmediate(int, int, uint);
+  void jitShiftImmediate(int, int, int);
+  void jitBitTest(int, int);
+  void jitCarryIn();
+  void jitSet(uchar, int);
+  void jitZeroExtend(int);
+  void jitCall(void*);
+  uint jitJump(int);
+  void jitLink(uint, uint);
+  void jitLink(uint);
+  void jitReturn(uint, uint);
+  void jitExit(uint, uint, bool, uint);
+  void jitOperand(int, int, uint);
+  bool jitShift(int, int, int);
+  uint jitCondition(int);
+  void jitFoldFlag(int, int);
+  void jitWriteFlags(bool, int);
+  void jitDataOp(DecodedInstruction*, uint);
+  void jitCheck(BasicBlock*, bool, uint, bool, uint);
+  void jitTransfer(DecodedInstruction*, uint, BasicBlock*, uint);
+  void jitFallBack(DecodedInstruction*, uint, BasicBlock*, uint);
+  bool jitNative(DecodedInstruction*);
+};
 
-uchar memory[RAMSIZE];
+/**
+ * @brief Call an instruction handler, a member function, through the plain
+ * function pointer held in a DecodedInstruction.
+ * @param machine
+ * @param d
+ */
+template <void (Machine::*member)(DecodedInstruction*)>
+void handle(Machine* machine, DecodedInstruction* d) {
+  (machine->*member)(d);
+}
 
-uchar status, oldStatus;
-int stepsToGo;    // Number of left steps before halting (0 is infinite)
-uint stepsReset;  // Number of steps since last reset
-char runFlags;
-uchar rtf;
-bool breakpointEnable;   // Breakpoints will be checked
-bool breakpointEnabled;  // Breakpoints will be checked now
-bool runThroughBL;       // Treat BL as a single step
-bool runThroughSWI;      // Treat SWI as a single step
+#define HANDLER(...) handle<&Machine::__VA_ARGS__>
 
-uint tubeAddress;
+/**
+ * @brief Execution counts for "--profile": per instruction address, per basic
+ * block and per function. A function is entered by a call (BL or BLX) and
+ * left when its return address is fetched, however it gets there.
+ */
+class Profiler {
+ public:
+  Profiler();
+  ~Profiler();
+
+  void fetch(uint);
+  void unfetch(uint);
+  void enterBlock(uint);
+  void call(uint);
+  bool report(const char*, const char*);
+
+ private:
+  typedef struct {
+    uint function;       // Entry address
+    uint returnAddress;  // Fetching this leaves the function
+    uint64_t entered;    // Fetches before it was entered
+  } Frame;
+
+  typedef struct {
+    uint calls;
+    uint64_t exclusive;  // Fetches in the function itself
+    uint64_t inclusive;  // ... and in everything it called
+    uint active;         // Frames on the stack, if recursive
+  } FunctionCounts;
+
+  typedef struct {
+    uint calls;
+    uint64_t inclusive;
+  } ArcCounts;
+
+  uint* counts;       // Fetches of each halfword address
+  uint* blockCounts;  // Entries to a block starting at each halfword
+  uint64_t fetches;
+  uint64_t attributed;  // Fetches already charged to a stack, below
+  bool callPending;     // The last instruction was a call
+  uint pendingReturn;
+
+  std::vector<Frame> stack;
+  std::vector<uint> path;  // The functions on the stack, outermost first
+  std::map<uint, FunctionCounts> functions;
+  std::map<std::pair<uint, uint>, ArcCounts> arcs;  // Caller, callee
+  std::map<std::vector<uint>, uint64_t> folded;  // Exclusive, by stack
+
+  void enter(uint, uint);
+  void leave();
+  void attribute();
+};
 
-int r[16];
-int fiqR[7];
-int irqR[2];
-int supR[2];
-int abtR[2];
-int underR[2];
-uint cpsr;
-uint spsr[32];  // Lots of wasted space - safe for any "mode"
+/**
+ * @brief Records an execution trace for "--trace": for each instruction, its
+ * address and op. code, the registers it wrote and the loads and stores it
+ * made. Each record only holds what differs from what a reader could predict
+ * - the next address in line, the op. code last seen at that address and the
+ * registers unchanged - as variable length deltas. Full buffers are written
+ * out by a thread of their own.
+ */
+class Tracer {
+ public:
+  Tracer(FILE*, const int*, uint);
+  ~Tracer();
 
-bool printOut;
-int runUntilPC, runUntilSP, runUntilMode;  // Used to determine when
-uchar runUntilStatus;  //  to finish a `stepped' subroutine, SWI, etc.
+  void access(uint, uint, int, bool);
+  void record(uint, uint, const int*, uint);
 
-uint exceptionPara[9];
+ private:
+  typedef struct {
+    uint address;
+    uint value;
+    uchar size;  // Bytes, | traceStore
+  } Access;
 
-int nextFileHandle;
-FILE*(fileHandle[20]);
+  FILE* file;
+  std::thread writer;
+  std::mutex lock;
+  std::condition_variable changed;
+  std::vector<uchar*> empty;  // Buffers free to fill
+  std::deque<std::pair<uchar*, uint>> full;  // ... and awaiting the writer
+  bool finished;
 
-int count;
+  uchar* buffer;  // Being filled
+  uint used;
 
-uint lastAddr;
+  uint registers[16];  // As last recorded: r0-r14 and the CPSR
+  uint nextTag;        // Address | Thumb flag of the next in line
+  uint lastAccess;     // Address following the last load or store
+  uint opCodes[traceOpCodes][2];  // Tag, op. code; by tag
+  Access accesses[traceMaxAccesses];
+  uint accessCount;
 
-int glob1, glob2;
+  void putByte(uchar);
+  void putVarint(uint);
+  void putDelta(int);
+  void flush();
+  void write();
+};
 
-int pastOpcAddr[32];  // History buffer of fetched op. code addresses
-int pastSize;         // Used size of buffer
-int pastOpcPtr;       // Pointer into same
-int pastCount;        // Count of hits in instruction history
 
-// Thumb stuff
-int PC;
-int BLPrefix, BLAddress;
-int ARMFlag;
 
-struct pollfd* SWIPoll;  // Pointer to allow SWI to scan input - YUK!
+}  // namespace
 
-ringBuffer terminal0Tx, terminal0Rx;
-ringBuffer terminal1Tx, terminal1Rx;
-ringBuffer* terminalTable[16][2];
+#ifndef JIMULATOR_LIBRARY
 
 /**
  * @brief Program entry point.
  * @return int Exit code.
  */
 int main(int argc, char** argv) {
+  const char* batchFile = NULL;
+  const char* inputFile = NULL;
+  const char* manifest = NULL;
+  const char* profile = NULL;
+  const char* trace = NULL;
+  const char* readTrace = NULL;
+  const char* record = NULL;
+  const char* replay = NULL;
+  const char* timed = NULL;
+  uint limit = 0;
+  uint threads = std::thread::hardware_concurrency();
+  std::string aasm = argv[0];  // Assembler, by default beside jimulator
+
+  aasm = aasm.substr(0, aasm.find_last_of('/') + 1) + "aasm";
+
+  bool ok = true;
+
+  for (int i = 1; (i < argc) && ok; i++) {
+    if (strcmp(argv[i], "--jit") == 0) {
+      jitEnabled = true;
+    } else if ((strcmp(argv[i], "--memory") == 0) && (i + 1 < argc)) {
+      ok = parseMemSize(argv[++i], &memSize);
+    } else if ((strcmp(argv[i], "--batch") == 0) && (i + 1 < argc)) {
+      batchFile = argv[++i];
+    } else if ((strcmp(argv[i], "--input") == 0) && (i + 1 < argc)) {
+      inputFile = argv[++i];
+    } else if ((strcmp(argv[i], "--limit") == 0) && (i + 1 < argc)) {
+      ok = parseCount(argv[++i], &limit);
+    } else if ((strcmp(argv[i], "--manifest") == 0) && (i + 1 < argc)) {
+      manifest = argv[++i];
+    } else if ((strcmp(argv[i], "--threads") == 0) && (i + 1 < argc)) {
+      ok = parseCount(argv[++i], &threads) && (threads > 0);
+    } else if ((strcmp(argv[i], "--aasm") == 0) && (i + 1 < argc)) {
+      aasm = argv[++i];
+    } else if ((strcmp(argv[i], "--profile") == 0) && (i + 1 < argc)) {
+      profile = argv[++i];
+    } else if ((strcmp(argv[i], "--trace") == 0) && (i + 1 < argc)) {
+      trace = argv[++i];
+    } else if ((strcmp(argv[i], "--read-trace") == 0) && (i + 1 < argc)) {
+      readTrace = argv[++i];
+    } else if ((strcmp(argv[i], "--record") == 0) && (i + 1 < argc)) {
+      record = argv[++i];
+    } else if ((strcmp(argv[i], "--replay") == 0) && (i + 1 < argc)) {
+      replay = argv[++i];
+    } else if ((strcmp(argv[i], "--checkpoint-interval") == 0) &&
+               (i + 1 < argc)) {
+      ok = parseCount(argv[++i], &checkpointInterval);
+    } else if ((strcmp(argv[i], "--checkpoint-memory") == 0) &&
+               (i + 1 < argc)) {
+      unsigned long long budget;
+
+      ok = parseSize(argv[++i], &budget);
+      checkpointBudget = budget;
+    } else if ((strcmp(argv[i], "--timing") == 0) && (i + 1 < argc)) {
+      timed = argv[++i];
+    } else {
+      ok = false;  // Unknown, or wanting a value
+    }
+
+    if (!ok) {
+      fprintf(stderr, "Bad argument %s\n", argv[i]);
+    }
+  }
+
+  if (ok && (batchFile == NULL) &&
+      ((inputFile != NULL) || (replay != NULL) || (profile != NULL) ||
+       (trace != NULL))) {
+    fprintf(stderr, "--input, --replay, --profile and --trace need --batch\n");
+    ok = false;
+  }
+  if (!ok) {
+    usage(argv[0]);
+    return batchFailed;
+  }
+
+  initTables();
+
+  if (timed != NULL) {
+    coreTiming = findTiming(timed);
+
+    if (coreTiming == NULL) {
+      fprintf(stderr, "Unknown core %s; timed are:", timed);
+      for (const Timing& profile : timingProfiles) {
+        fprintf(stderr, " %s", profile.name);
+      }
+      fprintf(stderr, "\n");
+      return batchFailed;
+    }
+    jitEnabled = false;  // Compiled code is not timed
+  }
+
+  if (readTrace != NULL) {
+    return printTrace(readTrace, batchFile);
+  }
+
+  if (manifest != NULL) {
+    batchMode = true;
+    return runManifest(manifest, aasm.c_str(), limit, threads);
+  }
+
+  Machine* machine = new Machine();
+
+  if ((record != NULL) &&
+      ((machine->inputLog = fopen(record, "w")) == NULL)) {
+    fprintf(stderr, "Cannot write input record %s\n", record);
+    return batchFailed;
+  }
+
+  if (batchFile != NULL) {
+    batchMode = true;
+    machine->batchInput = (inputFile == NULL) ? stdin : fopen(inputFile, "r");
+    machine->batchOutput = stdout;
+
+    if (machine->batchInput == NULL) {
+      fprintf(stderr, "Cannot read input %s\n", inputFile);
+      return batchFailed;
+    }
+    if ((replay != NULL) &&
+        ((machine->inputReplay = fopen(replay, "r")) == NULL)) {
+      fprintf(stderr, "Cannot read input record %s\n", replay);
+      return batchFailed;
+    }
+    if (!machine->loadKMD(batchFile)) {
+      fprintf(stderr, "Cannot load %s\n", batchFile);
+      return batchFailed;
+    }
+
+    if (profile != NULL) {
+      machine->jitActive = false;  // Compiled code makes calls unseen
+      machine->profiler = new Profiler();
+    }
+    if (trace != NULL) {
+      FILE* file = fopen(trace, "w");
+
+      if (file == NULL) {
+        fprintf(stderr, "Cannot write trace %s\n", trace);
+        return batchFailed;
+      }
+      machine->jitActive = false;  // Only the interpreter records each one
+      machine->tracer = new Tracer(file, machine->r, machine->cpsr);
+    }
+
+    int result = machine->runBatch(limit);
+    fprintf(stderr, "%s after %u instructions", batchReason(result),
+            batchInstructions(result, machine->stepsReset));
+    if (machine->timing != NULL) {
+      fprintf(stderr, ", %" PRIu64 " %s cycles", machine->cycles,
+              machine->timing->name);
+    }
+    fprintf(stderr, "\n");
+    delete machine->tracer;  // Waits for the trace to be written
+
+    if ((profile != NULL) && !machine->profiler->report(batchFile, profile)) {
+      fprintf(stderr, "Cannot write profile %s\n", profile);
+    }
+    return result;
+  }
+
+  machine->keepHistory(checkpointInterval, checkpointBudget);
+  machine->monitor();
+
+  return 0;
+}
+
+#endif
+
+namespace {
+
+/**
+ * @brief Build the tables shared by every Machine, once memSize is settled.
+ */
+void initTables() {
+  for (int i = 0; i < 4; i++) {  // Report the real segment length
+    whatAreYou[WOTLEN - 4 + i] = (memSize >> (8 * i)) & 0xFF;
+  }
+  initConditionTable();
+  initThumbTable();
+}
+
+/**
+ * @brief Set up a machine, with its memory reserved, ready to load.
+ */
+Machine::Machine() : MachineState() {  // Zero filled, as if static
   for (int i = 0; i < 16; i++) {
     terminalTable[i][0] = NULL;
     terminalTable[i][1] = NULL;
@@ -385,769 +1252,4287 @@ int main(int argc, char** argv) {
   terminalTable[1][0] = &terminal1Tx;
   terminalTable[1][1] = &terminal1Rx;
 
-  pollfd.fd = 0;
-  pollfd.events = POLLIN;
-  SWIPoll = &pollfd;  // Grubby pass to "mySystem"
-
-  emulSetup();
-
   emulBPFlag[0] = 0;
   if (NO_OF_BREAKPOINTS == 0) {
     emulBPFlag[1] = 0x00000000;  // C work around
   } else {
-    emulBPFlag[1] = (1 << NO_OF_WATCHPOINTS) - 1;
+    emulBPFlag[1] = 0XFFFFFFFF >> (32 - NO_OF_BREAKPOINTS);
   }
 
   emulWPFlag[0] = 0;
   if (NO_OF_WATCHPOINTS == 0) {
     emulWPFlag[1] = 0x00000000;  // C work around
   } else {
-    emulWPFlag[1] = (1 << NO_OF_WATCHPOINTS) - 1;
+    emulWPFlag[1] = 0XFFFFFFFF >> (32 - NO_OF_WATCHPOINTS);
+  }
+
+  timing = coreTiming;
+  jitActive = jitEnabled;
+  initMemory();
+  emulSetup();
+}
+
+/**
+ * @brief Release the machine's memory and any code compiled for it.
+ */
+Machine::~Machine() {
+  munmap(memory, memSize);
+  if (inputLog != NULL) {
+    fclose(inputLog);
   }
+  if (jitBuffer != NULL) {
+    munmap(jitBuffer, jitBufferSize);
+  }
+  free(codeLines);
+  free(dirtyPages);
+  free(usedPages);
+}
 
+/**
+ * @brief Serve the monitor (over stdin/stdout) until killed.
+ */
+void Machine::monitor() {
   while (true) {
     comm(&pollfd);  // Check for monitor command
     if ((status & CLIENT_STATE_CLASS_MASK) == CLIENT_STATE_CLASS_RUNNING) {
-      step();  // Step emulator as required
+      runBlocks();  // Step emulator as required
     } else {
       poll(&pollfd, 1, -1);  // If not running, deschedule until command arrives
     }
   }
-
-  return 0;
 }
 
 /**
- * @brief
+ * @brief Load a .kmd listing straight into memory, as kcmd would over the
+ * monitor. Each record is an address, a colon and up to four hex data fields,
+ * sized by their number of digits, before a ';' and the source text. Other
+ * records - the header and symbols - carry no data.
+ * @param fileName
+ * @return true if the file could be read and held some data.
  */
-void step() {
-  oldStatus = status;
-  executeInstruction();
+bool Machine::loadKMD(const char* fileName) {
+  FILE* file = fopen(fileName, "r");
+  char line[0X100];
+  bool loaded = false;
 
-  // Still running - i.e. no breakpoint (etc.) found
-  if ((status & CLIENT_STATE_CLASS_MASK) == CLIENT_STATE_CLASS_RUNNING) {
-    // don't count the instructions from now
-    if (status == CLIENT_STATE_RUNNING_SWI) {
-      if ((getRegisterMonitor(15, regCurrent) == runUntilPC) &&
-          (getRegisterMonitor(13, regCurrent) == runUntilSP) &&
-          ((getRegisterMonitor(16, regCurrent) & 0x3F) == runUntilMode)) {
-        status = runUntilStatus;
+  if (file == NULL) {
+    return false;
+  }
+
+  while (fgets(line, sizeof(line), file) != NULL) {
+    if (strchr(line, '\n') == NULL) {  // Discard the rest of a long line
+      int c;
+      while (((c = getc(file)) != '\n') && (c != EOF)) {
       }
-    }  // This can have changed status - hence no "else" below`
+    }
 
-    // OR _BL
-    if (status != CLIENT_STATE_RUNNING_SWI) {
-      // Count steps unless inside routine
-      stepsReset++;
+    char* text = strchr(line, ';');
+    if (text != NULL) {
+      *text = '\0';  // Data fields precede the source text
+    }
 
-      // Stepping
-      if (stepsToGo > 0) {
-        stepsToGo--;  // If -decremented- to reach zero, stop
-        if (stepsToGo == 0) {
-          status = CLIENT_STATE_STOPPED;
-        }
+    char* end;
+    uint address = strtoul(line, &end, 16);
+    if ((end == line) || (*end != ':')) {
+      continue;  // Not a source line record
+    }
+
+    for (text = end + 1;; text = end) {
+      uint value = strtoul(text, &end, 16);
+      int digits = end - text - strspn(text, " \t");
+
+      if (end == text) {
+        break;
+      }
+
+      int size = 1;  // Bytes, rounded up to 2^N and clipped at 32 bits
+      while ((size < 4) && (2 * size < digits)) {
+        size = size << 1;
       }
+
+      for (int i = 0; i < size; i++) {  // Little endian, as the monitor
+        markDirty((address & (memSize - 1)) >> 2);
+        memory[address++ & (memSize - 1)] = (value >> (8 * i)) & 0XFF;
+      }
+      loaded = true;
     }
   }
 
-  if ((status & CLIENT_STATE_CLASS_MASK) != CLIENT_STATE_CLASS_RUNNING) {
-    breakpointEnabled = false;  // No longer running - allow "continue"
+  fclose(file);
+  return loaded;
+}
+
+/**
+ * @brief Run the loaded program headless, with terminal output straight to
+ * batchOutput and input from batchInput, until it halts, needs input which is
+ * not there or has executed the given number of instructions.
+ * @param limit Instructions to execute, or 0 for no limit.
+ * @return int The exit code: batchHalted, batchLimit, batchNoInput or
+ * batchDiverged.
+ */
+int Machine::runBatch(uint limit) {
+  stalled = false;
+  stepsToGo = limit;
+  status = (limit == 0) ? CLIENT_STATE_RUNNING : CLIENT_STATE_STEPPING;
+
+  while ((status & CLIENT_STATE_CLASS_MASK) == CLIENT_STATE_CLASS_RUNNING) {
+    runBlocks();
+  }
+  fflush(batchOutput);
+
+  if (status == CLIENT_STATE_BYPROG) {
+    return batchHalted;
+  } else if (batchInputEnded) {
+    return batchNoInput;
+  } else if (replayDiverged) {
+    return batchDiverged;
   }
+  return batchLimit;
 }
 
 /**
  * @brief
- * @param command
+ * @param result A batch run's exit code.
+ * @return const char* Its description.
  */
-void monitorOptionsMisc(uchar command) {
-  uchar tempchar;
-  int temp;
-  switch (command & 0x3F) {
-    case BR_NOP:
-      break;
-    case BR_PING:
-      if (write(1, "OK00", 4) < 0) {
-        std::cout << "Some error occurred!" << std::endl;
-      }
-      break;
-    case BR_WOT_R_U:
-      sendCharArray(whatAreYou[0], &whatAreYou[1]);
-      break;
+const char* batchReason(int result) {
+  switch (result) {
+    case batchHalted:
+      return "Halted";
+    case batchLimit:
+      return "Instruction limit reached";
+    case batchNoInput:
+      return "Out of input";
+    case batchDiverged:
+      return "Replay diverged";
+    default:
+      return "Not loaded";
+  }
+}
 
-    case BR_RESET:
-      boardreset();
-      break;
+/**
+ * @brief The instructions a batch run executed, as profiles and traces count
+ * them: the monitor's count, which leaves out the SWI that halted the
+ * program, and that SWI.
+ * @param result The run's exit code.
+ * @param steps stepsReset at its end.
+ * @return uint
+ */
+uint batchInstructions(int result, uint steps) {
+  return (result == batchHalted) ? steps + 1 : steps;
+}
 
-    case BR_RTF_GET:
-      sendChar(rtf);
-      break;
+/**
+ * @brief Find the cycle costs of a core, by name (as "arm7tdmi").
+ * @param name
+ * @return const Timing* NULL if the core is not known.
+ */
+const Timing* findTiming(const char* name) {
+  for (const Timing& profile : timingProfiles) {
+    if (strcasecmp(profile.name, name) == 0) {
+      return &profile;
+    }
+  }
+  return NULL;
+}
 
-    case BR_RTF_SET:
-      getChar(&rtf);
-      break;
+/**
+ * @brief Return this thread's machine to its state at start-up, ready for
+ * another batch program.
+ */
+void Machine::resetMachine() {
+  clearMemory();
+
+  memset(r, 0, sizeof(r));
+  memset(userR, 0, sizeof(userR));
+  memset(fiqR, 0, sizeof(fiqR));
+  memset(irqR, 0, sizeof(irqR));
+  memset(supR, 0, sizeof(supR));
+  memset(abtR, 0, sizeof(abtR));
+  memset(underR, 0, sizeof(underR));
+  memset(spsr, 0, sizeof(spsr));
 
-    case BR_WOT_U_DO:
-      sendChar(status);
-      sendNBytes(stepsToGo, 4);
-      sendNBytes(stepsReset, 4);
-      break;
+  stepsReset = 0;
+  cycles = 0;
+  batchInputEnded = false;
+  replayDiverged = false;
+  forgetHistory();
+  emulSetup();
+}
 
-    case BR_PAUSE:
-    case BR_STOP:
-      if ((status & CLIENT_STATE_CLASS_MASK) == CLIENT_STATE_CLASS_RUNNING) {
-        oldStatus = status;
-        status = CLIENT_STATE_STOPPED;
-      }
-      break;
+/**
+ * @brief Visit each part of the machine's state which a snapshot holds, in
+ * snapshot order. Caches and indices derived from these are rebuilt on
+ * restoring instead; host files and the memory itself are not visited.
+ * @param visit Called with each field.
+ */
+template <typename Visit>
+void Machine::snapshotFields(Visit visit) {
+  visit(breakpoints);
+  visit(watchpoints);
+  visit(emulBPFlag);
+  visit(emulWPFlag);
+
+  visit(oldStatus);
+  visit(stepsToGo);
+  visit(runFlags);
+  visit(rtf);
+  visit(breakpointEnable);
+  visit(breakpointEnabled);
+  visit(tubeAddress);
+  visit(printOut);
+
+  processorFields(visit);
+
+  visit(batchInputEnded);
+  visit(terminal0Tx);
+  visit(terminal0Rx);
+  visit(terminal1Tx);
+  visit(terminal1Rx);
+}
 
-    case BR_CONTINUE:
-      if (((status & CLIENT_STATE_CLASS_MASK) == CLIENT_STATE_CLASS_STOPPED) &&
-          (status != CLIENT_STATE_BYPROG))  // Only act if already stopped
-        if ((oldStatus = CLIENT_STATE_STEPPING) || (stepsToGo != 0))
-          status = oldStatus;
-      break;
+/**
+ * @brief Visit the state of the processor, and of the run counting its
+ * instructions, as a checkpoint holds it: not what the monitor has set up,
+ * such as breakpoints, nor the terminals.
+ * @param visit Called with each field.
+ */
+template <typename Visit>
+void Machine::processorFields(Visit visit) {
+  visit(status);
+  visit(stepsReset);
+  visit(cycles);
+  visit(runThroughBL);
+  visit(runThroughSWI);
+  visit(runUntilPC);
+  visit(runUntilSP);
+  visit(runUntilMode);
+  visit(runUntilStatus);
+
+  visit(r);
+  visit(userR);
+  visit(fiqR);
+  visit(irqR);
+  visit(supR);
+  visit(abtR);
+  visit(underR);
+  visit(cpsr);
+  visit(spsr);
+  visit(flagPending);
+  visit(flagA);
+  visit(flagB);
+  visit(flagResult);
+  visit(flagCarry);
+
+  visit(exceptionPara);
+  visit(count);
+  visit(lastAddr);
+  visit(glob1);
+  visit(glob2);
+  visit(pastOpcAddr);
+  visit(pastOpcPtr);
+  visit(PC);
+  visit(BLPrefix);
+  visit(BLAddress);
+  visit(ARMFlag);
+}
 
-    case BR_BP_GET:
-      sendNBytes(emulBPFlag[0], 4);
-      sendNBytes(emulBPFlag[1], 4);
-      break;
+/**
+ * @brief Whether a page of memory holds anything other than zeros.
+ * @param page
+ */
+bool Machine::pageInUse(uint page) {
+  const uint64_t* words = (uint64_t*)&memory[page << snapshotPageShift];
+  uint64_t any = 0;
 
-    case BR_BP_SET: {
-      int data[2];
-      getNBytes(&data[0], 4);
-      getNBytes(&data[1], 4);
-      /* Note ordering to avoid temporary variable */
-      emulBPFlag[1] = (~emulBPFlag[0] & emulBPFlag[1]) |
-                      (emulBPFlag[0] & ((emulBPFlag[1] & ~data[0]) | data[1]));
-      emulBPFlag[0] = emulBPFlag[0] & (data[0] | ~data[1]);
-    } break;
+  for (uint i = 0; i < (1 << snapshotPageShift) / sizeof(uint64_t); i++) {
+    any |= words[i];
+  }
+  return any != 0;
+}
 
-    case BR_BP_READ:
-      getChar(&tempchar);
-      temp = tempchar;
-      sendChar(breakpoints[temp].cond);
-      sendChar(breakpoints[temp].size);
-      sendNBytes(breakpoints[temp].addrA, 4);
-      sendNBytes(breakpoints[temp].addrB, 4);
-      sendNBytes(breakpoints[temp].dataA[0], 4);
+/**
+ * @brief Zero fill memory again, returning the pages written since it was
+ * last cleared to the host in runs. Pages never written are left alone, so
+ * this costs the pages in use rather than the size of memory.
+ */
+void Machine::clearMemory() {
+  uint first = 0;
+  uint length = 0;  // Of the run of written pages from "first"
+  auto release = [&]() {
+    if (length != 0) {
+      madvise(&memory[first << snapshotPageShift], length << snapshotPageShift,
+              MADV_DONTNEED);
+    }
+  };
+
+  for (uint word = 0; word < dirtyPageWords; word++) {
+    for (uint bits = dirtyPages[word] | usedPages[word]; bits != 0;
+         bits &= bits - 1) {
+      uint page = 32 * word + __builtin_ctz(bits);
+
+      if (page != first + length) {
+        release();
+        first = page;
+        length = 0;
+      }
+      length++;
+    }
+    dirtyPages[word] = 0;
+    usedPages[word] = 0;
+  }
+  release();
+}
+
+/**
+ * @brief Append a word to a snapshot.
+ * @param blob
+ * @param word
+ */
+void putSnapshotWord(std::string* blob, uint word) {
+  blob->append((const char*)&word, sizeof(word));
+}
+
+/**
+ * @brief Read a word of a snapshot, if there is one.
+ * @param blob
+ * @param at Position, advanced past the word.
+ * @param word
+ * @return bool false if the snapshot has ended.
+ */
+bool getSnapshotWord(const std::string& blob, size_t* at, uint* word) {
+  if (blob.size() - *at < sizeof(*word)) {
+    return false;
+  }
+  memcpy(word, blob.data() + *at, sizeof(*word));
+  *at += sizeof(*word);
+  return true;
+}
+
+/**
+ * @brief Capture the whole machine - registers of every mode, breakpoints and
+ * watchpoints, terminals, counts and memory - as a binary blob. Only memory
+ * pages written since it was cleared, and not all zero, are saved, so the
+ * blob - and the time taken - is about the size of the program loaded,
+ * whatever the size of memory.
+ * @param blob Replaced by the snapshot.
+ */
+void Machine::saveSnapshot(std::string* blob) {
+  const uint pageSize = 1 << snapshotPageShift;
+  std::string terminal(terminalIn.begin(), terminalIn.end());
+
+  blob->clear();
+  putSnapshotWord(blob, snapshotMagic);
+  putSnapshotWord(blob, snapshotVersion);
+  putSnapshotWord(blob, memSize);
+
+  snapshotFields([&](auto& field) {
+    blob->append((const char*)&field, sizeof(field));
+  });
+
+  putSnapshotWord(blob, terminal.size());  // An Emulator's terminal
+  blob->append(terminal);
+  putSnapshotWord(blob, terminalOut.size());
+  blob->append(terminalOut);
+
+  for (uint word = 0; word < dirtyPageWords; word++) {
+    for (uint bits = dirtyPages[word] | usedPages[word]; bits != 0;
+         bits &= bits - 1) {
+      uint page = 32 * word + __builtin_ctz(bits);
+
+      if (pageInUse(page)) {
+        putSnapshotWord(blob, page);
+        blob->append((const char*)&memory[page << snapshotPageShift],
+                     pageSize);
+      }
+    }
+  }
+  putSnapshotWord(blob, snapshotEnd);
+}
+
+/**
+ * @brief Return the machine to the state captured by "saveSnapshot". The
+ * pages in use are cleared and only the saved pages copied back, so this costs
+ * little more than the pages in use. Nothing is changed if the snapshot is
+ * malformed or was taken with a different memory size.
+ * @param blob
+ * @return bool Whether it was restored.
+ */
+bool Machine::restoreSnapshot(const std::string& blob) {
+  const uint pageSize = 1 << snapshotPageShift;
+  size_t fixed = 0;
+  size_t at = 0;
+  uint magic, version, size, length[2], page;
+
+  snapshotFields([&](auto& field) { fixed += sizeof(field); });
+
+  // Check the whole blob before altering anything
+  if (!getSnapshotWord(blob, &at, &magic) ||
+      !getSnapshotWord(blob, &at, &version) ||
+      !getSnapshotWord(blob, &at, &size) || (magic != snapshotMagic) ||
+      (version != snapshotVersion) || (size != memSize) ||
+      (blob.size() - at < fixed)) {
+    return false;
+  }
+  size_t fields = at;
+  at += fixed;
+
+  for (int i = 0; i < 2; i++) {
+    if (!getSnapshotWord(blob, &at, &length[i]) ||
+        (blob.size() - at < length[i])) {
+      return false;
+    }
+    at += length[i];
+  }
+  size_t pages = at;
+
+  do {
+    if (!getSnapshotWord(blob, &at, &page)) {
+      return false;
+    }
+    if (page != snapshotEnd) {
+      if ((page >= memSize >> snapshotPageShift) ||
+          (blob.size() - at < pageSize)) {
+        return false;
+      }
+      at += pageSize;
+    }
+  } while (page != snapshotEnd);
+
+  at = fields;
+  snapshotFields([&](auto& field) {
+    memcpy(&field, blob.data() + at, sizeof(field));
+    at += sizeof(field);
+  });
+
+  at += sizeof(uint);
+  terminalIn.assign(blob.begin() + at, blob.begin() + at + length[0]);
+  at += length[0] + sizeof(uint);
+  terminalOut.assign(blob, at, length[1]);
+
+  clearMemory();
+  for (at = pages; getSnapshotWord(blob, &at, &page) && (page != snapshotEnd);
+       at += pageSize) {
+    memcpy(&memory[page << snapshotPageShift], blob.data() + at, pageSize);
+    usedPages[page >> 5] |= 1 << (page & 31);
+  }
+
+  stalled = false;
+  forgetHistory();
+  indexBreakpoints();
+  indexWatchpoints();
+  for (uint i = 0; i < decodeCacheSize; i++) {
+    decodeCache[i].tag = decodeInvalid;
+  }
+  flushBlocks();
+  jitReset();
+  return true;
+}
+
+/**
+ * @brief Keep checkpoints from the next run on, so that it can be run
+ * backwards.
+ * @param interval Instructions between checkpoints; 0 keeps none.
+ * @param budget Bytes the checkpoints may hold; they are thinned to fit.
+ */
+void Machine::keepHistory(uint interval, size_t budget) {
+  historyInterval = interval;
+  historyBudget = budget;
+  forgetHistory();
+}
+
+/**
+ * @brief Discard the checkpoints, as the machine has been changed other than
+ * by running. The next run starts from a full checkpoint again.
+ */
+void Machine::forgetHistory() {
+  checkpoints.clear();
+  inputHistory.clear();
+  historyBytes = 0;
+  historySpacing = historyInterval;
+  nextCheckpoint = 0;
+  inputNext = 0;
+  stepsReached = 0;
+}
+
+/**
+ * @brief Note that the page holding a word has been written.
+ * @param number The word address.
+ */
+inline void Machine::markDirty(uint number) {
+  uint page = number >> (snapshotPageShift - 2);
+
+  dirtyPages[page >> 5] |= 1 << (page & 31);
+}
+
+/**
+ * @brief Checkpoint the processor and the pages written since the last
+ * checkpoint; the first holds every page in use, of those ever written since
+ * memory was cleared. While over budget every other checkpoint is folded
+ * into the next, keeping the first and the last, so the history reaches as far
+ * back as before with twice the spacing; later ones are taken that far apart.
+ */
+void Machine::takeCheckpoint() {
+  const uint pageSize = 1 << snapshotPageShift;
+  bool first = checkpoints.empty();
+
+  checkpoints.emplace_back();
+  Checkpoint* checkpoint = &checkpoints.back();
+
+  checkpoint->steps = stepsReset;
+  checkpoint->inputs = inputNext;
+  processorFields([&](auto& field) {
+    checkpoint->processor.append((const char*)&field, sizeof(field));
+  });
+
+  for (uint word = 0; word < dirtyPageWords; word++) {
+    uint bits = dirtyPages[word] | (first ? usedPages[word] : 0);
+
+    for (; bits != 0; bits &= bits - 1) {
+      uint page = 32 * word + __builtin_ctz(bits);
+
+      if (!first || pageInUse(page)) {
+        checkpoint->pages[page].assign(
+            (const char*)&memory[page << snapshotPageShift], pageSize);
+      }
+    }
+    usedPages[word] |= dirtyPages[word];
+    dirtyPages[word] = 0;
+  }
+  checkpoint->bytes =
+      checkpoint->processor.size() + checkpoint->pages.size() * pageSize;
+  historyBytes += checkpoint->bytes;
+
+  while ((historyBytes > historyBudget) && (checkpoints.size() > 2)) {
+    std::deque<Checkpoint> thinned;
+
+    for (uint i = 0; i < checkpoints.size(); i++) {
+      if ((i % 2 == 1) && (i + 1 < checkpoints.size())) {
+        Checkpoint* dropped = &checkpoints[i];
+        Checkpoint* next = &checkpoints[i + 1];
+
+        historyBytes -= dropped->bytes + next->bytes;
+        next->pages.insert(dropped->pages.begin(),
+                           dropped->pages.end());  // Older
+        next->bytes = next->processor.size() + next->pages.size() * pageSize;
+        historyBytes += next->bytes;
+      } else {
+        thinned.push_back(std::move(checkpoints[i]));
+      }
+    }
+    checkpoints.swap(thinned);
+    if (historySpacing < 0X80000000) {
+      historySpacing *= 2;
+    }
+  }
+  nextCheckpoint = stepsReset + historySpacing;
+}
+
+/**
+ * @brief Return the processor and memory to a checkpoint. Only pages written
+ * since are copied back, from the latest copy at or before the checkpoint -
+ * or zeroed, if it has none. They stay marked as written, being different
+ * from the last checkpoint's.
+ * @param index Into checkpoints.
+ */
+void Machine::restoreCheckpoint(uint index) {
+  const uint pageSize = 1 << snapshotPageShift;
+  const Checkpoint* checkpoint = &checkpoints[index];
+
+  for (uint i = index + 1; i < checkpoints.size(); i++) {
+    for (auto& page : checkpoints[i].pages) {
+      markDirty(page.first << (snapshotPageShift - 2));
+    }
+  }
+
+  for (uint word = 0; word < dirtyPageWords; word++) {
+    for (uint bits = dirtyPages[word]; bits != 0; bits &= bits - 1) {
+      uint page = 32 * word + __builtin_ctz(bits);
+      const std::string* copy = NULL;
+
+      for (int i = index; (i >= 0) && (copy == NULL); i--) {
+        auto found = checkpoints[i].pages.find(page);
+
+        if (found != checkpoints[i].pages.end()) {
+          copy = &found->second;
+        }
+      }
+      if (copy != NULL) {
+        memcpy(&memory[page << snapshotPageShift], copy->data(), pageSize);
+      } else {
+        memset(&memory[page << snapshotPageShift], 0, pageSize);
+      }
+    }
+  }
+
+  size_t at = 0;
+  processorFields([&](auto& field) {
+    memcpy(&field, checkpoint->processor.data() + at, sizeof(field));
+    at += sizeof(field);
+  });
+  inputNext = checkpoint->inputs;
+  stalled = false;
+
+  for (uint i = 0; i < decodeCacheSize; i++) {
+    decodeCache[i].tag = decodeInvalid;
+  }
+  flushBlocks();
+  jitReset();
+}
+
+/**
+ * @brief Run forwards again from a restored checkpoint, as the run was then,
+ * until "end" instructions have been counted. Leaves the machine stopped.
+ * @param end The stepsReset to stop at.
+ * @param hits If not NULL, check breakpoints, noting the stepsReset at each
+ * one hit and carrying on past it.
+ */
+void Machine::reExecute(uint end, std::vector<uint>* hits) {
+  bool enable = breakpointEnable;
+
+  breakpointEnable = breakpointEnabled = (hits != NULL);
+  stepsToGo = end - stepsReset;
+  if (stepsToGo == 0) {
+    status = CLIENT_STATE_STOPPED;
+  }
+
+  while (((status & CLIENT_STATE_CLASS_MASK) == CLIENT_STATE_CLASS_RUNNING) &&
+         !stalled) {
+    runBlocks();
+    if (status == CLIENT_STATE_BREAKPOINT) {
+      hits->push_back(stepsReset);
+      status = oldStatus;
+    }
+  }
+
+  if ((status & CLIENT_STATE_CLASS_MASK) == CLIENT_STATE_CLASS_RUNNING) {
+    status = CLIENT_STATE_STOPPED;
+  }
+  breakpointEnable = enable;
+  breakpointEnabled = false;  // Allow "continue" from here
+  stepsToGo = 0;
+}
+
+/**
+ * @brief Return to the point at which "target" instructions had been counted,
+ * from the nearest checkpoint before it.
+ * @param target
+ */
+void Machine::runTo(uint target) {
+  uint index = 0;
+
+  while ((index + 1 < checkpoints.size()) &&
+         (checkpoints[index + 1].steps < target)) {
+    index++;
+  }
+  restoreCheckpoint(index);
+  reExecute(target, NULL);
+}
+
+/**
+ * @brief Go back a number of instructions, or as far as the checkpoints
+ * reach. Output is not repeated and input comes from what was read before,
+ * until the run passes the furthest point reached.
+ * @param steps
+ * @return bool false if there is no history or the machine is running.
+ */
+bool Machine::stepBack(uint steps) {
+  if (checkpoints.empty() || waiting ||
+      ((status & CLIENT_STATE_CLASS_MASK) == CLIENT_STATE_CLASS_RUNNING)) {
+    return false;
+  }
+  stepsReached = std::max(stepsReached, stepsReset);
+
+  uint earliest = checkpoints[0].steps;
+  runTo(steps < stepsReset - earliest ? stepsReset - steps : earliest);
+  return true;
+}
+
+/**
+ * @brief Go back to the last breakpoint hit before this point, searching back
+ * from one checkpoint to the one before; to the earliest checkpoint if none.
+ * @return bool false if there is no history or the machine is running.
+ */
+bool Machine::reverseContinue() {
+  if (checkpoints.empty() || waiting ||
+      ((status & CLIENT_STATE_CLASS_MASK) == CLIENT_STATE_CLASS_RUNNING)) {
+    return false;
+  }
+  stepsReached = std::max(stepsReached, stepsReset);
+
+  uint end = stepsReset;
+  int index = checkpoints.size() - 1;
+
+  while ((index > 0) && (checkpoints[index].steps >= end)) {
+    index--;
+  }
+  for (; index >= 0; index--) {
+    std::vector<uint> hits;
+
+    restoreCheckpoint(index);
+    reExecute(end, &hits);
+    if (!hits.empty()) {
+      restoreCheckpoint(index);
+      reExecute(hits.back(), NULL);
+      status = CLIENT_STATE_BREAKPOINT;
+      return true;
+    }
+    end = checkpoints[index].steps;
+  }
+
+  runTo(checkpoints[0].steps);
+  return true;
+}
+
+/**
+ * @brief Start counting, with the program at reset - "function" 0 - and the
+ * counts reserved as memory is, so only the pages used are committed.
+ */
+Profiler::Profiler() {
+  size_t bytes = (memSize >> 1) * sizeof(uint);
+  void* space = mmap(NULL, 2 * bytes, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+  if (space == MAP_FAILED) {
+    fprintf(stderr, "Cannot reserve space to profile\n");
+    exit(1);
+  }
+  counts = (uint*)space;
+  blockCounts = counts + (memSize >> 1);
+
+  fetches = 0;
+  attributed = 0;
+  callPending = false;
+  enter(0, 0XFFFFFFFF);
+}
+
+Profiler::~Profiler() {
+  munmap(counts, 2 * (memSize >> 1) * sizeof(uint));
+}
+
+/**
+ * @brief Count an instruction fetch, first moving into a function just called
+ * or out of one whose return address this is.
+ * @param address
+ */
+void Profiler::fetch(uint address) {
+  if (callPending) {
+    callPending = false;
+    enter(address, pendingReturn);
+  } else if ((stack.size() > 1) && (address == stack.back().returnAddress)) {
+    leave();
+  }
+
+  counts[(address & (memSize - 1)) >> 1]++;
+  fetches++;
+}
+
+/**
+ * @brief Take back the count of a fetch whose instruction did not run - SWI 1
+ * at the end of the input, say - so that the counts agree with the run's.
+ * @param address
+ */
+void Profiler::unfetch(uint address) {
+  counts[(address & (memSize - 1)) >> 1]--;
+  fetches--;
+}
+
+/**
+ * @brief Count an entry to the basic block starting at an address.
+ * @param address
+ */
+void Profiler::enterBlock(uint address) {
+  blockCounts[(address & (memSize - 1)) >> 1]++;
+}
+
+/**
+ * @brief Note a call; the function is entered at the next fetch.
+ * @param returnAddress The link register, less any Thumb bit.
+ */
+void Profiler::call(uint returnAddress) {
+  callPending = true;
+  pendingReturn = returnAddress;
+}
+
+/**
+ * @brief Charge the fetches since the stack last changed to the function on
+ * top of it, and to the stack as a whole.
+ */
+void Profiler::attribute() {
+  uint64_t since = fetches - attributed;
+
+  if (since != 0) {
+    functions[path.back()].exclusive += since;
+    folded[path] += since;
+    attributed = fetches;
+  }
+}
+
+/**
+ * @brief Push a function onto the call stack.
+ * @param function
+ * @param returnAddress
+ */
+void Profiler::enter(uint function, uint returnAddress) {
+  if (!path.empty()) {
+    attribute();
+    arcs[{path.back(), function}].calls++;
+  }
+
+  FunctionCounts* counts = &functions[function];
+  counts->calls++;
+  counts->active++;
+
+  stack.push_back({function, returnAddress, fetches});
+  path.push_back(function);
+}
+
+/**
+ * @brief Pop the function on top of the call stack, charging everything since
+ * it was entered to it. A recursive function is charged by its outermost
+ * frame only.
+ */
+void Profiler::leave() {
+  Frame frame = stack.back();
+  uint64_t inclusive = fetches - frame.entered;
+
+  attribute();
+  stack.pop_back();
+  path.pop_back();
+
+  FunctionCounts* counts = &functions[frame.function];
+  if (--counts->active == 0) {
+    counts->inclusive += inclusive;
+  }
+  if (!path.empty()) {
+    arcs[{path.back(), frame.function}].inclusive += inclusive;
+  }
+}
+
+/**
+ * @brief Write the profile: a text report of the functions, the call graph,
+ * the basic blocks and the .kmd listing with a count beside each instruction,
+ * and beside it, with ".folded" appended, the exclusive counts of each call
+ * stack in the folded form taken by flame graph tools. Any functions still
+ * running are treated as having returned.
+ * @param kmd The listing loaded, for its source lines and labels.
+ * @param fileName
+ * @return bool Whether both could be written.
+ */
+bool Profiler::report(const char* kmd, const char* fileName) {
+  FILE* listing = fopen(kmd, "r");
+  std::vector<std::string> lines;
+  std::map<uint, std::string> names;
+  char line[0X100];
+
+  if (listing != NULL) {
+    while (fgets(line, sizeof(line), listing) != NULL) {
+      char label[0X80];
+      uint address;
+
+      line[strcspn(line, "\r\n")] = '\0';
+      lines.push_back(line);
+      if ((sscanf(line, ": %127s %x", label, &address) == 2) &&
+          (names.count(address) == 0)) {
+        names[address] = label;  // Symbol table
+      }
+    }
+    fclose(listing);
+  }
+
+  auto name = [&](uint address) -> std::string {
+    char hex[12];
+
+    if (names.count(address) != 0) {
+      return names[address];
+    }
+    snprintf(hex, sizeof(hex), "0x%08X", address);
+    return hex;
+  };
+
+  while (!stack.empty()) {
+    leave();
+  }
+
+  FILE* file = fopen(fileName, "w");
+  FILE* flames = fopen((std::string(fileName) + ".folded").c_str(), "w");
+
+  if ((file == NULL) || (flames == NULL)) {
+    if (file != NULL) {
+      fclose(file);
+    }
+    if (flames != NULL) {
+      fclose(flames);
+    }
+    return false;
+  }
+
+  fprintf(file, "Profile of %s: %" PRIu64 " instructions\n", kmd, fetches);
+
+  std::vector<std::pair<uint, FunctionCounts>> byExclusive(functions.begin(),
+                                                           functions.end());
+  std::stable_sort(byExclusive.begin(), byExclusive.end(),
+                   [](const auto& a, const auto& b) {
+                     return a.second.exclusive > b.second.exclusive;
+                   });
+
+  fprintf(file, "\nFunctions\n%12s %12s %8s  %s\n", "Exclusive", "Inclusive",
+          "Calls", "Function");
+  for (auto& function : byExclusive) {
+    fprintf(file, "%12" PRIu64 " %12" PRIu64 " %8u  %s\n",
+            function.second.exclusive, function.second.inclusive,
+            function.second.calls, name(function.first).c_str());
+  }
+
+  fprintf(file, "\nCall graph\n%12s %8s  %s\n", "Inclusive", "Calls",
+          "Caller -> callee");
+  for (auto& arc : arcs) {
+    fprintf(file, "%12" PRIu64 " %8u  %s -> %s\n", arc.second.inclusive,
+            arc.second.calls, name(arc.first.first).c_str(),
+            name(arc.first.second).c_str());
+  }
+
+  std::vector<std::pair<uint, uint>> blocks;  // Executions, address
+  for (uint i = 0; i < memSize >> 1; i++) {
+    if (blockCounts[i] != 0) {
+      blocks.push_back({blockCounts[i], i << 1});
+    }
+  }
+  std::stable_sort(blocks.begin(), blocks.end(),
+                   [](const auto& a, const auto& b) { return a.first > b.first; });
+
+  fprintf(file, "\nBasic blocks\n%12s  %s\n", "Executions", "Start");
+  for (auto& block : blocks) {
+    fprintf(file, "%12u  %s\n", block.first, name(block.second).c_str());
+  }
+
+  fprintf(file, "\nListing\n");
+  for (std::string& text : lines) {
+    char* end;
+    uint address = strtoul(text.c_str(), &end, 16);
+    size_t data = end - text.c_str() + 1;
+    bool code = (*end == ':') &&
+                (text.find_first_not_of(' ', data) < text.find(';', data));
+    uint count = code ? counts[(address & (memSize - 1)) >> 1] : 0;
+
+    if (count != 0) {
+      fprintf(file, "%12u  %s\n", count, text.c_str());
+    } else {
+      fprintf(file, "%12s  %s\n", "", text.c_str());
+    }
+  }
+
+  for (auto& stack : folded) {
+    for (uint i = 0; i < stack.first.size(); i++) {
+      fprintf(flames, "%s%s", (i == 0) ? "" : ";",
+              name(stack.first[i]).c_str());
+    }
+    fprintf(flames, " %" PRIu64 "\n", stack.second);
+  }
+
+  fclose(file);
+  fclose(flames);
+  return true;
+}
+
+/**
+ * @brief Start a trace, writing the registers it starts from.
+ * @param trace Open for writing; closed by the tracer.
+ * @param r The registers of the current mode.
+ * @param cpsr
+ */
+Tracer::Tracer(FILE* trace, const int* r, uint cpsr) {
+  file = trace;
+  finished = false;
+  for (uint i = 0; i < traceBuffers; i++) {
+    empty.push_back(new uchar[traceBufferSize]);
+  }
+  buffer = empty.back();
+  empty.pop_back();
+  used = 0;
+
+  for (uint i = 0; i < 15; i++) {
+    registers[i] = r[i];
+  }
+  registers[15] = cpsr;
+  nextTag = 0;
+  lastAccess = 0;
+  for (uint i = 0; i < traceOpCodes; i++) {
+    opCodes[i][0] = decodeInvalid;
+  }
+  accessCount = 0;
+
+  uint header[] = {traceMagic, traceVersion};
+  fwrite(header, sizeof(header), 1, file);
+  fwrite(registers, sizeof(registers), 1, file);
+
+  writer = std::thread(&Tracer::write, this);
+}
+
+/**
+ * @brief Finish the trace, waiting for all of it to be written.
+ */
+Tracer::~Tracer() {
+  flush();
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    finished = true;
+  }
+  changed.notify_all();
+  writer.join();
+  fclose(file);
+
+  for (uchar* spare : empty) {
+    delete[] spare;
+  }
+}
+
+/**
+ * @brief Write out full buffers as they arrive, until the trace is finished.
+ */
+void Tracer::write() {
+  std::unique_lock<std::mutex> guard(lock);
+
+  while (true) {
+    changed.wait(guard, [&] { return finished || !full.empty(); });
+    if (full.empty()) {
+      return;  // Finished, with everything written
+    }
+
+    std::pair<uchar*, uint> next = full.front();
+    full.pop_front();
+    guard.unlock();
+    fwrite(next.first, 1, next.second, file);
+    guard.lock();
+    empty.push_back(next.first);
+    changed.notify_all();
+  }
+}
+
+/**
+ * @brief Pass the buffer being filled to the writer, and take an empty one.
+ */
+void Tracer::flush() {
+  std::unique_lock<std::mutex> guard(lock);
+
+  full.push_back({buffer, used});
+  changed.notify_all();
+  changed.wait(guard, [&] { return !empty.empty(); });
+  buffer = empty.back();
+  empty.pop_back();
+  used = 0;
+}
+
+void Tracer::putByte(uchar byte) {
+  buffer[used++] = byte;
+}
+
+/**
+ * @brief Append a number seven bits at a time, least significant first, the
+ * top bit of each byte set if more follow.
+ */
+void Tracer::putVarint(uint value) {
+  while (value >= 0X80) {
+    putByte(value | 0X80);
+    value = value >> 7;
+  }
+  putByte(value);
+}
+
+/**
+ * @brief Append a signed difference, folded so that small ones either side of
+ * zero are short.
+ */
+void Tracer::putDelta(int delta) {
+  putVarint(((uint)delta << 1) ^ (uint)(delta >> 31));
+}
+
+/**
+ * @brief Note a load or store by the instruction being executed.
+ * @param address
+ * @param value As loaded or stored.
+ * @param size Bytes.
+ * @param store
+ */
+void Tracer::access(uint address, uint value, int size, bool store) {
+  if (accessCount < traceMaxAccesses) {
+    if (size < 4) {
+      value = value & ((1 << (8 * size)) - 1);
+    }
+    accesses[accessCount++] = {address, value,
+                               (uchar)(size | (store ? traceStore : 0))};
+  }
+}
+
+/**
+ * @brief Record an instruction, once executed.
+ * @param tag Its address | Thumb flag.
+ * @param opCode
+ * @param r The registers of the current mode, afterwards.
+ * @param cpsr Afterwards, with the flags up to date.
+ */
+void Tracer::record(uint tag, uint opCode, const int* r, uint cpsr) {
+  uint* remembered = opCodes[(tag >> 1) & (traceOpCodes - 1)];
+  uint written = 0;
+  uchar flags = 0;
+
+  for (uint i = 0; i < 15; i++) {
+    if ((uint)r[i] != registers[i]) {
+      written |= 1 << i;
+    }
+  }
+  if (cpsr != registers[15]) {
+    written |= 1 << 15;
+  }
+
+  if (tag != nextTag) {
+    flags |= traceJump;
+  }
+  if ((remembered[0] != tag) || (remembered[1] != opCode)) {
+    flags |= traceOpCode;
+  }
+  if (written != 0) {
+    flags |= traceWrites;
+  }
+  if (accessCount != 0) {
+    flags |= traceAccess;
+  }
+
+  putByte(flags);
+  if (flags & traceJump) {
+    putDelta(tag - nextTag);
+  }
+  if (flags & traceOpCode) {
+    putVarint(opCode);
+    remembered[0] = tag;
+    remembered[1] = opCode;
+  }
+  if (flags & traceWrites) {
+    putVarint(written);
+    for (uint i = 0; i < 16; i++) {
+      if (written & (1 << i)) {
+        uint value = (i == 15) ? cpsr : r[i];
+
+        putDelta(value - registers[i]);
+        registers[i] = value;
+      }
+    }
+  }
+  if (flags & traceAccess) {
+    putByte(accessCount);
+    for (uint i = 0; i < accessCount; i++) {
+      putByte(accesses[i].size);
+      putDelta(accesses[i].address - lastAccess);
+      putVarint(accesses[i].value);
+      lastAccess = accesses[i].address + (accesses[i].size & ~traceStore);
+    }
+    accessCount = 0;
+  }
+
+  nextTag = tag + ((tag & 1) ? 2 : 4);
+  if (used > traceBufferSize - traceMaxRecord) {
+    flush();
+  }
+}
+
+/**
+ * @brief Read a variable length number from a trace.
+ * @return bool false at the end of the file.
+ */
+bool getTraceVarint(FILE* file, uint* value) {
+  int byte;
+
+  *value = 0;
+  for (int shift = 0; (byte = getc(file)) != EOF; shift += 7) {
+    *value |= (uint)(byte & 0X7F) << shift;
+    if ((byte & 0X80) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * @brief Read a signed difference from a trace.
+ * @return bool false at the end of the file.
+ */
+bool getTraceDelta(FILE* file, uint* delta) {
+  uint folded;
+
+  if (!getTraceVarint(file, &folded)) {
+    return false;
+  }
+  *delta = (folded >> 1) ^ -(folded & 1);
+  return true;
+}
+
+/**
+ * @brief Print a trace written by "--trace", an instruction a line: its
+ * address and op. code, the registers it wrote, its loads ("<-") and stores
+ * ("->"), and the source line from the listing, if given.
+ * @param fileName
+ * @param kmd The listing which was run, or NULL.
+ * @return int 0, or 1 if the trace cannot be read.
+ */
+int printTrace(const char* fileName, const char* kmd) {
+  FILE* file = fopen(fileName, "r");
+  std::map<uint, std::string> source;
+  uint header[2], registers[16];
+  char line[0X100];
+
+  if ((file == NULL) || (fread(header, sizeof(header), 1, file) != 1) ||
+      (header[0] != traceMagic) || (header[1] != traceVersion) ||
+      (fread(registers, sizeof(registers), 1, file) != 1)) {
+    fprintf(stderr, "Cannot read trace %s\n", fileName);
+    return 1;
+  }
+
+  FILE* listing = (kmd == NULL) ? NULL : fopen(kmd, "r");
+  if (listing != NULL) {
+    while (fgets(line, sizeof(line), listing) != NULL) {
+      char* end;
+      uint address = strtoul(line, &end, 16);
+      char* text = strchr(line, ';');
+
+      line[strcspn(line, "\r\n")] = '\0';
+      if ((*end == ':') && (text != NULL) &&
+          (strspn(end + 1, " ") < (size_t)(text - end - 1))) {
+        source.emplace(address, text + 1);  // Lines holding data only
+      }
+    }
+    fclose(listing);
+  }
+
+  uint opCodes[traceOpCodes][2];
+  uint nextTag = 0;
+  uint lastAccess = 0;
+  int flags;
+
+  for (uint i = 0; i < traceOpCodes; i++) {
+    opCodes[i][0] = decodeInvalid;
+  }
+
+  while ((flags = getc(file)) != EOF) {
+    uint tag = nextTag, opCode, written = 0, delta;
+    std::string effects;
+    bool ok = true;
+
+    if (flags & traceJump) {
+      ok = getTraceDelta(file, &delta);
+      tag = nextTag + delta;
+    }
+
+    uint* remembered = opCodes[(tag >> 1) & (traceOpCodes - 1)];
+    if (flags & traceOpCode) {
+      ok = ok && getTraceVarint(file, &opCode);
+      remembered[0] = tag;
+      remembered[1] = opCode;
+    }
+    opCode = remembered[1];
+
+    if (flags & traceWrites) {
+      ok = ok && getTraceVarint(file, &written);
+      for (uint i = 0; ok && (i < 16); i++) {
+        if (written & (1 << i)) {
+          ok = getTraceDelta(file, &delta);
+          registers[i] += delta;
+          if (i == 15) {
+            snprintf(line, sizeof(line), " cpsr=%08X", registers[i]);
+          } else {
+            snprintf(line, sizeof(line), " r%u=%08X", i, registers[i]);
+          }
+          effects += line;
+        }
+      }
+    }
+
+    if (flags & traceAccess) {
+      int count = getc(file);
+
+      ok = ok && (count != EOF);
+      for (int i = 0; ok && (i < count); i++) {
+        int size = getc(file);
+        uint value;
+
+        ok = (size != EOF) && getTraceDelta(file, &delta) &&
+             getTraceVarint(file, &value);
+        uint address = lastAccess + delta;
+        uint bytes = size & ~traceStore;
+
+        snprintf(line, sizeof(line), " [%08X]%s%0*X", address,
+                 (size & traceStore) ? "->" : "<-", 2 * bytes, value);
+        effects += line;
+        lastAccess = address + bytes;
+      }
+    }
+
+    if (!ok) {
+      fprintf(stderr, "Trace %s ends part way through a record\n", fileName);
+      fclose(file);
+      return 1;
+    }
+
+    uint address = tag & ~1;
+    auto text = source.find(address);
+
+    printf("%08X %0*X%*s %-40s%s%s\n", address, (tag & 1) ? 4 : 8, opCode,
+           (tag & 1) ? 4 : 0, "", effects.c_str(),
+           (text == source.end()) ? "" : " ;",
+           (text == source.end()) ? "" : text->second.c_str());
+    nextTag = tag + ((tag & 1) ? 2 : 4);
+  }
+
+  fclose(file);
+  return 0;
+}
+
+/**
+ * @brief Assemble a source file with aasm.
+ * @param aasm Path to the assembler.
+ * @param source
+ * @param kmd The listing to produce.
+ * @return true if it assembled.
+ */
+bool assemble(const char* aasm, const char* source, const char* kmd) {
+  char* const args[] = {(char*)aasm, (char*)"-lk", (char*)kmd, (char*)source,
+                        NULL};
+  posix_spawn_file_actions_t actions;
+  pid_t pid;
+  int result = -1;
+
+  posix_spawn_file_actions_init(&actions);  // Listing only; no chatter
+  posix_spawn_file_actions_addopen(&actions, 1, "/dev/null", O_WRONLY, 0);
+
+  if (posix_spawn(&pid, aasm, &actions, NULL, args, environ) == 0) {
+    waitpid(pid, &result, 0);
+  }
+  posix_spawn_file_actions_destroy(&actions);
+
+  return result == 0;
+}
+
+/**
+ * @brief A path without the extension of its last component, if any.
+ * @param path
+ * @return std::string
+ */
+std::string pathStem(const std::string& path) {
+  size_t dot = path.find_last_of('.');
+  size_t slash = path.find_last_of('/');
+
+  if ((dot == std::string::npos) ||
+      ((slash != std::string::npos) && (dot < slash))) {
+    return path;
+  }
+  return path.substr(0, dot);
+}
+
+/**
+ * @brief Assemble (if need be) and run one program of a manifest on this
+ * thread's machine. Its terminal output goes to the job's output file, which
+ * is only created once the program has loaded.
+ * @param job
+ * @param aasm
+ * @param limit
+ * @param loaded Snapshots of programs already loaded, used in place of
+ * assembling and loading them again.
+ */
+void Machine::runJob(BatchJob* job, const char* aasm, uint limit,
+                     LoadedPrograms* loaded) {
+  struct timespec start, end;
+  std::string kmd = job->program;
+  const std::string* snapshot = NULL;
+  bool ready;
+  std::string blob;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  job->result = batchFailed;
+  job->instructions = 0;
+  job->cycles = 0;
+
+  {
+    std::unique_lock<std::mutex> guard(loaded->lock);
+
+    loaded->loadedOne.wait(
+        guard, [&] { return loaded->loading.count(job->program) == 0; });
+    auto found = loaded->snapshots.find(job->program);
+
+    if (found != loaded->snapshots.end()) {
+      snapshot = &found->second;  // Never altered once added
+    } else {
+      loaded->loading.insert(job->program);
+    }
+  }
+
+  if (snapshot != NULL) {
+    ready = restoreSnapshot(*snapshot);
+  } else {
+    resetMachine();
+
+    if (pathStem(job->program) + ".s" == job->program) {
+      char name[] = "/tmp/jimulatorXXXXXX";
+      int fd = mkstemp(name);
+
+      if (fd >= 0) {
+        close(fd);
+        kmd = name;
+        if (!assemble(aasm, job->program.c_str(), name)) {
+          kmd.clear();
+        }
+      }
+    }
+
+    ready = !kmd.empty() && loadKMD(kmd.c_str());
+    if (ready) {
+      saveSnapshot(&blob);
+    }
+
+    {
+      std::lock_guard<std::mutex> guard(loaded->lock);
+      loaded->snapshots.emplace(job->program, std::move(blob));
+      loaded->loading.erase(job->program);
+    }
+    loaded->loadedOne.notify_all();
+  }
+
+  batchInput = job->input.empty() ? NULL : fopen(job->input.c_str(), "r");
+  batchOutput = NULL;
+  if (ready && (job->input.empty() || (batchInput != NULL))) {
+    batchOutput = fopen(job->output.c_str(), "w");
+  }
+
+  if (batchOutput != NULL) {
+    job->result = runBatch(limit);
+    job->instructions = batchInstructions(job->result, stepsReset);
+    job->cycles = cycles;
+  }
+
+  if (batchInput != NULL) {
+    fclose(batchInput);
+  }
+  if (batchOutput != NULL) {
+    fclose(batchOutput);
+  }
+  if (kmd != job->program) {
+    unlink(kmd.c_str());
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  job->seconds =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1E-9;
+}
+
+/**
+ * @brief Name the terminal output of each job beside its program: the
+ * program's stem and ".out", with the stem of the input's name between them
+ * if it has input. Jobs which would still share a name are told apart by
+ * their line of the manifest instead, so no two write the same file.
+ * @param jobs
+ */
+void outputNames(std::vector<BatchJob>* jobs) {
+  std::map<std::string, uint> uses;
+
+  for (BatchJob& job : *jobs) {
+    std::string input = pathStem(job.input);
+
+    job.output = pathStem(job.program);
+    if (!job.input.empty()) {
+      job.output += "." + input.substr(input.find_last_of('/') + 1);
+    }
+    job.output += ".out";
+    uses[job.output]++;
+  }
+  for (BatchJob& job : *jobs) {
+    if (uses[job.output] > 1) {
+      job.output = pathStem(job.program) + "." + std::to_string(job.line) +
+                   ".out";
+    }
+  }
+}
+
+/**
+ * @brief Run every program listed in a manifest, spread over a number of
+ * threads, each with a machine of its own. Each line of the manifest names a
+ * program (.s, assembled first, or .kmd) and optionally a file of terminal
+ * input for it. Threads take the next unstarted program as they become free,
+ * so long runs do not hold up the rest. A line per program - its name, how
+ * it ended, the instructions executed and the wall time taken - is printed
+ * once all are done, in manifest order.
+ * @param manifest
+ * @param aasm Path to the assembler.
+ * @param limit Instructions each program may execute, or 0 for no limit.
+ * @param threads
+ * @return int 0 if every program halted by itself, else 1.
+ */
+int runManifest(const char* manifest, const char* aasm, uint limit,
+                uint threads) {
+  FILE* file = fopen(manifest, "r");
+  std::vector<BatchJob> jobs;
+  char line[0X400];
+  uint lines = 0;
+
+  if (file == NULL) {
+    fprintf(stderr, "Cannot read manifest %s\n", manifest);
+    return batchFailed;
+  }
+
+  while (fgets(line, sizeof(line), file) != NULL) {
+    char* program = strtok(line, " \t\r\n");
+    char* input = strtok(NULL, " \t\r\n");
+
+    lines++;
+    if ((program != NULL) && (program[0] != '#')) {
+      jobs.push_back({program, (input == NULL) ? "" : input, "", lines});
+    }
+  }
+  fclose(file);
+  outputNames(&jobs);
+
+  struct timespec start, end;
+  std::atomic<uint> next(0);
+  std::vector<std::thread> workers;
+  LoadedPrograms loaded;
+
+  if (threads > jobs.size()) {  // Each machine holds megabytes
+    threads = jobs.size();
+  }
+  if (threads == 0) {
+    threads = 1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (uint i = 0; i < threads; i++) {
+    workers.emplace_back([&]() {
+      Machine* machine = new Machine();
+
+      for (uint job = next++; job < jobs.size(); job = next++) {
+        machine->runJob(&jobs[job], aasm, limit, &loaded);
+      }
+      delete machine;
+    });
+  }
+  for (std::thread& worker : workers) {
+    worker.join();
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  int result = 0;
+  for (BatchJob& job : jobs) {
+    printf("%s\t%s\t%u\t", job.program.c_str(), batchReason(job.result),
+           job.instructions);
+    if (coreTiming != NULL) {
+      printf("%" PRIu64 "\t", job.cycles);
+    }
+    printf("%.3f\n", job.seconds);
+    if (job.result != batchHalted) {
+      result = 1;
+    }
+  }
+  fprintf(stderr, "%zu programs in %.3fs on %u threads\n", jobs.size(),
+          (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1E-9,
+          threads);
+
+  return result;
+}
+
+}  // namespace
+
+/**
+ * @brief The machine behind an Emulator.
+ */
+class Emulator::Machine : public ::Machine {};
+
+/**
+ * @brief Set up an emulator in this process, building the shared tables on
+ * first use.
+ */
+Emulator::Emulator() {
+  static std::once_flag tablesBuilt;
+
+  std::call_once(tablesBuilt, initTables);
+  machine = new Machine();
+  machine->inProcess = true;
+  machine->keepHistory(checkpointInterval, checkpointBudget);
+}
+
+Emulator::~Emulator() {
+  delete machine;
+}
+
+/**
+ * @brief Load a .kmd listing into memory, cleared first, and reset.
+ * @param pathToKMD
+ * @return bool Whether anything was loaded.
+ */
+bool Emulator::load(const char* pathToKMD) {
+  machine->resetMachine();
+  return machine->loadKMD(pathToKMD);
+}
+
+/**
+ * @brief Read memory, wrapping at the top of the address space as the monitor.
+ */
+void Emulator::readMemory(uint32_t address, unsigned char* data,
+                          unsigned int length) {
+  for (uint i = 0; i < length; i++) {
+    data[i] = machine->memory[(address + i) & (memSize - 1)];
+  }
+}
+
+/**
+ * @brief Write memory, discarding anything decoded from it.
+ */
+void Emulator::writeMemory(uint32_t address, const unsigned char* data,
+                           unsigned int length) {
+  for (uint i = 0; i < length; i++) {
+    machine->memory[(address + i) & (memSize - 1)] = data[i];
+  }
+  machine->invalidateDecodedRange(address & (memSize - 1), length);
+  machine->forgetHistory();
+}
+
+/**
+ * @brief Start running, with breakpoints enabled.
+ * @param steps Instructions to run, or 0 to run until stopped.
+ */
+void Emulator::start(unsigned int steps) {
+  machine->startRunning(0X30, steps);
+}
+
+void Emulator::stop() {
+  machine->stopRunning();
+}
+
+void Emulator::resume() {
+  machine->continueRunning();
+}
+
+void Emulator::reset() {
+  machine->boardreset();
+}
+
+/**
+ * @brief Run for one time slice (blockBudget instructions or so). The caller
+ * calls this repeatedly, in place of jimulator's own loop.
+ * @return bool Whether there is more to run now; false if stopped or waiting
+ * for terminal input.
+ */
+bool Emulator::run() {
+  machine->stalled = false;
+  machine->runBlocks();
+  return !machine->stalled && ((machine->status & CLIENT_STATE_CLASS_MASK) ==
+                               CLIENT_STATE_CLASS_RUNNING);
+}
+
+/**
+ * @brief What the machine is doing, as the monitor's BR_WOT_U_DO.
+ */
+unsigned char Emulator::status() {
+  return machine->status;
+}
+
+unsigned int Emulator::stepsSinceReset() {
+  return machine->stepsReset;
+}
+
+/**
+ * @brief Read a register of the current mode; 15 reads as the PC of the next
+ * instruction, 16 as the CPSR and 17 as the SPSR.
+ */
+uint32_t Emulator::getRegister(unsigned int number) {
+  return machine->getRegisterMonitor(number, regCurrent);
+}
+
+/**
+ * @brief The addresses of the most recently fetched instructions.
+ * @param count The most wanted.
+ * @return std::vector<uint32_t> Most recent first.
+ */
+std::vector<uint32_t> Emulator::recentPCs(unsigned int count) {
+  uint addresses[pastSize];
+
+  count = machine->getTrace(count, addresses);
+  return std::vector<uint32_t>(addresses, addresses + count);
+}
+
+/**
+ * @brief Set a breakpoint on an instruction address.
+ * @return bool false if one is already set there, or none are free.
+ */
+bool Emulator::setBreakpoint(uint32_t address) {
+  uint free = ~machine->emulBPFlag[0] & machine->emulBPFlag[1];
+
+  if ((free == 0) || (findBreakpoint(address) >= 0)) {
+    return false;
+  }
+
+  int index = __builtin_ctz(free);
+  BreakElement* breakpoint = &machine->breakpoints[index];
+
+  breakpoint->cond = 0XFF;  // Any mode; the address alone
+  breakpoint->size = 0XFF;
+  breakpoint->addrA = address;
+  breakpoint->addrB = 0XFFFFFFFF;
+  breakpoint->dataA[0] = breakpoint->dataA[1] = 0;
+  breakpoint->dataB[0] = breakpoint->dataB[1] = 0;
+  machine->defineBreakpoint(index);
+  return true;
+}
+
+/**
+ * @brief Remove any breakpoint on an instruction address.
+ * @return bool Whether there was one.
+ */
+bool Emulator::clearBreakpoint(uint32_t address) {
+  int index = findBreakpoint(address);
+
+  if (index < 0) {
+    return false;
+  }
+  machine->setBreakpointFlags(0, 1 << index);
+  return true;
+}
+
+/**
+ * @brief Find the active breakpoint on an address.
+ * @return int Its index, or -1 if there is none.
+ */
+int Emulator::findBreakpoint(uint32_t address) {
+  for (int i = 0; i < NO_OF_BREAKPOINTS; i++) {
+    if (((machine->emulBPFlag[0] >> i) & 1) &&
+        ((uint)machine->breakpoints[i].addrA == address)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/**
+ * @brief The addresses of the active breakpoints.
+ */
+std::vector<uint32_t> Emulator::getBreakpoints() {
+  std::vector<uint32_t> addresses;
+
+  for (int i = 0; i < NO_OF_BREAKPOINTS; i++) {
+    if ((machine->emulBPFlag[0] >> i) & 1) {
+      addresses.push_back(machine->breakpoints[i].addrA);
+    }
+  }
+  return addresses;
+}
+
+/**
+ * @brief Queue a character for the program to read (SWI 1).
+ */
+void Emulator::terminalInput(char c) {
+  machine->terminalIn.push_back(c);
+}
+
+/**
+ * @brief Take everything the program has written to the terminal since the
+ * last call.
+ */
+std::string Emulator::terminalOutput() {
+  std::string output;
+
+  output.swap(machine->terminalOut);
+  return output;
+}
+
+/**
+ * @brief Capture the whole machine, memory included, as a binary blob.
+ */
+std::string Emulator::snapshot() {
+  std::string blob;
+
+  machine->saveSnapshot(&blob);
+  return blob;
+}
+
+/**
+ * @brief Return to the state captured by "snapshot".
+ * @return bool false, with nothing changed, if the blob is not a snapshot of
+ * an emulator with the same memory size.
+ */
+bool Emulator::restore(const std::string& blob) {
+  return machine->restoreSnapshot(blob);
+}
+
+/**
+ * @brief Go back a number of instructions, while stopped; as far as the
+ * checkpoints reach at most.
+ * @return bool false if there is no history or the machine is running.
+ */
+bool Emulator::stepBack(unsigned int steps) {
+  return machine->stepBack(steps);
+}
+
+/**
+ * @brief Go back to the last breakpoint hit, while stopped; to the earliest
+ * checkpoint if none was.
+ * @return bool false if there is no history or the machine is running.
+ */
+bool Emulator::reverseContinue() {
+  return machine->reverseContinue();
+}
+
+/**
+ * @brief Change how often checkpoints are taken and the memory they may use,
+ * discarding those taken so far.
+ * @param interval Instructions between checkpoints; 0 keeps none.
+ * @param budget Bytes; every other checkpoint is merged away to fit.
+ */
+void Emulator::setCheckpoints(unsigned int interval, size_t budget) {
+  machine->keepHistory(interval, budget);
+}
+
+/**
+ * @brief Time the run from here on with a core's cycle costs, or stop timing.
+ * The count carries on from where it was.
+ * @param core As "arm7tdmi", or NULL to stop timing.
+ * @return bool false if the core is not known.
+ */
+bool Emulator::setTiming(const char* core) {
+  const Timing* timing = (core == NULL) ? NULL : findTiming(core);
+
+  if ((core != NULL) && (timing == NULL)) {
+    return false;
+  }
+  machine->timing = timing;
+  return true;
+}
+
+/**
+ * @brief The cycles estimated since reset, while timed.
+ */
+uint64_t Emulator::cycles() {
+  return machine->cycles;
+}
+
+/**
+ * @brief Record each character the program reads from the terminal, with the
+ * instruction count at which it was read, for "jimulator --replay".
+ * @param fileName
+ * @return bool Whether the record could be started.
+ */
+bool Emulator::recordInput(const char* fileName) {
+  FILE* log = fopen(fileName, "w");
+
+  if (log == NULL) {
+    return false;
+  }
+  if (machine->inputLog != NULL) {
+    fclose(machine->inputLog);
+  }
+  machine->inputLog = log;
+  return true;
+}
+
+namespace {
+
+/**
+ * @brief Run chained basic blocks until the emulator stops or the instruction
+ * budget is used, so monitor commands are only polled between chains.
+ */
+void Machine::runBlocks() {
+  BasicBlock* block = NULL;
+  uint budget = blockBudget;
+
+  while (((status & CLIENT_STATE_CLASS_MASK) == CLIENT_STATE_CLASS_RUNNING) &&
+         (budget > 0) && !stalled) {
+    uint tag = getRegisterMonitor(15, regCurrent) | ((cpsr & tfMask) != 0);
+    BasicBlock* next;
+
+    if (block == NULL) {
+      next = lookupBlock(tag);
+    } else if ((block->chain[0] != NULL) && (block->chain[0]->tag == tag)) {
+      next = block->chain[0];
+    } else if ((block->chain[1] != NULL) && (block->chain[1]->tag == tag)) {
+      next = block->chain[1];
+    } else {
+      next = lookupBlock(tag);
+      block->chain[block->chainNext] = next;  // Chain to successor
+      block->chainNext ^= 1;
+    }
+
+    if ((historyInterval != 0) && (stepsReset >= nextCheckpoint)) {
+      takeCheckpoint();
+    }
+
+    block = next;
+    uint executed = executeBlock(block);
+    budget = executed < budget ? budget - executed : 0;
+  }
+}
+
+/**
+ * @brief Step through the instructions of a block. Leaves early if anything
+ * takes control elsewhere - an exception, a stop or the block being
+ * overwritten by its own code.
+ * @param block
+ * @return uint The number of instructions stepped.
+ */
+uint Machine::executeBlock(BasicBlock* block) {
+  uint tag = block->tag;
+  uint address = tag & ~1;
+  uint length = (tag & 1) ? 2 : 4;
+
+  uint i = 0;
+
+  if (profiler != NULL) {
+    profiler->enterBlock(address);
+  }
+
+  if ((block->jitCode == NULL) && jitActive && (tag & 1) == 0 &&
+      (++block->executions == jitThreshold)) {
+    jitCompile(block);
+  }
+
+  if (block->jitCode != NULL) {
+    i = runCompiled(block);
+    address += 4 * i;
+
+    if ((i > 0) &&
+        (((status & CLIENT_STATE_CLASS_MASK) != CLIENT_STATE_CLASS_RUNNING) ||
+         (block->tag != tag) ||
+         (getRegisterMonitor(15, regCurrent) != address) ||
+         ((cpsr & tfMask) != 0))) {
+      return i;
+    }
+  }
+
+  for (; i < block->length; i++) {
+    recordFetch(address);
+    step(&block->instructions[i], i == 0);  // Blocks split at breakpoints
+    address += length;
+
+    if (((status & CLIENT_STATE_CLASS_MASK) != CLIENT_STATE_CLASS_RUNNING) ||
+        (block->tag != tag) ||
+        (getRegisterMonitor(15, regCurrent) != address) ||
+        (((cpsr & tfMask) != 0) != (tag & 1))) {
+      return i + 1;
+    }
+  }
+
+  return block->length;
+}
+
+/**
+ * @brief Step a single (fetched) instruction.
+ * @param decoded
+ * @param mayBreak Check for breakpoints before executing.
+ */
+void Machine::step(DecodedInstruction* decoded, bool mayBreak) {
+  uint cost = (timing != NULL) ? instructionCycles(decoded) : 0;
+
+  oldStatus = status;
+  executeInstruction(decoded, mayBreak);
+  if (stalled || (status == CLIENT_STATE_BREAKPOINT)) {
+    // Not executed, so neither timed, traced nor counted; nor will its
+    // breakpoint be hit again
+    if (profiler != NULL) {
+      profiler->unfetch(decoded->tag & ~1);
+    }
+    breakpointEnabled = false;
+    return;
+  }
+  if (timing != NULL) {
+    uint next = (decoded->tag & ~1) + (((decoded->tag & 1) != 0) ? 2 : 4);
+
+    cycles += cost;
+    if (getRegisterMonitor(15, regCurrent) != next) {
+      cycles += timing->refill;  // Taken: the pipeline is refilled
+    }
+  }
+  if (tracer != NULL) {
+    tracer->record(decoded->tag, decoded->opCode, r,
+                   (cpsr & ~(nfMask | zfMask | cfMask | vfMask)) |
+                       evaluateFlags());
+  }
+  // Still running - i.e. no breakpoint (etc.) found
+  if ((status & CLIENT_STATE_CLASS_MASK) == CLIENT_STATE_CLASS_RUNNING) {
+    // don't count the instructions from now
+    if (status == CLIENT_STATE_RUNNING_SWI) {
+      if ((getRegisterMonitor(15, regCurrent) == runUntilPC) &&
+          (getRegisterMonitor(13, regCurrent) == runUntilSP) &&
+          ((getRegisterMonitor(16, regCurrent) & 0x3F) == runUntilMode)) {
+        status = runUntilStatus;
+      }
+    }  // This can have changed status - hence no "else" below`
+
+    // OR _BL
+    if (status != CLIENT_STATE_RUNNING_SWI) {
+      // Count steps unless inside routine
+      stepsReset++;
+
+      // Stepping
+      if (stepsToGo > 0) {
+        stepsToGo--;  // If -decremented- to reach zero, stop
+        if (stepsToGo == 0) {
+          status = CLIENT_STATE_STOPPED;
+        }
+      }
+    }
+  }
+
+  if ((status & CLIENT_STATE_CLASS_MASK) != CLIENT_STATE_CLASS_RUNNING) {
+    breakpointEnabled = false;  // No longer running - allow "continue"
+  }
+}
+
+/**
+ * @brief Estimate the cycles an instruction takes from its class - and, for
+ * a multiply, the size of its multiplier - before it executes; "step" adds
+ * the pipeline refill if it turns out to write the PC.
+ * @param decoded
+ * @return uint
+ */
+uint Machine::instructionCycles(DecodedInstruction* decoded) {
+  uint opCode = decoded->opCode;
+  bool load = (opCode & loadMask) != 0;
+
+  if ((decoded->tag & 1) != 0) {
+    return thumbCycles(opCode);
+  } else if (!decoded->always && !checkCC(decoded->cond)) {
+    return timing->skipped;
+  } else if ((opCode & 0X0FB00FF0) == 0X01000090) {  // SWP
+    return timing->swap;
+  } else if ((opCode & 0X0FC000F0) == 0X00000090) {  // MUL, MLA
+    return multiplyCycles(getRegister((opCode & rsMask) >> 8, regCurrent),
+                          true) +
+           (((opCode & mulAccBit) != 0) ? timing->accumulate : 0);
+  } else if ((opCode & 0X0F8000F0) == 0X00800090) {  // Long
+    return multiplyCycles(getRegister((opCode & rsMask) >> 8, regCurrent),
+                          (opCode & mulSignBit) != 0) +
+           timing->multiplyLong +
+           (((opCode & mulAccBit) != 0) ? timing->accumulate : 0);
+  } else if (isItSBHW(opCode) || ((opCode & 0X0C000000) == 0X04000000)) {
+    return load ? timing->load : timing->store;
+  } else if ((opCode & 0X0E000000) == 0X08000000) {  // LDM, STM
+    return (load ? timing->loadMultiple : timing->storeMultiple) +
+           timing->perRegister * __builtin_popcount(opCode & 0XFFFF);
+  } else if (((opCode & 0X0E000090) == 0X00000010) &&
+             ((opCode & 0X0FFFFFF0) != 0X012FFF10)) {  // Not BX
+    return timing->dataOp + timing->shiftByRegister;
+  }
+  return timing->dataOp;
+}
+
+/**
+ * @brief As "instructionCycles", for a Thumb instruction.
+ * @param opCode
+ * @return uint
+ */
+uint Machine::thumbCycles(uint opCode) {
+  bool load = (opCode & 0X0800) != 0;
+
+  if ((opCode & 0XFFC0) == 0X4340) {  // MUL Rd, Rm: Rd is the multiplier
+    return multiplyCycles(getRegister(opCode & 7, regCurrent), true);
+  } else if ((opCode & 0XF800) == 0X4800) {  // LDR Rd, [PC, #]
+    return timing->load;
+  } else if ((opCode & 0XF000) == 0X5000) {  // Register offset
+    return ((opCode & 0X0E00) < 0X0600) ? timing->store : timing->load;
+  } else if (((opCode & 0XE000) == 0X6000) || ((opCode & 0XE000) == 0X8000)) {
+    return load ? timing->load : timing->store;
+  } else if ((opCode & 0XF600) == 0XB400) {  // PUSH, POP
+    return (load ? timing->loadMultiple : timing->storeMultiple) +
+           timing->perRegister * __builtin_popcount(opCode & 0X01FF);
+  } else if ((opCode & 0XF000) == 0XC000) {  // LDMIA, STMIA
+    return (load ? timing->loadMultiple : timing->storeMultiple) +
+           timing->perRegister * __builtin_popcount(opCode & 0X00FF);
+  }
+  return timing->dataOp;
+}
+
+/**
+ * @brief The cycles of a multiply, before any accumulate or long result: the
+ * multiplier is taken a byte at a time, stopping early once the rest of it is
+ * all zeros - or, if signed, all ones.
+ * @param multiplier
+ * @param isSigned
+ * @return uint
+ */
+uint Machine::multiplyCycles(uint multiplier, bool isSigned) {
+  uint bytes = 1;
+
+  if (isSigned && ((multiplier & bit31) != 0)) {
+    multiplier = ~multiplier;
+  }
+  for (multiplier >>= 8; (multiplier != 0) && (bytes < 4); multiplier >>= 8) {
+    bytes++;
+  }
+  return timing->multiply + bytes * timing->multiplierByte;
+}
+
+/**
+ * @brief
+ * @param command
+ */
+void Machine::monitorOptionsMisc(uchar command) {
+  uchar tempchar;
+  int temp;
+  switch (command & 0x3F) {
+    case BR_NOP:
+      break;
+    case BR_PING:
+      if (write(1, "OK00", 4) < 0) {
+        std::cout << "Some error occurred!" << std::endl;
+      }
+      break;
+    case BR_WOT_R_U:
+      sendCharArray(whatAreYou[0], &whatAreYou[1]);
+      break;
+
+    case BR_RESET:
+      boardreset();
+      break;
+
+    case BR_RTF_GET:
+      sendChar(rtf);
+      break;
+
+    case BR_RTF_SET:
+      getChar(&rtf);
+      break;
+
+    case BR_TRACE_GET:
+      getNBytes(&temp, 2);
+      sendTrace(temp);
+      break;
+
+    case BR_STEP_BACK:  // Replies 1 if gone back, then where it stopped
+      getNBytes(&temp, 4);
+      sendChar(stepBack(temp) ? 1 : 0);
+      sendNBytes(stepsReset, 4);
+      break;
+
+    case BR_REVERSE:  // As above
+      sendChar(reverseContinue() ? 1 : 0);
+      sendNBytes(stepsReset, 4);
+      break;
+
+    case BR_WOT_U_DO:
+      sendChar(status);
+      sendNBytes(stepsToGo, 4);
+      sendNBytes(stepsReset, 4);
+      if (timing != NULL) {  // Only with --timing, so others see 9 bytes
+        sendNBytes(cycles & 0XFFFFFFFF, 4);
+        sendNBytes(cycles >> 32, 4);
+      }
+      break;
+
+    case BR_PAUSE:
+    case BR_STOP:
+      stopRunning();
+      break;
+
+    case BR_CONTINUE:
+      continueRunning();
+      break;
+
+    case BR_BP_GET:
+      sendNBytes(emulBPFlag[0], 4);
+      sendNBytes(emulBPFlag[1], 4);
+      break;
+
+    case BR_BP_SET: {
+      int data[2];
+      getNBytes(&data[0], 4);
+      getNBytes(&data[1], 4);
+      setBreakpointFlags(data[0], data[1]);
+    } break;
+
+    case BR_BP_READ:
+      getChar(&tempchar);
+      temp = tempchar;
+      sendChar(breakpoints[temp].cond);
+      sendChar(breakpoints[temp].size);
+      sendNBytes(breakpoints[temp].addrA, 4);
+      sendNBytes(breakpoints[temp].addrB, 4);
+      sendNBytes(breakpoints[temp].dataA[0], 4);
       sendNBytes(breakpoints[temp].dataA[1], 4);
       sendNBytes(breakpoints[temp].dataB[0], 4);
       sendNBytes(breakpoints[temp].dataB[1], 4);
       break;
 
-    case BR_BP_WRITE:
-      getChar(&tempchar);
-      temp = tempchar;
-      getChar(&breakpoints[temp].cond);
-      getChar(&breakpoints[temp].size);
-      getNBytes(&breakpoints[temp].addrA, 4);
-      getNBytes(&breakpoints[temp].addrB, 4);
-      getNBytes(&breakpoints[temp].dataA[0], 4);
-      getNBytes(&breakpoints[temp].dataA[1], 4);
-      getNBytes(&breakpoints[temp].dataB[0], 4);
-      getNBytes(&breakpoints[temp].dataB[1], 4);
-      /* add breakpoint */
-      temp = (1 << temp) & ~emulBPFlag[0];
-      emulBPFlag[0] |= temp;
-      emulBPFlag[1] |= temp;
-      break;
+    case BR_BP_WRITE:
+      getChar(&tempchar);
+      temp = tempchar;
+      getChar(&breakpoints[temp].cond);
+      getChar(&breakpoints[temp].size);
+      getNBytes(&breakpoints[temp].addrA, 4);
+      getNBytes(&breakpoints[temp].addrB, 4);
+      getNBytes(&breakpoints[temp].dataA[0], 4);
+      getNBytes(&breakpoints[temp].dataA[1], 4);
+      getNBytes(&breakpoints[temp].dataB[0], 4);
+      getNBytes(&breakpoints[temp].dataB[1], 4);
+      defineBreakpoint(temp);
+      break;
+
+    case BR_WP_GET:
+      sendNBytes(emulWPFlag[0], 4);
+      sendNBytes(emulWPFlag[1], 4);
+      break;
+
+    case BR_WP_SET: {
+      int data[2];
+      getNBytes(&data[0], 4);
+      getNBytes(&data[1], 4);
+      temp = data[1] & ~data[0];
+      emulWPFlag[0] &= ~temp;
+      emulWPFlag[1] |= temp;
+      temp = data[0] & emulWPFlag[0];
+      emulWPFlag[1] = (emulWPFlag[1] & ~temp) | (data[1] & temp);
+      indexWatchpoints();
+    } break;
+
+    case BR_WP_READ:
+      getChar(&tempchar);
+      temp = tempchar;
+      sendChar(watchpoints[temp].cond);
+      sendChar(watchpoints[temp].size);
+      sendNBytes(watchpoints[temp].addrA, 4);
+      sendNBytes(watchpoints[temp].addrB, 4);
+      sendNBytes(watchpoints[temp].dataA[0], 4);
+      sendNBytes(watchpoints[temp].dataA[1], 4);
+      sendNBytes(watchpoints[temp].dataB[0], 4);
+      sendNBytes(watchpoints[temp].dataB[1], 4);
+      break;
+
+    case BR_WP_WRITE:
+      getChar(&tempchar);
+      temp = tempchar;
+      getChar(&watchpoints[temp].cond);
+      getChar(&watchpoints[temp].size);
+      getNBytes(&watchpoints[temp].addrA, 4);
+      getNBytes(&watchpoints[temp].addrB, 4);
+      getNBytes(&watchpoints[temp].dataA[0], 4);
+      getNBytes(&watchpoints[temp].dataA[1], 4);
+      getNBytes(&watchpoints[temp].dataB[0], 4);
+      getNBytes(&watchpoints[temp].dataB[1], 4);
+      temp = 1 << temp & ~emulWPFlag[0];
+      emulWPFlag[0] |= temp;
+      emulWPFlag[1] |= temp;
+      indexWatchpoints();
+      break;
+
+    case BR_FR_WRITE: {
+      uchar device, length;
+      ringBuffer* pBuff;
+
+      getChar(&device);
+      pBuff = terminalTable[device][1];
+      getChar(&length);
+      temp = tempchar;
+      while (length-- > 0) {
+        getChar(&tempchar); /* Read character */
+        if (pBuff != NULL)
+          putBuffer(pBuff, tempchar); /*  and put in buffer */
+      }
+      sendChar(0);
+    } break;
+
+    case BR_FR_READ: {
+      uchar device, max_length;
+      uint i, length, available;
+      ringBuffer* pBuff;
+
+      getChar(&device);
+      pBuff = terminalTable[device][0];
+      getChar(&max_length);
+      available = countBuffer(&terminal0Tx); /* See how many chars we have */
+      if (pBuff == NULL) {
+        length = 0; /* Kill if no corresponding buffer */
+      } else {
+        length = available < max_length ? available : max_length;
+      }
+      sendChar(length);
+      for (i = 0; i < length; i++) /* Send zero or more characters */
+      {
+        uchar c;
+        getBuffer(pBuff, &c);
+        sendChar(c);
+      }
+    } break;
+
+    default:
+      break;
+  }
+}
+
+/**
+ * @brief
+ * @param c
+ */
+void Machine::monitorMemory(uchar c) {
+  int addr;
+  uchar* pointer;
+  int size;
+
+  getNBytes(&addr, 4);  // Start address really
+  if ((c & 0x30) == 0x10) {
+    int temp;
+    int reg_bank, reg_number;
+
+    switch (addr & 0xE0) {
+      case 0x00:
+        reg_bank = regCurrent;
+        break;
+      case 0x20:
+        reg_bank = regUser;
+        break;
+      case 0x40:
+        reg_bank = regSvc;
+        break;
+      case 0x60:
+        reg_bank = regAbt;
+        break;
+      case 0x80:
+        reg_bank = regUndef;
+        break;
+      case 0xA0:
+        reg_bank = regIrq;
+        break;
+      case 0xC0:
+        reg_bank = regFiq;
+        break;
+      default:
+        reg_bank = regCurrent;
+        break;
+    }
+    reg_number = addr & 0x1F;
+
+    getNBytes(&size, 2); /* Length of transfer */
+
+    while (size--)
+      if ((c & 8) != 0)
+        sendNBytes(getRegisterMonitor(reg_number++, reg_bank), 4);
+      else {
+        getNBytes(&temp, 4);
+        putRegister(reg_number++, temp, reg_bank);
+        forgetHistory();  // The past no longer leads here
+      }
+  } else {
+    pointer = memory + (addr & (memSize - 1));
+    getNBytes(&size, 2);
+    size *= 1 << (c & 7);
+    if (((uchar*)pointer + size) > ((uchar*)memory + memSize))
+      pointer -= memSize;
+    if (c & 8)
+      sendCharArray(size, pointer);
+    else {
+      getCharArray(size, pointer);
+      invalidateDecodedRange(pointer - memory, size);
+      forgetHistory();
+    }
+  }
+}
+
+/**
+ * @brief
+ * @param c
+ */
+void Machine::monitorBreakpoints(uchar c) {
+  int steps;
+
+  getNBytes(&steps, 4);
+  startRunning(c & 0x3F, steps);
+}
+
+/**
+ * @brief Start running, as the monitor's "start" command.
+ * @param flags Breakpoint enable, BL and SWI run through &c.
+ * @param steps Instructions to run, or 0 to run until stopped.
+ */
+void Machine::startRunning(uchar flags, int steps) {
+  runFlags = flags;
+  breakpointEnable = (runFlags & 0x10) != 0;
+  breakpointEnabled = (runFlags & 0x01) != 0; /* Break straight away */
+  runThroughBL = (runFlags & 0x02) != 0;
+  runThroughSWI = (runFlags & 0x04) != 0;
+  stepsToGo = steps;
+  if (stepsToGo == 0)
+    status = CLIENT_STATE_RUNNING;
+  else
+    status = CLIENT_STATE_STEPPING;
+}
+
+/**
+ * @brief Stop, if running, so that "continueRunning" can carry on.
+ */
+void Machine::stopRunning() {
+  if ((status & CLIENT_STATE_CLASS_MASK) == CLIENT_STATE_CLASS_RUNNING) {
+    oldStatus = status;
+    status = CLIENT_STATE_STOPPED;
+  }
+}
+
+/**
+ * @brief Carry on after "stopRunning" or a breakpoint.
+ */
+void Machine::continueRunning() {
+  if (((status & CLIENT_STATE_CLASS_MASK) == CLIENT_STATE_CLASS_STOPPED) &&
+      (status != CLIENT_STATE_BYPROG))  // Only act if already stopped
+    if ((oldStatus = CLIENT_STATE_STEPPING) || (stepsToGo != 0))
+      status = oldStatus;
+}
+
+/**
+ * @brief Activate breakpoint "index", once its definition has been written.
+ * @param index
+ */
+void Machine::defineBreakpoint(uint index) {
+  uint bit = (1 << index) & ~emulBPFlag[0];
+
+  emulBPFlag[0] |= bit;
+  emulBPFlag[1] |= bit;
+  indexBreakpoints();
+  flushBlocks();  // Blocks are split at breakpoints
+}
+
+/**
+ * @brief Change which breakpoints are active, as the monitor's BR_BP_SET.
+ * @param a
+ * @param b
+ */
+void Machine::setBreakpointFlags(uint a, uint b) {
+  /* Note ordering to avoid temporary variable */
+  emulBPFlag[1] = (~emulBPFlag[0] & emulBPFlag[1]) |
+                  (emulBPFlag[0] & ((emulBPFlag[1] & ~a) | b));
+  emulBPFlag[0] = emulBPFlag[0] & (a | ~b);
+  indexBreakpoints();
+  flushBlocks();  // Blocks are split at breakpoints
+}
+
+/**
+ * @brief
+ * @param pPollfd
+ */
+void Machine::comm(struct pollfd* pPollfd) {
+  uchar c;
+
+  if (poll(pPollfd, 1, 0) > 0) {
+    if (read(0, &c, 1) < 0) {
+      std::cout << "Some error occurred!" << std::endl;
+    }  // Look at error return - find EOF & exit
+    switch (c & 0xC0) {
+      case 0x00:
+        monitorOptionsMisc(c);
+        break;
+      case 0x40:
+        monitorMemory(c);
+        break;
+      case 0x80:
+        monitorBreakpoints(c);
+        break;
+      case 0xC0:
+        break;
+    }
+  }
+}
+
+/**
+ * @brief Get 1 character from host.
+ * @param toGet
+ * @return int
+ */
+int getChar(uchar* toGet) {
+  return getCharArray(1, toGet);
+}
+
+/**
+ * @brief Send 1 character to host
+ * @param toSend
+ * @return int
+ */
+int sendChar(uchar toSend) {
+  return sendCharArray(1, &toSend);
+}
+
+/**
+ * @brief Sends N bytes from the supplied value to the host (??), LSB first.
+ * @param value
+ * @param N
+ * @return int The number of bytes believed received successfully (i.e. N=>"Ok")
+ */
+int sendNBytes(int value, int N) {
+  uchar buffer[MAX_SERIAL_WORD];
+  int i;
+
+  if (N > MAX_SERIAL_WORD)
+    N = MAX_SERIAL_WORD; /* Clip, just in case ... */
+
+  for (i = 0; i < N; i++) {
+    buffer[i] = value & 0xFF; /* Byte into buffer */
+    value = value >> 8;       /* Get next byte */
+  }
+
+  return sendCharArray(N, buffer);
+}
+
+/**
+ * @brief Gets N bytes from the host (??) into the indicated val_ptr, LSB first.
+ * @param valPtr
+ * @param N
+ * @return int The number of bytes received successfully (i.e. N=>"Ok")
+ */
+int getNBytes(int* valPtr, int N) {
+  uchar buffer[MAX_SERIAL_WORD];
+  int i, No_received;
+
+  if (N > MAX_SERIAL_WORD) {
+    N = MAX_SERIAL_WORD;  // Clip, just in case ...
+  }
+
+  No_received = getCharArray(N, buffer);
+
+  *valPtr = 0;
+
+  for (i = 0; i < No_received; i++) {
+    *valPtr = *valPtr | ((buffer[i] & 0xFF) << (i * 8)); /* Assemble integer */
+  }
+
+  return No_received;
+}
+
+/**
+ * @brief Reads a character array from buffer. Sends charNumber number of
+ * characters given by dataPtr.
+ * @param charNumber
+ * @param dataPtr
+ * @return int Number of bytes received.
+ */
+int getCharArray(int charNumber, uchar* dataPtr) {
+  int ret = charNumber;
+  int replycount = 0;
+  struct pollfd pollfd;
+
+  pollfd.fd = 0;
+  pollfd.events = POLLIN;
+
+  while (charNumber) {
+    if (!poll(&pollfd, 1, -1)) {
+      return ret - charNumber;
+    }
+
+    replycount = read(0, dataPtr, charNumber);
+    if (replycount < 0) {
+      replycount = 0;
+    }
+
+    charNumber -= replycount;
+    dataPtr += replycount;
+  }
+
+  return ret;
+}
+
+/**
+ * @brief writes an array of bytes in the buffer.
+ * @param charNumber number of bytes given by dataPtr
+ * @param dataPtr points to the beginning of the sequence to be sent
+ * @return int
+ */
+int sendCharArray(int charNumber, uchar* dataPtr) {
+  if (write(1, dataPtr, charNumber) < 0) {
+    std::cout << "Some error occurred!" << std::endl;
+  }
+
+  return charNumber;  // send char array to the board
+}
+
+/**
+ * @brief Parse a count, such as "1000" or "0x100".
+ * @param arg
+ * @param count
+ * @return bool false unless the whole of arg is a number.
+ */
+bool parseCount(const char* arg, uint* count) {
+  char* end;
+
+  *count = strtoul(arg, &end, 0);
+  return isdigit((uchar)arg[0]) && (*end == '\0');
+}
+
+/**
+ * @brief Parse a size, such as "0x400000", "64K" or "256M".
+ * @param arg
+ * @param size In bytes.
+ * @return bool false unless the whole of arg is a size.
+ */
+bool parseSize(const char* arg, unsigned long long* size) {
+  char* end;
+
+  *size = strtoull(arg, &end, 0);
+  if ((*end == 'K') || (*end == 'k')) {
+    *size = *size << 10;
+    end++;
+  } else if ((*end == 'M') || (*end == 'm')) {
+    *size = *size << 20;
+    end++;
+  } else if ((*end == 'G') || (*end == 'g')) {
+    *size = *size << 30;
+    end++;
+  }
+  return isdigit((uchar)arg[0]) && (*end == '\0');
+}
+
+/**
+ * @brief Parse a memory size, as "parseSize", rounding it up to a power of
+ * two within the supported range.
+ * @param arg
+ * @param bytes The size in bytes.
+ * @return bool false unless the whole of arg is a size.
+ */
+bool parseMemSize(const char* arg, uint* bytes) {
+  unsigned long long size;
+
+  if (!parseSize(arg, &size)) {
+    return false;
+  }
+  *bytes = minMemSize;
+  while ((*bytes < size) && (*bytes < maxMemSize)) {
+    *bytes = *bytes << 1;
+  }
+  if (size > maxMemSize) {
+    fprintf(stderr, "Memory limited to %dMB\n", maxMemSize >> 20);
+  }
+
+  return true;
+}
+
+/**
+ * @brief Print the command line jimulator takes.
+ * @param program As it was run.
+ */
+void usage(const char* program) {
+  fprintf(stderr,
+          "usage: %s [--memory <size>] [--jit] [--timing <core>]\n"
+          "         [--record <file>] [--checkpoint-interval <n>]\n"
+          "         [--checkpoint-memory <size>]\n"
+          "         [--batch <file.kmd> [--input <file> | --replay <file>]\n"
+          "          [--limit <n>] [--profile <file>] [--trace <file>]]\n"
+          "         [--manifest <file> [--threads <n>] [--aasm <path>]\n"
+          "          [--limit <n>]]\n"
+          "         [--read-trace <file> [--batch <file.kmd>]]\n",
+          program);
+}
+
+/**
+ * @brief Reserve the guest memory and the structures sized from it. The
+ * memory is anonymous, so the host commits zero filled pages only as they
+ * are first touched.
+ */
+void Machine::initMemory() {
+  void* space = mmap(NULL, memSize, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+  if (space == MAP_FAILED) {
+    fprintf(stderr, "Cannot reserve %dKB of memory\n", memSize >> 10);
+    exit(1);
+  }
+  memory = (uchar*)space;
+
+  codeLineWords = ((memSize >> 2) >> codeLineShift) / 32;
+  codeLines = (uint*)calloc(codeLineWords, sizeof(uint));
+
+  dirtyPageWords = ((memSize >> snapshotPageShift) + 31) / 32;
+  dirtyPages = (uint*)calloc(dirtyPageWords, sizeof(uint));
+  usedPages = (uint*)calloc(dirtyPageWords, sizeof(uint));
+}
+
+/**
+ * @brief
+ */
+void Machine::emulSetup() {
+  glob1 = 0;
+  glob2 = 0;
+
+  for (uint i = 0; i < decodeCacheSize; i++) {
+    decodeCache[i].tag = decodeInvalid;
+  }
+  flushBlocks();
+  pastOpcPtr = 0;
+
+  int initialMode = 0xC0 | supMode;
+  printOut = false;
+
+  nextFileHandle = 1;
+
+  initialise(0, initialMode);
+}
+
+/**
+ * @brief Rebuild the breakpoint lookup from the active breakpoints. Those on
+ * a single address are hashed on it; the rest are kept for a full check.
+ * Breakpoints which can never match are left out altogether.
+ */
+void Machine::indexBreakpoints() {
+  uint active = emulBPFlag[0] & emulBPFlag[1];
+
+  for (uint i = 0; i < breakHashSize; i++) {
+    breakHash[i].set = 0;
+  }
+  breakRanges = 0;
+
+  for (int i = 0; i < NO_OF_BREAKPOINTS; i++) {
+    BreakElement* bp = &breakpoints[i];
+    uint address = bp->addrA;
+
+    if (((active & (1 << i)) == 0) || ((bp->cond & 0x08) == 0) ||
+        ((bp->cond & 0x02) == 0)) {
+      continue;
+    }
+
+    if ((((bp->cond & 0x0C) == 0x08) && (bp->addrA == bp->addrB)) ||
+        (((bp->cond & 0x0C) == 0x0C) && (bp->addrB == -1))) {
+      BreakSlot* slot = &breakHash[(address >> 1) & (breakHashSize - 1)];
+
+      while ((slot->set != 0) && (slot->address != address)) {
+        if (++slot == &breakHash[breakHashSize]) {
+          slot = breakHash;
+        }
+      }
+      slot->address = address;
+      slot->set |= 1 << i;
+    } else {
+      breakRanges |= 1 << i;
+    }
+  }
+}
+
+/**
+ * @brief Whether any active breakpoint matches; a single probe unless there
+ * are breakpoints on ranges.
+ * @param instrAddr
+ * @param instr
+ * @return true
+ * @return false
+ */
+bool Machine::checkBreakpoint(uint instrAddr, uint instr) {
+  BreakSlot* slot = &breakHash[(instrAddr >> 1) & (breakHashSize - 1)];
+  uint candidates = breakRanges;
+
+  while (slot->set != 0) {
+    if (slot->address == instrAddr) {
+      candidates |= slot->set;
+      break;
+    }
+    if (++slot == &breakHash[breakHashSize]) {
+      slot = breakHash;
+    }
+  }
+
+  for (int i = 0; candidates != 0; i++, candidates >>= 1) {
+    if (((candidates & 1) != 0) && matchBreakpoint(i, instrAddr, instr)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * @brief
+ * @param i The breakpoint to compare against.
+ * @param instrAddr
+ * @param instr
+ * @return true
+ * @return false
+ */
+bool Machine::matchBreakpoint(int i, uint instrAddr, uint instr) {
+  bool mayBreak = true;
+
+  // Try address comparison
+  {
+    {
+      switch (breakpoints[i].cond & 0x0C) {
+        case 0x00:
+        case 0x04:
+          mayBreak = false;
+          break;
+        // Case of between address A and address B
+        case 0x08:
+          if ((instrAddr < breakpoints[i].addrA) ||
+              (instrAddr > breakpoints[i].addrB)) {
+            mayBreak = false;
+          }
+          break;
+        // case of mask
+        case 0x0C:
+          if ((instrAddr & breakpoints[i].addrB) != breakpoints[i].addrA) {
+            mayBreak = false;
+          }
+          break;
+      }
+    }
+
+    // Try data comparison
+    if (mayBreak) {
+      switch (breakpoints[i].cond & 0x03) {
+        case 0x00:
+          mayBreak = false;
+          break;
+
+        case 0x01:
+          mayBreak = false;
+          break;
+
+        case 0x02:  // Case of between data A and data B
+          if ((instr < breakpoints[i].dataA[0]) ||
+              (instr > breakpoints[i].dataB[0])) {
+            mayBreak = false;
+          }
+          break;
+
+        case 0x03:  // Case of mask
+          if ((instr & breakpoints[i].dataB[0]) != breakpoints[i].dataA[0]) {
+            mayBreak = false;
+          }
+          break;
+      }
+    }
+  }
+  return mayBreak;
+}
+
+/**
+ * @brief
+ * @param decoded
+ * @param mayBreak
+ */
+void Machine::executeInstruction(DecodedInstruction* decoded, bool mayBreak) {
+  uint instr_addr =
+      getRegister(15, regCurrent) - instructionLength(cpsr, tfMask);
+  lastAddr = getRegister(15, regCurrent) - instructionLength(cpsr, tfMask);
+
+  uint instr = decoded->opCode;
+
+  if (mayBreak && breakpointEnabled && (status != CLIENT_STATE_RUNNING_SWI)) {
+    if (checkBreakpoint(instr_addr, instr)) {
+      status = CLIENT_STATE_BREAKPOINT;
+      return;
+    }
+  }
+  breakpointEnabled = breakpointEnable; /* More likely after first fetch */
+
+  /* BL instruction */
+  if (((instr & 0x0F000000) == 0x0B000000) && runThroughBL) {
+    saveState(CLIENT_STATE_RUNNING_BL);
+  } else {
+    if (((instr & 0x0F000000) == 0x0F000000) && runThroughSWI) {
+      saveState(CLIENT_STATE_RUNNING_SWI);
+    }
+  }
+
+  /* Execute */
+  execute(decoded);
+}
+
+/**
+ * @brief Save state for leaving "procedure" {PC, SP, Mode, current state}
+ * @param newStatus
+ */
+void Machine::saveState(uchar newStatus) {
+  runUntilPC = getRegister(15, regCurrent);  // Incremented once: correct here
+  runUntilSP = getRegister(13, regCurrent);
+  runUntilMode = getRegister(16, regCurrent) & 0x3F;  // Just the mode bits
+  runUntilStatus = status;
+  status = newStatus;
+}
+
+/**
+ * @brief
+ */
+void Machine::boardreset() {
+  stepsReset = 0;
+  cycles = 0;
+  pastOpcPtr = 0;
+  forgetHistory();
+  if (inputLog != NULL) {  // Start the record again, with the count
+    fflush(inputLog);
+    if (ftruncate(fileno(inputLog), 0) == 0) {
+      rewind(inputLog);
+    }
+  }
+  initialise(0, supMode);
+}
+
+/**
+ * @brief
+ * @param startAddr
+ * @param initMode
+ */
+void Machine::initialise(uint startAddr, int initMode) {
+  writeCPSR(0X000000C0 | initMode);  // Disable interrupts
+  flagPending = flagNone;
+  r[15] = startAddr;
+  oldStatus = CLIENT_STATE_RESET;
+  status = CLIENT_STATE_RESET;
+}
+
+/**
+ * @brief Execute a predecoded instruction.
+ * @param decoded
+ */
+void Machine::execute(DecodedInstruction* decoded) {
+  incPC(); /* Easier here than later */
+
+  /* Thumb is unconditional; ARM must check condition */
+  if (((cpsr & tfMask) != 0) || decoded->always ||
+      (checkCC(decoded->cond) == true)) {
+    // Only data operations and branches cope with flags still pending
+    if (!decoded->aluOp && (decoded->handler != HANDLER(armBranch))) {
+      resolveFlags();
+    }
+    decoded->handler(this, decoded);
+  }
+}
+
+/**
+ * @brief
+ * @param opCode
+ * @return int
+ */
+int isItSBHW(uint opCode) {
+  if (((opCode & 0X0E000090) == 0X00000090) &&
+      ((opCode & 0X00000060) != 0X00000000)     /* No multiplies */
+      && ((opCode & 0X00100040) != 0X00000040)) /* No signed stores */
+  {
+    if (((opCode & 0X00400000) != 0) || ((opCode & 0X00000F00) == 0))
+      return true;
+    else
+      return false;
+  } else
+    return false;
+}
+
+// Adaptors from the decode cache to the op. code based execute functions
+
+void Machine::armMulti(DecodedInstruction* d) {
+  myMulti(d->opCode);
+}
+
+void Machine::armTransferSBHW(DecodedInstruction* d) {
+  transferSBHW(d->opCode);
+}
+
+void Machine::armSwap(DecodedInstruction* d) {
+  swap(d->opCode);
+}
+
+void Machine::armMrs(DecodedInstruction* d) {
+  mrs(d->opCode);
+}
+
+void Machine::armMsr(DecodedInstruction* d) {
+  msr(d->opCode);
+}
+
+void Machine::armBx(DecodedInstruction* d) {
+  bx(d->rm, d->opCode & 0X00000020);
+}
+
+void Machine::armBreakpoint(DecodedInstruction* d) {
+  breakpoint();
+}
+
+void Machine::armClz(DecodedInstruction* d) {
+  clz(d->opCode);
+}
+
+void Machine::armUndefined(DecodedInstruction* d) {
+  undefined();
+}
+
+void Machine::armTransfer(DecodedInstruction* d) {
+  transfer(d->opCode);
+}
+
+void Machine::armMultiple(DecodedInstruction* d) {
+  multiple(d->opCode);
+}
+
+void Machine::armBranch(DecodedInstruction* d) {
+  branch(d->opCode);
+}
+
+void Machine::armSystem(DecodedInstruction* d) {
+  mySystem(d->opCode);
+}
+
+/**
+ * @brief Fill a decode cache entry from a freshly fetched op. code.
+ * @param decoded The entry to fill.
+ * @param opCode
+ * @param thumb true if the op. code was fetched in Thumb state.
+ */
+void Machine::decode(DecodedInstruction* decoded, uint opCode, bool thumb) {
+  decoded->opCode = opCode;
+  decoded->cond = opCode >> 28;
+  decoded->always = false;
+  decoded->aluOp = false;
+  decoded->operation = 0;
+  decoded->rn = decoded->rd = decoded->rm = decoded->rs = 0;
+  decoded->shiftType = decoded->shiftDistance = 0;
+  decoded->immOperand = decoded->regShift = decoded->setFlags = false;
+  decoded->immCarry = carryPrevious;
+  decoded->operand = operandImmediate;
+  decoded->immediate = 0;
+
+  if (thumb) {
+    decodeThumb(decoded, opCode & 0XFFFF); /* 16-bit op. code */
+  } else {
+    decodeARM(decoded, opCode);
+  }
+}
+
+/**
+ * @brief
+ * @param decoded
+ * @param opCode
+ */
+void Machine::decodeARM(DecodedInstruction* decoded, uint opCode) {
+  decoded->always = ((opCode & 0XFE000000) == 0XFA000000) || /* Nasty BLX */
+                    (decoded->cond == 0XE);
+
+  switch ((opCode >> 25) & 0X00000007) {
+    case 0X0: /* includes load/store hw & sb */
+    case 0X1: /* data processing & MSR # */
+      decodeDataOp(decoded, opCode);
+      break;
+    case 0X2:
+    case 0X3:
+      decoded->handler = HANDLER(armTransfer);
+      break;
+    case 0X4:
+      decoded->handler = HANDLER(armMultiple);
+      break;
+    case 0X5:
+      decoded->handler = HANDLER(armBranch);
+      break;
+    case 0X6:
+      decoded->handler = HANDLER(armUndefined);
+      break;
+    case 0X7:
+      decoded->handler = HANDLER(armSystem);
+      break;
+  }
+}
+
+/**
+ * @brief Sort out the data processing space, extracting operand fields for
+ * the normal ALU operations.
+ * @param decoded
+ * @param opCode
+ */
+void Machine::decodeDataOp(DecodedInstruction* decoded, uint opCode) {
+  if (((opCode & mulMask) == mulOp) || ((opCode & longMulMask) == longMulOp)) {
+    decoded->handler = HANDLER(armMulti);
+  } else if (isItSBHW(opCode) == true) {
+    decoded->handler = HANDLER(armTransferSBHW);
+  } else if ((opCode & swpMask) == swpOp) {
+    decoded->handler = HANDLER(armSwap);
+  } else if ((opCode & dataExtMask) == arithExt) {
+    /* TST, TEQ, CMP, CMN - all lie in above range, but have S set */
+    /* PSR transfers OR BX */
+    if ((opCode & 0X0FBF0FFF) == 0X010F0000) {
+      decoded->handler = HANDLER(armMrs); /* MRS */
+    } else if (((opCode & 0X0DB6F000) == 0X0120F000) &&
+               ((opCode & 0X02000010) != 0X00000010)) {
+      decoded->handler = HANDLER(armMsr);                    /* MSR */
+    } else if ((opCode & 0X0FFFFFD0) == 0X012FFF10) /* BX/BLX */
+    {
+      decoded->rm = opCode & rmMask;
+      decoded->handler = HANDLER(armBx);
+    } else if ((opCode & 0XFFF000F0) == 0XE1200070) {
+      decoded->handler = HANDLER(armBreakpoint); /* Breakpoint */
+    } else if ((opCode & 0X0FFF0FF0) == 0X016F0F10) {
+      decoded->handler = HANDLER(armClz); /* CLZ */
+    } else {
+      decoded->handler = HANDLER(armUndefined);
+    }
+  } else { /* All data processing operations */
+    decoded->aluOp = true;
+    decoded->operation = (opCode & dataOpMask) >> 21;
+    decoded->rn = (opCode & rnMask) >> 16;
+    decoded->rd = (opCode & rdMask) >> 12;
+    decoded->setFlags = (opCode & sMask) != 0;
+
+    if ((opCode & immMask) != 0) {
+      int dummy;
+      int rotate = (opCode & 0XF00) >> 7; /* Number of rotates */
+
+      decoded->immOperand = true;
+      decoded->immediate = ror(opCode & 0X0FF, rotate, &dummy);
+      if (rotate != 0) {
+        decoded->immCarry = ((decoded->immediate & bit31) != 0);
+      }
+    } else {
+      decoded->rm = opCode & rmMask;
+      decoded->shiftType = (opCode & 0X060) >> 5;
+
+      if ((opCode & 0X010) != 0) {
+        decoded->regShift = true;
+        decoded->rs = (opCode & rsMask) >> 8;
+      } else {
+        decoded->shiftDistance = (opCode & 0XF80) >> 7;
+
+        if (decoded->shiftDistance == 0) { /* Special cases */
+          if (decoded->shiftType == 3) {
+            decoded->shiftType = 4;     /* RRX */
+            decoded->shiftDistance = 1; /* Something non-zero */
+          } else if (decoded->shiftType != 0) {
+            decoded->shiftDistance = 32; /* LSL excluded */
+          }
+        }
+      }
+    }
+
+    if (decoded->immOperand) {
+      decoded->operand = operandImmediate;
+    } else if (decoded->regShift) {
+      decoded->operand = operandRegShift;
+    } else if ((decoded->shiftType == 0) && (decoded->shiftDistance == 0)) {
+      decoded->operand = operandRegister;
+    } else {
+      decoded->operand = operandLSL + decoded->shiftType; /* Includes RRX */
+    }
+
+    if (decoded->rd == 0XF) {
+      decoded->handler = HANDLER(normalDataOp);  // May change mode
+    } else {
+      decoded->handler =
+          dataOpTable[decoded->operation][decoded->operand][decoded->setFlags];
+    }
+  }
+}
+
+/**
+ * @brief
+ * @param decoded
+ * @param opCode
+ */
+void Machine::decodeThumb(DecodedInstruction* decoded, uint opCode) {
+  ThumbDecoding* entry = &thumbTable[opCode >> 6];
+
+  decoded->opCode = opCode;
+  decoded->handler = entry->handler;
+
+  switch (entry->fields) {
+    case thumbFieldsShift:
+      decoded->rd = opCode & 7;
+      decoded->rm = (opCode >> 3) & 7;
+      decoded->shiftDistance = (opCode >> 6) & 0X1F;
+      if ((decoded->shiftDistance == 0) && ((opCode & 0X1800) != 0)) {
+        decoded->shiftDistance = 32; /* LSR, ASR #32 */
+      }
+      break;
+
+    case thumbFieldsAddSub:
+      decoded->rd = opCode & 7;
+      decoded->rn = (opCode >> 3) & 7;
+      decoded->rm = (opCode >> 6) & 7;
+      decoded->immediate = (opCode >> 6) & 7;
+      break;
+
+    case thumbFieldsImm8:
+      decoded->rd = (opCode >> 8) & 7;
+      decoded->immediate = opCode & 0X00FF;
+      break;
+
+    case thumbFieldsImm8Word:
+      decoded->rd = (opCode >> 8) & 7;
+      decoded->immediate = (opCode & 0X00FF) << 2;
+      break;
+
+    case thumbFieldsLow:
+      decoded->rd = opCode & 7;
+      decoded->rn = (opCode >> 3) & 7;
+      decoded->rm = (opCode >> 6) & 7;
+      break;
+
+    case thumbFieldsAlu:
+      decoded->rd = opCode & 7;
+      decoded->rm = (opCode >> 3) & 7;
+      break;
+
+    case thumbFieldsHigh:
+      decoded->rd = ((opCode & 0X0080) >> 4) | (opCode & 7);
+      decoded->rm = (opCode >> 3) & 15;
+      break;
+
+    case thumbFieldsImm5Word:
+      decoded->rd = opCode & 7;
+      decoded->rn = (opCode >> 3) & 7;
+      decoded->immediate = (opCode >> 4) & 0X07C; /* shift twice = *4 */
+      break;
+
+    case thumbFieldsImm5Half:
+      decoded->rd = opCode & 7;
+      decoded->rn = (opCode >> 3) & 7;
+      decoded->immediate = (opCode >> 5) & 0X03E; /* x2 in shift */
+      break;
+
+    case thumbFieldsImm5Byte:
+      decoded->rd = opCode & 7;
+      decoded->rn = (opCode >> 3) & 7;
+      decoded->immediate = (opCode >> 6) & 0X01F;
+      break;
+
+    case thumbFieldsSP:
+      decoded->rd = (opCode >> 8) & 7;
+      decoded->rn = 13;
+      decoded->immediate = (opCode & 0X00FF) << 2;
+      break;
+
+    case thumbFieldsAdjustSP:
+      decoded->immediate = (opCode & 0X7F) << 2;
+      if ((opCode & 0X0080) != 0) { /* SUB (4) */
+        decoded->immediate = -decoded->immediate;
+      }
+      break;
+
+    case thumbFieldsPush:
+      decoded->immediate = opCode & 0X00FF;
+      if ((opCode & 0X0100) != 0) {
+        decoded->immediate = decoded->immediate | 0X4000;
+      }
+      break;
+
+    case thumbFieldsPop:
+      decoded->immediate = opCode & 0X00FF;
+      if ((opCode & 0X0100) != 0) {
+        decoded->immediate = decoded->immediate | 0X8000;
+      }
+      break;
+
+    case thumbFieldsMultiple:
+      decoded->rn = (opCode >> 8) & 7;
+      decoded->immediate = opCode & 0X00FF;
+      break;
+
+    case thumbFieldsBranchCond:
+      decoded->cond = (opCode >> 8) & 0XF;
+      decoded->immediate = (opCode & 0X00FF) << 1;
+      if ((opCode & 0X0080) != 0) {
+        decoded->immediate = decoded->immediate | 0XFFFFFE00; /* Sign ext. */
+      }
+      break;
+
+    case thumbFieldsBranch:
+      decoded->immediate = (opCode & 0X07FF) << 1;
+      if ((opCode & 0X0400) != 0) {
+        decoded->immediate = decoded->immediate | 0XFFFFF000; /* Sign ext. */
+      }
+      break;
+
+    case thumbFieldsBlPrefix:
+      decoded->immediate = (opCode & 0X07FF) << 12;
+      if ((opCode & 0X0400) != 0) {
+        decoded->immediate = decoded->immediate | 0XFF800000; /* Sign ext. */
+      }
+      break;
+  }
+}
+
+/**
+ * @brief Discard any cached decode of an instruction held in the given memory
+ * word, and any block including it. Instructions are only ever fetched from a
+ * single word, so only the two cache slots which map onto that word need be
+ * checked.
+ * @param word The word number (address >> 2) which has been written.
+ */
+void Machine::invalidateDecoded(uint word) {
+  DecodedInstruction* entry = &decodeCache[(word << 1) & (decodeCacheSize - 1)];
+
+  if ((entry[0].tag >> 2) == word) {
+    entry[0].tag = decodeInvalid;
+  }
+  if ((entry[1].tag >> 2) == word) {
+    entry[1].tag = decodeInvalid;
+  }
+
+  invalidateBlocks(word);
+}
+
+/**
+ * @brief Discard any cached decodes over a range of (byte) addresses, and
+ * note its pages as written.
+ * @param address
+ * @param size The number of bytes written.
+ */
+void Machine::invalidateDecodedRange(uint address, uint size) {
+  if (size == 0) {
+    return;
+  }
+
+  for (uint word = address >> 2; word <= (address + size - 1) >> 2; word++) {
+    invalidateDecoded(word);
+    markDirty(word & ((memSize >> 2) - 1));
+  }
+}
+
+/**
+ * @brief Whether an instruction may change the flow of control, so ending a
+ * basic block. This need only be conservative for efficiency: a block is left
+ * early wherever the PC does not follow on.
+ * @param decoded
+ * @param thumb
+ * @return true
+ * @return false
+ */
+bool Machine::endsBlock(DecodedInstruction* decoded, bool thumb) {
+  uint opCode = decoded->opCode;
+  InstructionHandler handler = decoded->handler;
+
+  if (thumb) {
+    return ((opCode & 0XE000) == 0XE000) || /* Branches */
+           ((opCode & 0XE000) == 0XC000) || /* LDM/STM, B<cond>, SWI */
+           ((opCode & 0XF000) == 0XB000) || /* PUSH/POP, BKPT &c. */
+           ((opCode & 0XFC00) == 0X4400);   /* Hi register ops. and BX */
+  }
+
+  return (handler == HANDLER(armBranch)) ||
+         (handler == HANDLER(armBx)) || (handler == HANDLER(armSystem)) ||
+         (handler == HANDLER(armUndefined)) ||
+         (handler == HANDLER(armBreakpoint)) || (handler == HANDLER(armMsr)) ||
+         ((opCode & rdMask) == rdMask) ||
+         ((handler == HANDLER(armMultiple)) && ((opCode & 0X00008000) != 0));
+}
+
+/**
+ * @brief Find the block starting at an address, building it on a miss.
+ * @param tag Start address | Thumb flag.
+ * @return BasicBlock*
+ */
+BasicBlock* Machine::lookupBlock(uint tag) {
+  BasicBlock* block = &blockCache[(tag >> 1) & (blockCacheSize - 1)];
+
+  if (block->tag != tag) {
+    buildBlock(block, tag);
+  }
+
+  return block;
+}
+
+/**
+ * @brief Decode a basic block. Blocks are also split ahead of any instruction
+ * which would trigger a breakpoint, so that only the first instruction of a
+ * block need ever be checked.
+ * @param block
+ * @param tag Start address | Thumb flag.
+ */
+void Machine::buildBlock(BasicBlock* block, uint tag) {
+  bool thumb = (tag & 1) != 0;
+  uint address = tag & ~1;
+  uint length = thumb ? 2 : 4;
+  bool breakpoints = (emulBPFlag[0] & emulBPFlag[1]) != 0;
+
+  block->tag = tag;
+  block->length = 0;
+  block->chain[0] = block->chain[1] = NULL;
+  block->chainNext = 0;
+  block->executions = 0;
+  block->jitCode = NULL;
+
+  do {
+    DecodedInstruction* decoded = lookupDecoded(address, thumb);
+
+    if ((block->length > 0) && breakpoints &&
+        checkBreakpoint(address, decoded->opCode)) {
+      break;
+    }
+
+    block->instructions[block->length++] = *decoded;
+    address += length;
+  } while ((block->length < maxBlockLength) &&
+           !endsBlock(&block->instructions[block->length - 1], thumb));
+
+  block->endAddress = address;
+
+  for (uint word = (tag & ~1) >> 2; word <= (address - 1) >> 2; word++) {
+    uint line = (word & ((memSize >> 2) - 1)) >> codeLineShift;
+    codeLines[line / 32] |= 1 << (line % 32);
+  }
+}
+
+/**
+ * @brief Discard any cached blocks which include the given memory word. Only
+ * words in lines marked as holding code need be looked at; then just the
+ * cache slots of blocks which could start close enough to reach the word.
+ * @param word The word number (address >> 2) which has been written.
+ */
+void Machine::invalidateBlocks(uint word) {
+  uint line = (word & ((memSize >> 2) - 1)) >> codeLineShift;
+
+  if ((codeLines[line / 32] & (1 << (line % 32))) == 0) {
+    return;
+  }
+
+  uint last = (word << 2) + 3;
+  uint first = last - (4 * maxBlockLength - 1);
+  if (first > last) {
+    first = 0;  // Wrapped below address zero
+  }
+
+  for (uint start = first & ~1; start <= last; start += 2) {
+    BasicBlock* block = &blockCache[(start >> 1) & (blockCacheSize - 1)];
+
+    if ((block->tag != decodeInvalid) && ((block->tag & ~1) == start) &&
+        ((block->endAddress - 1) >> 2 >= word)) {
+      block->tag = decodeInvalid;
+    }
+  }
+}
+
+/**
+ * @brief Discard all cached blocks; needed when the breakpoint splits change.
+ */
+void Machine::flushBlocks() {
+  for (uint i = 0; i < blockCacheSize; i++) {
+    blockCache[i].tag = decodeInvalid;
+  }
+
+  for (uint i = 0; i < codeLineWords; i++) {
+    codeLines[i] = 0;
+  }
+}
+
+/**
+ * @brief Run the compiled prefix of a block, if the assumptions it was
+ * compiled under still hold, then do the bookkeeping which "step" would have
+ * done for each instruction it executed.
+ * @param block
+ * @return uint The number of instructions executed; 0 if none.
+ */
+uint Machine::runCompiled(BasicBlock* block) {
+  uint address = block->tag;
+  uchar entryStatus = status;
+
+  if (((status != CLIENT_STATE_RUNNING) && (status != CLIENT_STATE_STEPPING)) ||
+      runThroughBL ||
+      ((stepsToGo != 0) && (stepsToGo < (int)block->jitLength))) {
+    return 0;
+  }
+
+  // Leave a breakpoint for the interpreter to report
+  if (breakpointEnabled &&
+      checkBreakpoint(address, block->instructions[0].opCode)) {
+    return 0;
+  }
+  breakpointEnabled = breakpointEnable;
+  resolveFlags();  // Compiled code works on cpsr directly
+
+  uint executed = block->jitCode((uchar*)r);
+
+  for (uint i = 0; i < executed; i++) {
+    recordFetch(address + 4 * i);
+  }
+  lastAddr = address + 4 * (executed - 1);
+  oldStatus = entryStatus;
+
+  // As "step", the instruction which stopped the emulator is not counted
+  bool running =
+      (status & CLIENT_STATE_CLASS_MASK) == CLIENT_STATE_CLASS_RUNNING;
+  uint counted = running ? executed : executed - 1;
+
+  stepsReset += counted;
+  if (stepsToGo > 0) {
+    stepsToGo -= counted;
+    if (stepsToGo == 0) {
+      status = CLIENT_STATE_STOPPED;
+    }
+  }
+
+  if ((status & CLIENT_STATE_CLASS_MASK) != CLIENT_STATE_CLASS_RUNNING) {
+    breakpointEnabled = false;  // No longer running - allow "continue"
+  }
+
+  return executed;
+}
+
+/**
+ * @brief Execute a single instruction on behalf of compiled code, which does
+ * not keep the PC up to date itself.
+ * @param decoded
+ * @param address
+ */
+void Machine::jitInterpret(DecodedInstruction* decoded, uint address) {
+  r[15] = address;
+  execute(decoded);
+  resolveFlags();
+}
+
+/**
+ * @brief Discard all compiled code, making the whole buffer free again.
+ */
+void Machine::jitReset() {
+  for (uint i = 0; i < blockCacheSize; i++) {
+    blockCache[i].jitCode = NULL;
+  }
 
-    case BR_WP_GET:
-      sendNBytes(emulWPFlag[0], 4);
-      sendNBytes(emulWPFlag[1], 4);
-      break;
+  jitUsed = 0;
+}
 
-    case BR_WP_SET: {
-      int data[2];
-      getNBytes(&data[0], 4);
-      getNBytes(&data[1], 4);
-      temp = data[1] & ~data[0];
-      emulWPFlag[0] &= ~temp;
-      emulWPFlag[1] |= temp;
-      temp = data[0] & emulWPFlag[0];
-      emulWPFlag[1] = (emulWPFlag[1] & ~temp) | (data[1] & temp);
-    } break;
+#if defined(__x86_64__)
+
+// Registers, as encoded; rbx holds the base pointer (&r[0]) throughout
+enum X86Register {
+  xAX = 0,
+  xCX = 1,
+  xDX = 2,
+  xBX = 3,
+  xBP = 5,
+  xSI = 6,
+  xDI = 7,
+  x8 = 8,
+  x9 = 9,
+  x10 = 10,
+  x11 = 11,
+  x12 = 12
+};
 
-    case BR_WP_READ:
-      getChar(&tempchar);
-      temp = tempchar;
-      sendChar(watchpoints[temp].cond);
-      sendChar(watchpoints[temp].size);
-      sendNBytes(watchpoints[temp].addrA, 4);
-      sendNBytes(watchpoints[temp].addrB, 4);
-      sendNBytes(watchpoints[temp].dataA[0], 4);
-      sendNBytes(watchpoints[temp].dataA[1], 4);
-      sendNBytes(watchpoints[temp].dataB[0], 4);
-      sendNBytes(watchpoints[temp].dataB[1], 4);
-      break;
+/**
+ * @brief Compiled code calls these, with the machine as the first argument,
+ * in place of the member functions themselves.
+ */
+int jitReadMemory(Machine* machine, uint address, int size, bool sign,
+                  bool T, int source) {
+  return machine->readMemory(address, size, sign, T, source);
+}
 
-    case BR_WP_WRITE:
-      getChar(&tempchar);
-      temp = tempchar;
-      getChar(&watchpoints[temp].cond);
-      getChar(&watchpoints[temp].size);
-      getNBytes(&watchpoints[temp].addrA, 4);
-      getNBytes(&watchpoints[temp].addrB, 4);
-      getNBytes(&watchpoints[temp].dataA[0], 4);
-      getNBytes(&watchpoints[temp].dataA[1], 4);
-      getNBytes(&watchpoints[temp].dataB[0], 4);
-      getNBytes(&watchpoints[temp].dataB[1], 4);
-      temp = 1 << temp & ~emulWPFlag[0];
-      emulWPFlag[0] |= temp;
-      emulWPFlag[1] |= temp;
-      break;
+void jitWriteMemory(Machine* machine, uint address, int data, int size,
+                    bool T, int source) {
+  machine->writeMemory(address, data, size, T, source);
+}
 
-    case BR_FR_WRITE: {
-      uchar device, length;
-      ringBuffer* pBuff;
+void jitInterpretOn(Machine* machine, DecodedInstruction* d, uint address) {
+  machine->jitInterpret(d, address);
+}
 
-      getChar(&device);
-      pBuff = terminalTable[device][1];
-      getChar(&length);
-      temp = tempchar;
-      while (length-- > 0) {
-        getChar(&tempchar); /* Read character */
-        if (pBuff != NULL)
-          putBuffer(pBuff, tempchar); /*  and put in buffer */
-      }
-      sendChar(0);
-    } break;
+// Condition codes, as encoded in Jcc and SETcc
+constexpr const uchar x86C = 0X2;
+constexpr const uchar x86NC = 0X3;
+constexpr const uchar x86Z = 0X4;
+constexpr const uchar x86NZ = 0X5;
+constexpr const uchar x86O = 0X0;
+constexpr const uchar x86S = 0X8;
+
+// Shifter carry, as tracked while compiling a data operation
+constexpr const int carryUnchanged = 0;
+constexpr const int carryInX10 = 1;
+constexpr const int carrySet = 2;
+constexpr const int carryClear = 3;
+
+void Machine::jitByte(uchar value) {
+  jitBuffer[jitUsed++] = value;
+}
 
-    case BR_FR_READ: {
-      uchar device, max_length;
-      uint i, length, available;
-      ringBuffer* pBuff;
+void Machine::jitWord(uint value) {
+  memcpy(&jitBuffer[jitUsed], &value, 4);
+  jitUsed += 4;
+}
 
-      getChar(&device);
-      pBuff = terminalTable[device][0];
-      getChar(&max_length);
-      available = countBuffer(&terminal0Tx); /* See how many chars we have */
-      if (pBuff == NULL) {
-        length = 0; /* Kill if no corresponding buffer */
-      } else {
-        length = available < max_length ? available : max_length;
-      }
-      sendChar(length);
-      for (i = 0; i < length; i++) /* Send zero or more characters */
-      {
-        uchar c;
-        getBuffer(pBuff, &c);
-        sendChar(c);
-      }
-    } break;
+void Machine::jitPointer(void* value) {
+  memcpy(&jitBuffer[jitUsed], &value, 8);
+  jitUsed += 8;
+}
 
-    default:
-      break;
+/**
+ * @brief Emit a REX prefix, if one is needed to reach r8-r15.
+ */
+void Machine::jitRex(int reg, int rm) {
+  if ((reg >= 8) || (rm >= 8)) {
+    jitByte(0X40 | ((reg & 8) >> 1) | ((rm & 8) >> 3));
   }
 }
 
 /**
- * @brief
- * @param c
+ * @brief Emit the ModRM byte and displacement for an emulator variable,
+ * addressed relative to the base pointer.
  */
-void monitorMemory(uchar c) {
-  int addr;
-  uchar* pointer;
-  int size;
+void Machine::jitAddress(int reg, void* variable) {
+  jitByte(0X80 | ((reg & 7) << 3) | xBX);
+  jitWord((uchar*)variable - (uchar*)r);
+}
 
-  getNBytes(&addr, 4);  // Start address really
-  if ((c & 0x30) == 0x10) {
-    int temp;
-    int reg_bank, reg_number;
+void Machine::jitLoad(int reg, void* variable) {
+  jitRex(reg, 0);
+  jitByte(0X8B);
+  jitAddress(reg, variable);
+}
 
-    switch (addr & 0xE0) {
-      case 0x00:
-        reg_bank = regCurrent;
-        break;
-      case 0x20:
-        reg_bank = regUser;
-        break;
-      case 0x40:
-        reg_bank = regSvc;
-        break;
-      case 0x60:
-        reg_bank = regAbt;
-        break;
-      case 0x80:
-        reg_bank = regUndef;
-        break;
-      case 0xA0:
-        reg_bank = regIrq;
-        break;
-      case 0xC0:
-        reg_bank = regFiq;
-        break;
-      default:
-        reg_bank = regCurrent;
-        break;
-    }
-    reg_number = addr & 0x1F;
+void Machine::jitStore(void* variable, int reg) {
+  jitRex(reg, 0);
+  jitByte(0X89);
+  jitAddress(reg, variable);
+}
 
-    getNBytes(&size, 2); /* Length of transfer */
+void Machine::jitStoreImmediate(void* variable, uint value) {
+  jitByte(0XC7);
+  jitAddress(0, variable);
+  jitWord(value);
+}
 
-    while (size--)
-      if ((c & 8) != 0)
-        sendNBytes(getRegisterMonitor(reg_number++, reg_bank), 4);
-      else {
-        getNBytes(&temp, 4);
-        putRegister(reg_number++, temp, reg_bank);
-      }
-  } else {
-    pointer = memory + (addr & (RAMSIZE - 1));
-    getNBytes(&size, 2);
-    size *= 1 << (c & 7);
-    if (((uchar*)pointer + size) > ((uchar*)memory + RAMSIZE))
-      pointer -= RAMSIZE;
-    if (c & 8)
-      sendCharArray(size, pointer);
-    else
-      getCharArray(size, pointer);
-  }
+void Machine::jitCompareImmediate(void* variable, uint value) {
+  jitByte(0X81);
+  jitAddress(7, variable);
+  jitWord(value);
+}
+
+void Machine::jitMoveImmediate(int reg, uint value) {
+  jitRex(0, reg);
+  jitByte(0XB8 | (reg & 7));
+  jitWord(value);
 }
 
 /**
- * @brief
- * @param c
+ * @brief Register to register ALU operation; "op" is the "r/m, r" form.
  */
-void monitorBreakpoints(uchar c) {
-  runFlags = c & 0x3F;
-  breakpointEnable = (runFlags & 0x10) != 0;
-  breakpointEnabled = (runFlags & 0x01) != 0; /* Break straight away */
-  runThroughBL = (runFlags & 0x02) != 0;
-  runThroughSWI = (runFlags & 0x04) != 0;
-  getNBytes(&stepsToGo, 4);
-  if (stepsToGo == 0)
-    status = CLIENT_STATE_RUNNING;
-  else
-    status = CLIENT_STATE_STEPPING;
+void Machine::jitOp(uchar op, int dst, int src) {
+  jitRex(src, dst);
+  jitByte(op);
+  jitByte(0XC0 | ((src & 7) << 3) | (dst & 7));
 }
 
 /**
- * @brief
- * @param pPollfd
+ * @brief Operation from an opcode group, with a register operand.
  */
-void comm(struct pollfd* pPollfd) {
-  uchar c;
+void Machine::jitGroup(uchar op, int ext, int reg) {
+  jitRex(0, reg);
+  jitByte(op);
+  jitByte(0XC0 | (ext << 3) | (reg & 7));
+}
 
-  if (poll(pPollfd, 1, 0) > 0) {
-    if (read(0, &c, 1) < 0) {
-      std::cout << "Some error occurred!" << std::endl;
-    }  // Look at error return - find EOF & exit
-    switch (c & 0xC0) {
-      case 0x00:
-        monitorOptionsMisc(c);
-        break;
-      case 0x40:
-        monitorMemory(c);
-        break;
-      case 0x80:
-        monitorBreakpoints(c);
-        break;
-      case 0xC0:
-        break;
-    }
-  }
+void Machine::jitOpImmediate(int ext, int reg, uint value) {
+  jitGroup(0X81, ext, reg);  // ext: 0 = ADD, 1 = OR, 4 = AND, 7 = CMP
+  jitWord(value);
+}
+
+void Machine::jitShiftImmediate(int ext, int reg, int distance) {
+  jitGroup(0XC1, ext, reg);  // ext: 1 = ROR, 4 = SHL, 5 = SHR, 7 = SAR
+  jitByte(distance);
+}
+
+void Machine::jitBitTest(int reg, int bit) {
+  jitRex(0, reg);
+  jitByte(0X0F);
+  jitByte(0XBA);
+  jitByte(0XE0 | (reg & 7));
+  jitByte(bit);
 }
 
 /**
- * @brief Get 1 character from host.
- * @param toGet
- * @return int
+ * @brief Load the emulated carry flag into the host carry flag.
  */
-int getChar(uchar* toGet) {
-  return getCharArray(1, toGet);
+void Machine::jitCarryIn() {
+  jitByte(0X0F);
+  jitByte(0XBA);
+  jitAddress(4, &cpsr);
+  jitByte(29);
+}
+
+void Machine::jitSet(uchar cc, int reg) {
+  jitRex(0, reg);
+  jitByte(0X0F);
+  jitByte(0X90 | cc);
+  jitByte(0XC0 | (reg & 7));
+}
+
+void Machine::jitZeroExtend(int reg) {
+  jitRex(reg, reg);
+  jitByte(0X0F);
+  jitByte(0XB6);
+  jitByte(0XC0 | ((reg & 7) << 3) | (reg & 7));
+}
+
+void Machine::jitCall(void* function) {
+  jitByte(0X48);
+  jitByte(0XB8);  // MOV RAX, imm64
+  jitPointer(function);
+  jitByte(0XFF);
+  jitByte(0XD0);  // CALL RAX
 }
 
 /**
- * @brief Send 1 character to host
- * @param toSend
- * @return int
+ * @brief Emit a forward jump, to be linked later.
+ * @return uint Position of its rel32.
  */
-int sendChar(uchar toSend) {
-  return sendCharArray(1, &toSend);
+uint Machine::jitJump(int cc) {
+  if (cc < 0) {
+    jitByte(0XE9);
+  } else {
+    jitByte(0X0F);
+    jitByte(0X80 | cc);
+  }
+  jitWord(0);
+  return jitUsed - 4;
 }
 
 /**
- * @brief Sends N bytes from the supplied value to the host (??), LSB first.
- * @param value
- * @param N
- * @return int The number of bytes believed received successfully (i.e. N=>"Ok")
+ * @brief Point a rel32 at a target, by default the current position.
  */
-int sendNBytes(int value, int N) {
-  uchar buffer[MAX_SERIAL_WORD];
-  int i;
+void Machine::jitLink(uint patch, uint target) {
+  uint rel = target - (patch + 4);
+  memcpy(&jitBuffer[patch], &rel, 4);
+}
 
-  if (N > MAX_SERIAL_WORD)
-    N = MAX_SERIAL_WORD; /* Clip, just in case ... */
+void Machine::jitLink(uint patch) {
+  jitLink(patch, jitUsed);
+}
 
-  for (i = 0; i < N; i++) {
-    buffer[i] = value & 0xFF; /* Byte into buffer */
-    value = value >> 8;       /* Get next byte */
+void Machine::jitReturn(uint count, uint epilogue) {
+  jitMoveImmediate(xAX, count);
+  jitLink(jitJump(-1), epilogue);
+}
+
+void Machine::jitExit(uint patch, uint count, bool setPC, uint pc) {
+  jitExits[jitExitCount++] = {patch, count, setPC, pc};
+}
+
+/**
+ * @brief Load an ARM register as an operand; reading the PC gives address+8.
+ */
+void Machine::jitOperand(int reg, int regNum, uint address) {
+  if (regNum == 15) {
+    jitMoveImmediate(reg, address + 8);
+  } else {
+    jitLoad(reg, &r[regNum]);
   }
+}
 
-  return sendCharArray(N, buffer);
+/**
+ * @brief Shift a register by a constant, as the barrel shifter.
+ * @return true The shifter carry out is in the host carry flag.
+ * @return false The carry is unchanged (LSL #0).
+ */
+bool Machine::jitShift(int reg, int type, int distance) {
+  switch (type) {
+    case 0X0:  // LSL
+      if (distance == 0) {
+        return false;
+      }
+      jitShiftImmediate(4, reg, distance);
+      break;
+    case 0X1:  // LSR
+      if (distance == 32) {
+        jitBitTest(reg, 31);
+        jitMoveImmediate(reg, 0);
+      } else {
+        jitShiftImmediate(5, reg, distance);
+      }
+      break;
+    case 0X2:  // ASR
+      if (distance == 32) {
+        jitBitTest(reg, 31);
+        jitOp(0X19, reg, reg);  // SBB
+      } else {
+        jitShiftImmediate(7, reg, distance);
+      }
+      break;
+    case 0X3:  // ROR
+      jitShiftImmediate(1, reg, distance);
+      break;
+    case 0X4:  // RRX
+      jitCarryIn();
+      jitGroup(0XD1, 3, reg);  // RCR reg, 1
+      break;
+  }
+
+  return true;
 }
 
 /**
- * @brief Gets N bytes from the host (??) into the indicated val_ptr, LSB first.
- * @param valPtr
- * @param N
- * @return int The number of bytes received successfully (i.e. N=>"Ok")
+ * @brief Skip what follows unless an ARM condition holds.
+ * @return uint Position of the rel32 to link past the instruction; 0 if the
+ * condition is always true.
  */
-int getNBytes(int* valPtr, int N) {
-  uchar buffer[MAX_SERIAL_WORD];
-  int i, No_received;
+uint Machine::jitCondition(int cond) {
+  static const uint flag[8] = {zfMask, zfMask, cfMask, cfMask,
+                               nfMask, nfMask, vfMask, vfMask};
 
-  if (N > MAX_SERIAL_WORD) {
-    N = MAX_SERIAL_WORD;  // Clip, just in case ...
+  if (cond == 0XE) {
+    return 0;
   }
-
-  No_received = getCharArray(N, buffer);
-
-  *valPtr = 0;
-
-  for (i = 0; i < No_received; i++) {
-    *valPtr = *valPtr | ((buffer[i] & 0xFF) << (i * 8)); /* Assemble integer */
+  if (cond == 0XF) {
+    return jitJump(-1);
   }
 
-  return No_received;
-}
-
-/**
- * @brief Reads a character array from buffer. Sends charNumber number of
- * characters given by dataPtr.
- * @param charNumber
- * @param dataPtr
- * @return int Number of bytes received.
- */
-int getCharArray(int charNumber, uchar* dataPtr) {
-  int ret = charNumber;
-  int replycount = 0;
-  struct pollfd pollfd;
+  jitLoad(xDX, &cpsr);
 
-  pollfd.fd = 0;
-  pollfd.events = POLLIN;
+  if (cond < 8) {  // Single flag; even = set, odd = clear
+    jitGroup(0XF7, 0, xDX);  // TEST
+    jitWord(flag[cond]);
+    return jitJump(((cond & 1) == 0) ? x86Z : x86NZ);
+  }
 
-  while (charNumber) {
-    if (!poll(&pollfd, 1, -1)) {
-      return ret - charNumber;
-    }
+  if (cond < 0XA) {  // HI, LS
+    jitOpImmediate(4, xDX, cfMask | zfMask);
+    jitOpImmediate(7, xDX, cfMask);
+    return jitJump((cond == 0X8) ? x86NZ : x86Z);
+  }
 
-    replycount = read(0, dataPtr, charNumber);
-    if (replycount < 0) {
-      replycount = 0;
-    }
+  jitOp(0X89, xAX, xDX);  // N ^ V into bit 31 of eax
+  jitShiftImmediate(4, xAX, 3);
+  jitOp(0X31, xAX, xDX);
 
-    charNumber -= replycount;
-    dataPtr += replycount;
+  if (cond < 0XC) {  // GE, LT
+    jitGroup(0XF7, 0, xAX);
+    jitWord(nfMask);
+    return jitJump((cond == 0XA) ? x86NZ : x86Z);
   }
 
-  return ret;
+  jitOpImmediate(4, xAX, nfMask);  // GT, LE
+  jitOpImmediate(4, xDX, zfMask);
+  jitOp(0X09, xAX, xDX);
+  return jitJump((cond == 0XC) ? x86NZ : x86Z);
 }
 
 /**
- * @brief writes an array of bytes in the buffer.
- * @param charNumber number of bytes given by dataPtr
- * @param dataPtr points to the beginning of the sequence to be sent
- * @return int
+ * @brief Fold a host flag, saved by SETcc, into edx at an ARM flag position.
  */
-int sendCharArray(int charNumber, uchar* dataPtr) {
-  if (write(1, dataPtr, charNumber) < 0) {
-    std::cout << "Some error occurred!" << std::endl;
-  }
-
-  return charNumber;  // send char array to the board
+void Machine::jitFoldFlag(int reg, int bit) {
+  jitZeroExtend(reg);
+  jitShiftImmediate(4, reg, bit);
+  jitOp(0X09, xDX, reg);
 }
 
 /**
- * @brief
+ * @brief Write the flags saved in r8b (N), r9b (Z), r10b (C) and r11b (V)
+ * back to the CPSR.
+ * @param arithmetic All four are set; else N, Z and the shifter carry.
+ * @param carry Where a logical operation's carry comes from.
  */
-void emulSetup() {
-  glob1 = 0;
-  glob2 = 0;
+void Machine::jitWriteFlags(bool arithmetic, int carry) {
+  uint keep;
 
-  for (int i = 0; i < 32; i++) {
-    pastOpcAddr[i] = 1;  // Illegal op. code address
+  if (arithmetic) {
+    keep = ~(nfMask | zfMask | cfMask | vfMask);
+  } else if (carry == carryUnchanged) {
+    keep = ~(nfMask | zfMask);
+  } else {
+    keep = ~(nfMask | zfMask | cfMask);
   }
-  pastOpcPtr = 0;
-  pastCount = 0;
-  pastSize = 4;
-
-  int initialMode = 0xC0 | supMode;
-  printOut = false;
 
-  nextFileHandle = 1;
+  jitLoad(xDX, &cpsr);
+  jitOpImmediate(4, xDX, keep);
+  jitFoldFlag(x8, 31);
+  jitFoldFlag(x9, 30);
+
+  if (arithmetic) {
+    jitFoldFlag(x10, 29);
+    jitFoldFlag(x11, 28);
+  } else if (carry == carryInX10) {
+    jitFoldFlag(x10, 29);
+  } else if (carry == carrySet) {
+    jitOpImmediate(1, xDX, cfMask);
+  }
 
-  initialise(0, initialMode);
+  jitStore(&cpsr, xDX);
 }
 
 /**
- * @brief
- * @param instrAddr
- * @param instr
- * @return true
- * @return false
+ * @brief Compile a data processing operation (not writing the PC, nor with a
+ * register specified shift), as "normalDataOp".
  */
-bool checkBreakpoint(uint instrAddr, uint instr) {
-  bool mayBreak = false;
+void Machine::jitDataOp(DecodedInstruction* d, uint address) {
+  int operation = d->operation;
+  bool logical = ((operation & 0X6) == 0) || ((operation & 0XC) == 0XC);
+  int carry = carryUnchanged;
 
-  for (int i = 0; (i < NO_OF_BREAKPOINTS) && !mayBreak; i++) {
-    mayBreak = ((emulBPFlag[0] & emulBPFlag[1] & (1 << i)) !=
-                0);  // Breakpoint is active
+  if ((operation != 0XD) && (operation != 0XF)) {  // MOV and MVN ignore Rn
+    jitOperand(xAX, d->rn, address);
+  }
 
-    // Try address comparison
-    if (mayBreak) {
-      switch (breakpoints[i].cond & 0x0C) {
-        case 0x00:
-        case 0x04:
-          mayBreak = false;
-          break;
-        // Case of between address A and address B
-        case 0x08:
-          if ((instrAddr < breakpoints[i].addrA) ||
-              (instrAddr > breakpoints[i].addrB)) {
-            mayBreak = false;
-          }
-          break;
-        // case of mask
-        case 0x0C:
-          if ((instrAddr & breakpoints[i].addrB) != breakpoints[i].addrA) {
-            mayBreak = false;
-          }
-          break;
+  if (d->immOperand) {
+    jitMoveImmediate(xCX, d->immediate);
+    if (d->immCarry != carryPrevious) {
+      carry = (d->immCarry != 0) ? carrySet : carryClear;
+    }
+  } else {
+    jitOperand(xCX, d->rm, address);
+    if (jitShift(xCX, d->shiftType, d->shiftDistance)) {
+      carry = carryInX10;
+      if (logical && d->setFlags) {
+        jitSet(x86C, x10);
       }
     }
+  }
 
-    // Try data comparison
-    if (mayBreak) {
-      switch (breakpoints[i].cond & 0x03) {
-        case 0x00:
-          mayBreak = false;
-          break;
-
-        case 0x01:
-          mayBreak = false;
-          break;
+  switch (operation) {
+    case 0X0:  // AND
+    case 0X8:  // TST
+      jitOp(0X21, xAX, xCX);
+      break;
+    case 0X1:  // EOR
+    case 0X9:  // TEQ
+      jitOp(0X31, xAX, xCX);
+      break;
+    case 0X2:  // SUB
+    case 0XA:  // CMP
+      jitOp(0X29, xAX, xCX);
+      break;
+    case 0X3:  // RSB
+      jitOp(0X29, xCX, xAX);
+      jitOp(0X89, xAX, xCX);
+      break;
+    case 0X4:  // ADD
+    case 0XB:  // CMN
+      jitOp(0X01, xAX, xCX);
+      break;
+    case 0X5:  // ADC
+      jitCarryIn();
+      jitOp(0X11, xAX, xCX);
+      break;
+    case 0X6:  // SBC - borrow is the inverse of ARM carry
+      jitCarryIn();
+      jitByte(0XF5);  // CMC
+      jitOp(0X19, xAX, xCX);
+      break;
+    case 0X7:  // RSC
+      jitCarryIn();
+      jitByte(0XF5);
+      jitOp(0X19, xCX, xAX);
+      jitOp(0X89, xAX, xCX);
+      break;
+    case 0XC:  // ORR
+      jitOp(0X09, xAX, xCX);
+      break;
+    case 0XD:  // MOV
+      jitOp(0X89, xAX, xCX);
+      break;
+    case 0XE:  // BIC
+      jitGroup(0XF7, 2, xCX);  // NOT
+      jitOp(0X21, xAX, xCX);
+      break;
+    case 0XF:  // MVN
+      jitGroup(0XF7, 2, xCX);
+      jitOp(0X89, xAX, xCX);
+      break;
+  }
 
-        case 0x02:  // Case of between data A and data B
-          if ((instr < breakpoints[i].dataA[0]) ||
-              (instr > breakpoints[i].dataB[0])) {
-            mayBreak = false;
-          }
-          break;
+  // MOV to memory leaves the host flags alone
+  if ((operation & 0XC) != 0X8) {
+    jitStore(&r[d->rd], xAX);
+  }
 
-        case 0x03:  // Case of mask
-          if ((instr & breakpoints[i].dataB[0]) != breakpoints[i].dataA[0]) {
-            mayBreak = false;
-          }
-          break;
-      }
+  if (d->setFlags) {
+    if (logical) {
+      jitOp(0X85, xAX, xAX);  // TEST
+    }
+    jitSet(x86S, x8);
+    jitSet(x86Z, x9);
+    if (!logical) {
+      bool add = (operation == 0X4) || (operation == 0X5) || (operation == 0XB);
+      jitSet(add ? x86C : x86NC, x10);
+      jitSet(x86O, x11);
     }
+    jitWriteFlags(!logical, carry);
   }
-  return mayBreak;
 }
 
 /**
- * @brief
+ * @brief Leave compiled code if the emulator has stopped (e.g. at a
+ * watchpoint) or the block has been overwritten.
  */
-void executeInstruction() {
-  int i;
+void Machine::jitCheck(BasicBlock* block, bool store, uint count, bool setPC,
+                       uint pc) {
+  jitRex(xAX, 0);
+  jitByte(0X0F);
+  jitByte(0XB6);  // MOVZX eax, byte
+  jitAddress(xAX, &status);
+  jitOpImmediate(4, xAX, CLIENT_STATE_CLASS_MASK);
+  jitOpImmediate(7, xAX, CLIENT_STATE_CLASS_RUNNING);
+  jitExit(jitJump(x86NZ), count, setPC, pc);
+
+  if (store) {
+    jitCompareImmediate(&block->tag, block->tag);
+    jitExit(jitJump(x86NZ), count, setPC, pc);
+  }
+}
 
-  uint instr_addr =
-      getRegister(15, regCurrent) - instructionLength(cpsr, tfMask);
-  lastAddr = getRegister(15, regCurrent) - instructionLength(cpsr, tfMask);
+/**
+ * @brief Compile a word or byte load or store (not of the PC), as "transfer".
+ * Memory is accessed through readMemory and writeMemory.
+ */
+void Machine::jitTransfer(DecodedInstruction* d, uint address,
+                          BasicBlock* block, uint count) {
+  uint opCode = d->opCode;
+  int rn = (opCode & rnMask) >> 16;
+  int rd = (opCode & rdMask) >> 12;
+  bool pre = (opCode & preMask) != 0;
+  bool writeBack = !pre || ((opCode & writeBackMask) != 0);
+  bool load = (opCode & loadMask) != 0;
+  bool T = !pre && ((opCode & writeBackMask) != 0);
+  int size = ((opCode & byteMask) == 0) ? 4 : 1;
+  bool registerOffset = (opCode & immMask) != 0;
+  uint offset = opCode & 0XFFF;
+
+  jitOperand(xAX, rn, address);
+
+  if (registerOffset) {
+    int type = (offset & 0X060) >> 5;
+    int distance = (offset & 0XF80) >> 7;
+
+    if (distance == 0) { /* Special cases */
+      if (type == 3) {
+        type = 4; /* RRX */
+      } else if (type != 0) {
+        distance = 32; /* LSL excluded */
+      }
+    }
 
-  /* FETCH */
-  auto instr = fetch();
+    jitOperand(xCX, offset & 0XF, address);
+    jitShift(xCX, type, distance);
+    if ((opCode & upMask) == 0) {
+      jitGroup(0XF7, 3, xCX);  // NEG
+    }
+  } else if ((opCode & upMask) == 0) {
+    offset = -offset;
+  }
 
-  if ((breakpointEnabled) && (status != CLIENT_STATE_RUNNING_SWI)) {
-    if (checkBreakpoint(instr_addr, instr)) {
-      status = CLIENT_STATE_BREAKPOINT;
-      return;
+  if (pre) {
+    if (registerOffset) {
+      jitOp(0X01, xAX, xCX);
+    } else {
+      jitOpImmediate(0, xAX, offset);
     }
   }
-  breakpointEnabled = breakpointEnable; /* More likely after first fetch */
 
-  /* BL instruction */
-  if (((instr & 0x0F000000) == 0x0B000000) && runThroughBL) {
-    saveState(CLIENT_STATE_RUNNING_BL);
-  } else {
-    if (((instr & 0x0F000000) == 0x0F000000) && runThroughSWI) {
-      saveState(CLIENT_STATE_RUNNING_SWI);
+  jitOp(0X89, x12, xAX);  // Transfer address; preserved across the call
+
+  if (writeBack) {
+    jitOp(0X89, xBP, xAX);
+    if (!pre) {
+      if (registerOffset) {
+        jitOp(0X01, xBP, xCX);
+      } else {
+        jitOpImmediate(0, xBP, offset);
+      }
     }
   }
 
-  /* Execute */
-  execute(instr);
-}
+  jitByte(0X48);
+  jitByte(0XB8 | xDI);  // MOV RDI, imm64
+  jitPointer(this);
+  jitOp(0X89, xSI, x12);
+  if (load) {
+    jitMoveImmediate(xDX, size);
+    jitMoveImmediate(xCX, false);
+    jitMoveImmediate(x8, T);
+    jitMoveImmediate(x9, memData);
+    jitCall((void*)jitReadMemory);
+    jitStore(&r[rd], xAX);
+  } else {
+    jitOperand(xDX, rd, address);
+    jitMoveImmediate(xCX, size);
+    jitMoveImmediate(x8, T);
+    jitMoveImmediate(x9, memData);
+    jitCall((void*)jitWriteMemory);
+  }
 
-/**
- * @brief Save state for leaving "procedure" {PC, SP, Mode, current state}
- * @param newStatus
- */
-void saveState(uchar newStatus) {
-  runUntilPC = getRegister(15, regCurrent);  // Incremented once: correct here
-  runUntilSP = getRegister(13, regCurrent);
-  runUntilMode = getRegister(16, regCurrent) & 0x3F;  // Just the mode bits
-  runUntilStatus = status;
-  status = newStatus;
+  if (writeBack) {
+    jitStore(&r[rn], xBP);
+  }
+
+  jitCheck(block, !load, count, true, address + 4);
 }
 
 /**
- * @brief
+ * @brief Compile any other instruction as a call to the interpreter.
  */
-void boardreset() {
-  stepsReset = 0;
-  initialise(0, supMode);
+void Machine::jitFallBack(DecodedInstruction* d, uint address,
+                          BasicBlock* block, uint count) {
+  jitByte(0X48);
+  jitByte(0XB8 | xDI);  // MOV RDI, imm64
+  jitPointer(this);
+  jitByte(0X48);
+  jitByte(0XB8 | xSI);  // MOV RSI, imm64
+  jitPointer(d);
+  jitMoveImmediate(xDX, address);
+  jitCall((void*)jitInterpretOn);
+
+  jitCompareImmediate(&r[15], address + 4);
+  jitExit(jitJump(x86NZ), count, false, 0);
+  jitCheck(block, true, count, false, 0);
 }
 
 /**
- * @brief
- * @param startAddr
- * @param initMode
+ * @brief Whether an instruction can be compiled inline (rather than through
+ * the interpreter).
  */
-void initialise(uint startAddr, int initMode) {
-  cpsr = 0X000000C0 | initMode;  // Disable interrupts
-  r[15] = startAddr;
-  oldStatus = CLIENT_STATE_RESET;
-  status = CLIENT_STATE_RESET;
+bool Machine::jitNative(DecodedInstruction* d) {
+  uint opCode = d->opCode;
+
+  if (d->aluOp) {
+    return (d->rd != 15) && !d->regShift;
+  }
+
+  if (d->handler == HANDLER(armTransfer)) {
+    bool writeBack =
+        ((opCode & preMask) == 0) || ((opCode & writeBackMask) != 0);
+    return ((opCode & undefMask) != undefCode) &&
+           ((opCode & rdMask) != rdMask) &&
+           !(writeBack && ((opCode & rnMask) == rnMask));
+  }
+
+  return false;
 }
 
 /**
- * @brief
- * @param opCode
+ * @brief Translate the leading run of a (hot, ARM) block to x86-64: data
+ * processing and single word/byte transfers inline, B and BL to end it, and
+ * any other instructions before the end through the interpreter.
+ * @param block
  */
-void execute(uint opCode) {
-  incPC(); /* Easier here than later */
+void Machine::jitCompile(BasicBlock* block) {
+  uint length = 0;
+  bool branch;
 
-  /* ARM or THUMB ? */
-  if ((cpsr & tfMask) != 0) /* Thumb */
-  {
-    opCode = opCode & 0XFFFF; /* 16-bit op. code */
-    switch (opCode & 0XE000) {
-      case 0X0000:
-        data0(opCode);
-        break;
-      case 0X2000:
-        data1(opCode);
-        break;
-      case 0X4000:
-        dataTransfer(opCode);
-        break;
-      case 0X6000:
-        transfer0(opCode);
-        break;
-      case 0X8000:
-        transfer1(opCode);
-        break;
-      case 0XA000:
-        spPC(opCode);
-        break;
-      case 0XC000:
-        lsmB(opCode);
-        break;
-      case 0XE000:
-        thumbBranch(opCode);
-        break;
-    }
-  } else {
-    /* Check condition */
-    if ((checkCC(opCode >> 28) == true) ||
-        ((opCode & 0XFE000000) == 0XFA000000)) /* Nasty non-orthogonal BLX */
-    {
-      switch ((opCode >> 25) & 0X00000007) {
-        case 0X0:
-          dataOp(opCode);
-          break; /* includes load/store hw & sb */
-        case 0X1:
-          dataOp(opCode);
-          break; /* data processing & MSR # */
-        case 0X2:
-          transfer(opCode);
-          break;
-        case 0X3:
-          transfer(opCode);
-          break;
-        case 0X4:
-          multiple(opCode);
-          break;
-        case 0X5:
-          branch(opCode);
-          break;
-        case 0X6:
-          undefined();
-          break;
-        case 0X7:
-          mySystem(opCode);
-          break;
-      }
+  while ((length < block->length) &&
+         !endsBlock(&block->instructions[length], false)) {
+    length++;
+  }
+
+  branch = (length < block->length) &&
+           (block->instructions[length].handler == HANDLER(armBranch)) &&
+           (block->instructions[length].cond != 0XF);  // Not BLX
+  if (branch) {
+    length++;
+  }
+
+  if (length == 0) {
+    return;
+  }
+
+  if (jitBuffer == NULL) {
+    void* buffer = mmap(NULL, jitBufferSize, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED) {
+      fprintf(stderr, "No memory for compiled code - JIT disabled\n");
+      jitActive = false;
+      return;
     }
+    jitBuffer = (uchar*)buffer;
+  } else if (!jitProtect(true)) {
+    return;
   }
-}
 
-/**
- * @brief
- * @param opCode
- * @return int
- */
-int isItSBHW(uint opCode) {
-  if (((opCode & 0X0E000090) == 0X00000090) &&
-      ((opCode & 0X00000060) != 0X00000000)     /* No multiplies */
-      && ((opCode & 0X00100040) != 0X00000040)) /* No signed stores */
-  {
-    if (((opCode & 0X00400000) != 0) || ((opCode & 0X00000F00) == 0))
-      return true;
-    else
-      return false;
-  } else
-    return false;
-}
+  if (jitUsed + jitMaxBlockCode > jitBufferSize) {
+    jitReset();
+  }
 
-/**
- * @brief
- * @param opCode
- */
-void dataOp(uint opCode) {
-  int operation;
+  // Epilogue first, so that every exit is a backward jump to it
+  uint epilogue = jitUsed;
+  jitByte(0X41);
+  jitByte(0X5C);  // POP R12
+  jitByte(0X5D);  // POP RBP
+  jitByte(0X5B);  // POP RBX
+  jitByte(0XC3);  // RET
+
+  uint entry = jitUsed;
+  jitByte(0X53);  // PUSH RBX
+  jitByte(0X55);  // PUSH RBP
+  jitByte(0X41);
+  jitByte(0X54);  // PUSH R12 - stack now aligned for calls
+  jitByte(0X48);
+  jitByte(0X89);
+  jitByte(0XFB);  // MOV RBX, RDI
+
+  jitExitCount = 0;
+  uint address = block->tag;
+
+  for (uint i = 0; i < length; i++, address += 4) {
+    DecodedInstruction* d = &block->instructions[i];
+
+    if (branch && (i == length - 1)) {
+      int offset = (d->opCode & branchField) << 2;
+      if ((d->opCode & branchSign) != 0) {
+        offset = offset | (~(branchField << 2) & 0XFFFFFFFC);  // sign extend
+      }
 
-  if (((opCode & mulMask) == mulOp) || ((opCode & longMulMask) == longMulOp)) {
-    myMulti(opCode);
-  } else if (isItSBHW(opCode) == true) {
-    transferSBHW(opCode);
-  } else if ((opCode & swpMask) == swpOp) {
-    swap(opCode);
-  } else {
-    operation = (opCode & dataOpMask) >> 21;
+      uint skip = jitCondition(d->cond);
+      if ((d->opCode & linkMask) != 0) {
+        jitStoreImmediate(&r[14], address + 4);
+      }
+      jitStoreImmediate(&r[15], address + 8 + offset);
+      jitReturn(length, epilogue);
+
+      if (skip != 0) {
+        jitLink(skip);
+        jitStoreImmediate(&r[15], address + 4);
+        jitReturn(length, epilogue);
+      }
+    } else if (jitNative(d)) {
+      uint skip = jitCondition(d->cond);
 
-    /* TST, TEQ, CMP, CMN - all lie in following range, but have S set */
-    if ((opCode & dataExtMask) == arithExt) /* PSR transfers OR BX */
-    {
-      if ((opCode & 0X0FBF0FFF) == 0X010F0000) {
-        mrs(opCode); /* MRS */
-      } else if (((opCode & 0X0DB6F000) == 0X0120F000) &&
-                 ((opCode & 0X02000010) != 0X00000010)) {
-        msr(opCode);                                  /* MSR */
-      } else if ((opCode & 0X0FFFFFD0) == 0X012FFF10) /* BX/BLX */
-      {
-        bx(opCode & rmMask, opCode & 0X00000020);
-      } else if ((opCode & 0XFFF000F0) == 0XE1200070) {
-        breakpoint(); /* Breakpoint */
-      } else if ((opCode & 0X0FFF0FF0) == 0X016F0F10) {
-        clz(opCode); /* CLZ */
+      if (d->aluOp) {
+        jitDataOp(d, address);
       } else {
-        undefined();
+        jitTransfer(d, address, block, i + 1);
+      }
+
+      if (skip != 0) {
+        jitLink(skip);
       }
     } else {
-      normalDataOp(opCode, operation); /* All data processing operations */
+      jitFallBack(d, address, block, i + 1);
+    }
+  }
+
+  if (!branch) {
+    jitStoreImmediate(&r[15], address);
+    jitReturn(length, epilogue);
+  }
+
+  for (uint i = 0; i < jitExitCount; i++) {
+    jitLink(jitExits[i].patch);
+    if (jitExits[i].setPC) {
+      jitStoreImmediate(&r[15], jitExits[i].pc);
     }
+    jitReturn(jitExits[i].count, epilogue);
+  }
+
+  if (jitProtect(false)) {
+    block->jitCode = (CompiledBlock)&jitBuffer[entry];
+    block->jitLength = length;
+  }
+}
+
+/**
+ * @brief Make the code buffer writable, to emit code, or executable, to run
+ * it. Should that fail, all compiled code is discarded and no more compiled.
+ * @param writable
+ * @return bool Whether the buffer could be changed.
+ */
+bool Machine::jitProtect(bool writable) {
+  int protection = writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC;
+
+  if (mprotect(jitBuffer, jitBufferSize, protection) == 0) {
+    return true;
   }
+  fprintf(stderr, "Cannot protect compiled code - JIT disabled\n");
+  jitReset();
+  jitActive = false;
+  return false;
+}
+
+#else
+
+/**
+ * @brief No code generator for this host: everything is interpreted.
+ */
+void Machine::jitCompile(BasicBlock* block) {
+  jitActive = false;
 }
 
+#endif
+
 /**
  * @brief
  * @param opCode
  */
-void transferSBHW(uint opCode) {
+void Machine::transferSBHW(uint opCode) {
   uint address;
   int size;
   int offset, rd;
@@ -1198,7 +5583,7 @@ void transferSBHW(uint opCode) {
  * @brief
  * @param opCode
  */
-void mrs(uint opCode) {
+void Machine::mrs(uint opCode) {
   if ((opCode & 0X00400000) == 0) {
     putRegister((opCode & rdMask) >> 12, cpsr, regCurrent);
   } else {
@@ -1210,7 +5595,7 @@ void mrs(uint opCode) {
  * @brief
  * @param opCode
  */
-void msr(uint opCode) {
+void Machine::msr(uint opCode) {
   int mask, source;
 
   switch (opCode & 0X00090000) {
@@ -1242,7 +5627,7 @@ void msr(uint opCode) {
   }
 
   if ((opCode & 0X00400000) == 0)
-    cpsr = (cpsr & ~mask) | source;
+    writeCPSR((cpsr & ~mask) | source);
   else
     spsr[cpsr & modeMask] = (spsr[cpsr & modeMask] & ~mask) | source;
 }
@@ -1252,7 +5637,7 @@ void msr(uint opCode) {
  * @param rm
  * @param link Link is performed if "link" is NON-ZERO
  */
-void bx(uint rm, int link) {
+void Machine::bx(uint rm, int link) {
   int offset, t_bit;
 
   int PC = getRegister(15, regCurrent);
@@ -1277,6 +5662,9 @@ void bx(uint rm, int link) {
 
   if (link != 0) {
     putRegister(14, PC, regCurrent); /* Link if BLX */
+    if (profiler != NULL) {
+      profiler->call(PC & ~1);
+    }
   }
 }
 
@@ -1284,7 +5672,7 @@ void bx(uint rm, int link) {
  * @brief
  * @param opCode
  */
-void myMulti(uint opCode) {
+void Machine::myMulti(uint opCode) {
   int acc;
 
   // Normal
@@ -1361,7 +5749,7 @@ void myMulti(uint opCode) {
  * @brief
  * @param opCode
  */
-void swap(uint opCode) {
+void Machine::swap(uint opCode) {
   uint address, data, size;
 
   address = getRegister((opCode & rnMask) >> 16, regCurrent);
@@ -1379,24 +5767,22 @@ void swap(uint opCode) {
 
 /**
  * @brief
- * @param opCode
- * @param operation
+ * @param decoded
  */
-void normalDataOp(uint opCode, int operation) {
+void Machine::normalDataOp(DecodedInstruction* decoded) {
   int rd, a, b, mode;
-  int shift_carry;
+  int shift_carry, carry;
   int CPSR_special;
+  int operation = decoded->operation;
 
   mode = cpsr & modeMask;
   CPSR_special = false;
   shift_carry = 0;
-  a = getRegister((opCode & rnMask) >> 16,
-                  regCurrent);  // force_user = false
+  a = getRegister(decoded->rn, regCurrent);  // force_user = false
+  b = bDecoded(decoded, &shift_carry);
 
-  if ((opCode & immMask) == 0) {
-    b = bReg(opCode & op2Mask, &shift_carry);
-  } else {
-    b = bImmediate(opCode & op2Mask, &shift_carry);
+  if (decoded->rd == 0XF) {
+    resolveFlags();  // cpsr may be replaced wholesale
   }
 
   // R15s
@@ -1417,18 +5803,21 @@ void normalDataOp(uint opCode, int operation) {
       rd = a + b;
       break;  // ADD
     case 0X5:
+      carry = evaluateFlags() & cfMask;
       rd = a + b;
-      if ((cpsr & cfMask) != 0)
+      if (carry != 0)
         rd = rd + 1;
       break;  // ADC
     case 0X6:
+      carry = evaluateFlags() & cfMask;
       rd = a - b - 1;
-      if ((cpsr & cfMask) != 0)
+      if (carry != 0)
         rd = rd + 1;
       break;  // SBC
     case 0X7:
+      carry = evaluateFlags() & cfMask;
       rd = b - a - 1;
-      if ((cpsr & cfMask) != 0)
+      if (carry != 0)
         rd = rd + 1;
       break;  // RSC
     case 0X8:
@@ -1438,10 +5827,10 @@ void normalDataOp(uint opCode, int operation) {
       rd = a ^ b;  // TEQ
 
       // TEQP
-      if ((opCode & rdMask) == 0XF000) {
+      if (decoded->rd == 0XF) {
         CPSR_special = true;
         if (mode != userMode)
-          cpsr = spsr[mode];
+          writeCPSR(spsr[mode]);
       }
       break;
     case 0XA:
@@ -1466,16 +5855,16 @@ void normalDataOp(uint opCode, int operation) {
 
   // Return result unless a compare
   if ((operation & 0XC) != 0X8) {
-    putRegister((opCode & rdMask) >> 12, rd, regCurrent);
+    putRegister(decoded->rd, rd, regCurrent);
   }
 
   // S-bit && Want to change CPSR
-  if (((opCode & sMask) != 0) && (CPSR_special != true)) {
+  if (decoded->setFlags && (CPSR_special != true)) {
     // PC and S-bit
-    if (((opCode & rdMask) >> 12) == 0XF) {
+    if (decoded->rd == 0XF) {
       // restore saved CPSR
       if (mode != userMode) {
-        cpsr = spsr[mode];
+        writeCPSR(spsr[mode]);
       } else {
         fprintf(stderr, "SPSR_user read attempted\n");
       }
@@ -1491,12 +5880,7 @@ void normalDataOp(uint opCode, int operation) {
         case 0XD:           // MOV
         case 0XE:           // BIC
         case 0XF:           // MVN
-          setNZ(rd);
-          if (shift_carry == true) {
-            cpsr = cpsr | cfMask;  // CF := output
-          } else {
-            cpsr = cpsr & ~cfMask;  // from shifter
-          }
+          setLogicalFlags(rd, shift_carry);  // CF := output from shifter
           break;
 
         case 0X2:  // SUB
@@ -1505,7 +5889,7 @@ void normalDataOp(uint opCode, int operation) {
           break;
 
         case 0X6:  // SBC - Needs more testing
-          setFlags(flagSub, a, b, rd, cpsr & cfMask);
+          setFlags(flagSub, a, b, rd, carry);
           break;
 
         case 0X3:  // RSB
@@ -1513,7 +5897,7 @@ void normalDataOp(uint opCode, int operation) {
           break;
 
         case 0X7:  // RSC
-          setFlags(flagSub, b, a, rd, cpsr & cfMask);
+          setFlags(flagSub, b, a, rd, carry);
           break;
 
         case 0X4:  // ADD
@@ -1522,20 +5906,176 @@ void normalDataOp(uint opCode, int operation) {
           break;
 
         case 0X5:  // ADC
-          setFlags(flagAdd, a, b, rd, cpsr & cfMask);
+          setFlags(flagAdd, a, b, rd, carry);
           break;
       }
     }
   }
 }
 
+/**
+ * @brief Operand 2 of a data processing instruction, specialised for its
+ * form. Shifts by an immediate have their special cases (LSR/ASR #32, RRX)
+ * sorted out at decode time, so each is a couple of operations; the carry
+ * out is only worked out when it will be used.
+ * @param decoded
+ * @param cf Shifter carry out, or carryPrevious if the carry is unaffected
+ * @return int
+ */
+template <uint form, bool carryOut>
+inline int Machine::shifterOperand(DecodedInstruction* decoded, int* cf) {
+  if constexpr (form == operandImmediate) {
+    if constexpr (carryOut) {
+      *cf = decoded->immCarry;
+    }
+    return decoded->immediate;
+  } else if constexpr (form == operandRegShift) {
+    return bDecoded(decoded, cf);
+  } else {
+    uint reg = getRegister(decoded->rm, regCurrent);
+    uint distance = decoded->shiftDistance;
+
+    if constexpr (form == operandRegister) {
+      return reg;
+    } else if constexpr (form == operandLSL) {  // 1 to 31
+      if constexpr (carryOut) {
+        *cf = (reg >> (32 - distance)) & bit0;
+      }
+      return reg << distance;
+    } else if constexpr (form == operandLSR) {  // 1 to 32
+      if constexpr (carryOut) {
+        *cf = (reg >> (distance - 1)) & bit0;
+      }
+      return (distance == 32) ? 0 : reg >> distance;
+    } else if constexpr (form == operandASR) {  // 1 to 32
+      if constexpr (carryOut) {
+        *cf = (reg >> (distance - 1)) & bit0;
+      }
+      return (int)reg >> ((distance == 32) ? 31 : distance);
+    } else if constexpr (form == operandROR) {  // 1 to 31
+      if constexpr (carryOut) {
+        *cf = (reg >> (distance - 1)) & bit0;
+      }
+      return (reg >> distance) | (reg << (32 - distance));
+    } else {  // RRX
+      if constexpr (carryOut) {
+        *cf = reg & bit0;
+      }
+      return (reg >> 1) | (((evaluateFlags() & cfMask) != 0) ? bit31 : 0);
+    }
+  }
+}
+
+/**
+ * @brief A data processing instruction specialised at compile time for its
+ * operation, operand form and S-bit, so each carries only the work needed.
+ * Used for any destination but the PC; those are left to normalDataOp.
+ * @param decoded
+ */
+template <uint operation, uint form, bool setsFlags>
+void Machine::dataOp(DecodedInstruction* decoded) {
+  constexpr bool logical = ((operation & 0X6) == 0) || (operation >= 0XC);
+  int rd, a = 0, b;
+  int shift_carry = carryPrevious, carry = 0;
+
+  if constexpr ((operation != 0XD) && (operation != 0XF)) {
+    a = getRegister(decoded->rn, regCurrent);  // MOV and MVN ignore Rn
+  }
+
+  b = shifterOperand<form, setsFlags && logical>(decoded, &shift_carry);
+
+  if constexpr ((operation >= 0X5) && (operation <= 0X7)) {
+    carry = evaluateFlags() & cfMask;
+  }
+
+  switch (operation) {
+    case 0X0:  // AND
+    case 0X8:  // TST
+      rd = a & b;
+      break;
+    case 0X1:  // EOR
+    case 0X9:  // TEQ
+      rd = a ^ b;
+      break;
+    case 0X2:  // SUB
+    case 0XA:  // CMP
+      rd = a - b;
+      break;
+    case 0X3:  // RSB
+      rd = b - a;
+      break;
+    case 0X4:  // ADD
+    case 0XB:  // CMN
+      rd = a + b;
+      break;
+    case 0X5:  // ADC
+      rd = a + b + (carry != 0);
+      break;
+    case 0X6:  // SBC
+      rd = a - b - (carry == 0);
+      break;
+    case 0X7:  // RSC
+      rd = b - a - (carry == 0);
+      break;
+    case 0XC:  // ORR
+      rd = a | b;
+      break;
+    case 0XD:  // MOV
+      rd = b;
+      break;
+    case 0XE:  // BIC
+      rd = a & ~b;
+      break;
+    case 0XF:  // MVN
+      rd = ~b;
+      break;
+  }
+
+  if constexpr ((operation & 0XC) != 0X8) {
+    r[decoded->rd] = rd;  // Not the PC, so always the active register
+  }
+
+  if constexpr (setsFlags) {
+    if constexpr (logical) {
+      setLogicalFlags(rd, shift_carry);  // CF := output from shifter
+    } else if constexpr ((operation == 0X2) || (operation == 0XA)) {
+      setFlags(flagSub, a, b, rd, 1);  // SUB, CMP
+    } else if constexpr (operation == 0X6) {
+      setFlags(flagSub, a, b, rd, carry);  // SBC
+    } else if constexpr (operation == 0X3) {
+      setFlags(flagSub, b, a, rd, 1);  // RSB
+    } else if constexpr (operation == 0X7) {
+      setFlags(flagSub, b, a, rd, carry);  // RSC
+    } else if constexpr ((operation == 0X4) || (operation == 0XB)) {
+      setFlags(flagAdd, a, b, rd, 0);  // ADD, CMN
+    } else {
+      setFlags(flagAdd, a, b, rd, carry);  // ADC
+    }
+  }
+}
+
+// Indexed by operation, operand form and S-bit
+#define DATA_OP_FORM(op, form) \
+  {HANDLER(dataOp<op, form, false>), HANDLER(dataOp<op, form, true>)}
+#define DATA_OP_ROW(op)                                              \
+  {DATA_OP_FORM(op, operandImmediate), DATA_OP_FORM(op, operandRegister), \
+   DATA_OP_FORM(op, operandLSL),       DATA_OP_FORM(op, operandLSR),      \
+   DATA_OP_FORM(op, operandASR),       DATA_OP_FORM(op, operandROR),      \
+   DATA_OP_FORM(op, operandRRX),       DATA_OP_FORM(op, operandRegShift)}
+
+InstructionHandler dataOpTable[16][operandForms][2] = {
+    DATA_OP_ROW(0X0), DATA_OP_ROW(0X1), DATA_OP_ROW(0X2), DATA_OP_ROW(0X3),
+    DATA_OP_ROW(0X4), DATA_OP_ROW(0X5), DATA_OP_ROW(0X6), DATA_OP_ROW(0X7),
+    DATA_OP_ROW(0X8), DATA_OP_ROW(0X9), DATA_OP_ROW(0XA), DATA_OP_ROW(0XB),
+    DATA_OP_ROW(0XC), DATA_OP_ROW(0XD), DATA_OP_ROW(0XE), DATA_OP_ROW(0XF)};
+
 /**
  * @brief shift type: 00 = LSL, 01 = LSR, 10 = ASR, 11 = ROR
  * @param op2
  * @param cf
  * @return int
  */
-int bReg(int op2, int* cf) {
+int Machine::bReg(int op2, int* cf) {
   uint shift_type, reg, distance, result;
   reg = getRegister(op2 & 0X00F, regCurrent); /* Register */
   shift_type = (op2 & 0X060) >> 5;            /* Type of shift */
@@ -1590,7 +6130,7 @@ int bReg(int op2, int* cf) {
  * @param cf
  * @return int
  */
-int bImmediate(int op2, int* cf) {
+int Machine::bImmediate(int op2, int* cf) {
   uint x, y;
   int dummy;
 
@@ -1607,11 +6147,60 @@ int bImmediate(int op2, int* cf) {
   return ror(x, y, &dummy); /* Circular rotation */
 }
 
+/**
+ * @brief The shifter operand of a predecoded data processing instruction;
+ * equivalent to bReg/bImmediate without the field extraction.
+ * @param decoded
+ * @param cf Shifter carry out, or carryPrevious if the carry is unaffected
+ * @return int
+ */
+int Machine::bDecoded(DecodedInstruction* decoded, int* cf) {
+  uint reg, distance, result;
+
+  if (decoded->immOperand) {
+    *cf = decoded->immCarry;
+    return decoded->immediate;
+  }
+
+  reg = getRegister(decoded->rm, regCurrent);
+  if (decoded->regShift) {
+    distance = getRegister(decoded->rs, regCurrent) & 0XFF;
+  } else {
+    distance = decoded->shiftDistance;
+  }
+
+  *cf = carryPrevious; /* Unless shifted */
+  switch (decoded->shiftType) {
+    case 0X0:
+      result = lsl(reg, distance, cf);
+      break; /* LSL */
+    case 0X1:
+      result = lsr(reg, distance, cf);
+      break; /* LSR */
+    case 0X2:
+      result = asr(reg, distance, cf);
+      break; /* ASR */
+    case 0X3:
+      result = ror(reg, distance, cf);
+      break;  /* ROR */
+    case 0X4: /* RRX #1 */
+      result = reg >> 1;
+      if ((evaluateFlags() & cfMask) == 0)
+        result = result & ~bit31;
+      else
+        result = result | bit31;
+      *cf = ((reg & bit0) != 0);
+      break;
+  }
+
+  return result;
+}
+
 /**
  * @brief
  * @param opCode
  */
-void clz(uint opCode) {
+void Machine::clz(uint opCode) {
   int i, j;
 
   j = getRegister(opCode & rmMask, regCurrent);
@@ -1633,7 +6222,7 @@ void clz(uint opCode) {
  * @brief
  * @param opCode
  */
-void transfer(uint opCode) {
+void Machine::transfer(uint opCode) {
   uint address;
   int offset, rd, size;
   bool T;
@@ -1680,7 +6269,7 @@ void transfer(uint opCode) {
  * @param sbhw
  * @return int
  */
-int transferOffset(int op2, int add, int imm, bool sbhw) {
+int Machine::transferOffset(int op2, int add, int imm, bool sbhw) {
   int offset;
   int cf;  // Dummy parameter
 
@@ -1713,7 +6302,7 @@ int transferOffset(int op2, int add, int imm, bool sbhw) {
  * @brief
  * @param opCode
  */
-void multiple(uint opCode) {
+void Machine::multiple(uint opCode) {
   if ((opCode & loadMask) == 0) {
     stm((opCode & 0X01800000) >> 23, (opCode & rnMask) >> 16,
         opCode & 0X0000FFFF, opCode & writeBackMask, opCode & userMask);
@@ -1724,29 +6313,31 @@ void multiple(uint opCode) {
 }
 
 /**
- * @brief
- * @param source
- * @param first
- * @return int
+ * @brief Whether a block transfer may go straight between the registers and
+ * memory: it must lie wholly within memory and touch neither the tube nor a
+ * page with a watchpoint on it.
+ * @param address The lowest address transferred (word aligned).
+ * @param count The number of words.
+ * @return true
+ * @return false
  */
-int bitCount(uint source, int* first) {
-  int count = 0;
-  int reg = 0;
-  *first = -1;
-
-  while (source != 0) {
-    if ((source & bit0) != 0) {
-      count = count + 1;
-      if (*first < 0) {
-        *first = reg;
-      }
-    }
+bool Machine::directTransfer(uint address, int count) {
+  uint end = address + 4 * count;
 
-    source = source >> 1;
-    reg = reg + 1;
+  if ((address >= memSize) || ((uint)(4 * count) > memSize - address)) {
+    return false;
+  }
+  if ((tubeAddress != 0) && (tubeAddress >= address) && (tubeAddress < end)) {
+    return false;
+  }
+  if ((runFlags & 0x20) && (watchedPage(address) || watchedPage(end - 1))) {
+    return false;
+  }
+  if (tracer != NULL) {
+    return false;  // Each word is traced on the way
   }
 
-  return count;
+  return true;
 }
 
 /**
@@ -1757,13 +6348,13 @@ int bitCount(uint source, int* first) {
  * @param writeBack
  * @param hat
  */
-void ldm(int mode, int rn, int regList, bool writeBack, bool hat) {
-  int address, new_base, count, first_reg, reg, data;
+void Machine::ldm(int mode, int rn, int regList, bool writeBack, bool hat) {
+  int address, new_base, count, reg, data;
   int force_user;
   bool r15_inc;  // internal `bool'
 
   address = getRegister(rn, regCurrent);
-  count = bitCount(regList, &first_reg);
+  count = __builtin_popcount(regList);
   r15_inc = (regList & 0X00008000) != 0;  // R15 in list
 
   switch (mode) {
@@ -1797,6 +6388,15 @@ void ldm(int mode, int rn, int regList, bool writeBack, bool hat) {
     force_user = regCurrent;
   }
 
+  // The direct path consumes the list, leaving nothing for the loop below
+  if ((force_user == regCurrent) && directTransfer(address, count)) {
+    for (; regList != 0; regList &= regList - 1) {
+      data = getmem32(address >> 2);  // Keep for later
+      putRegister(__builtin_ctz(regList), data, regCurrent);
+      address = address + 4;
+    }
+  }
+
   reg = 0;
 
   while (regList != 0) {
@@ -1819,7 +6419,7 @@ void ldm(int mode, int rn, int regList, bool writeBack, bool hat) {
     }
 
     if (hat) {
-      cpsr = spsr[cpsr & modeMask];  // and if S bit set
+      writeCPSR(spsr[cpsr & modeMask]);  // and if S bit set
     }
   }
 }
@@ -1832,13 +6432,14 @@ void ldm(int mode, int rn, int regList, bool writeBack, bool hat) {
  * @param writeBack
  * @param hat
  */
-void stm(int mode, int rn, int regList, bool writeBack, bool hat) {
+void Machine::stm(int mode, int rn, int regList, bool writeBack, bool hat) {
   int address, new_base, count, first_reg, reg;
   int force_user;
   bool special;
 
   address = getRegister(rn, regCurrent);
-  count = bitCount(regList, &first_reg);
+  count = __builtin_popcount(regList);
+  first_reg = (regList != 0) ? __builtin_ctz(regList) : -1;
 
   switch (mode) {
     case 0:
@@ -1875,6 +6476,14 @@ void stm(int mode, int rn, int regList, bool writeBack, bool hat) {
     force_user = regCurrent;
   }
 
+  // The direct path consumes the list, leaving nothing for the loop below
+  if ((force_user == regCurrent) && directTransfer(address, count)) {
+    for (; regList != 0; regList &= regList - 1) {
+      setmem32(address >> 2, getRegister(__builtin_ctz(regList), regCurrent));
+      address = address + 4;
+    }
+  }
+
   reg = 0;
 
   while (regList != 0) {
@@ -1895,7 +6504,7 @@ void stm(int mode, int rn, int regList, bool writeBack, bool hat) {
  * @brief
  * @param opCode
  */
-void branch(uint opCode) {
+void Machine::branch(uint opCode) {
   int PC = getRegister(15, regCurrent);  // Get this now in case mode changes
 
   if (((opCode & linkMask) != 0) || ((opCode & 0XF0000000) == 0XF0000000)) {
@@ -1915,6 +6524,11 @@ void branch(uint opCode) {
   }
 
   putRegister(15, PC + offset, regCurrent);
+
+  if ((profiler != NULL) &&
+      (((opCode & linkMask) != 0) || ((opCode & 0XF0000000) == 0XF0000000))) {
+    profiler->call(getRegister(14, regCurrent) & ~1);
+  }
 }
 
 /**
@@ -1923,14 +6537,29 @@ void branch(uint opCode) {
  * @return true
  * @return false
  */
-bool swiCharacterPrint(char c) {
+bool Machine::swiCharacterPrint(char c) {
+  if (stepsReset < stepsReached) {  // Printed before, on the way back
+    return true;
+  }
+  if (batchMode) {
+    putc(c, batchOutput);
+    return true;
+  }
+  if (inProcess) {
+    terminalOut.push_back(c);
+    return true;
+  }
+
+  waiting = true;
   while (!putBuffer(&terminal0Tx, c)) {
     if (status == CLIENT_STATE_RESET) {
+      waiting = false;
       return false;
     } else {
       comm(SWIPoll);  // If stalled, retain monitor communications
     }
   }
+  waiting = false;
 
   return true;
 }
@@ -1940,7 +6569,7 @@ bool swiCharacterPrint(char c) {
  * @param number
  * @return int
  */
-int swiDecimalPrint(uint number) {
+int Machine::swiDecimalPrint(uint number) {
   int okay;
 
   okay = true;
@@ -1958,7 +6587,7 @@ int swiDecimalPrint(uint number) {
  * @brief
  * @param opCode
  */
-void mySystem(uint opCode) {
+void Machine::mySystem(uint opCode) {
   int temp;
 
   if (((opCode & 0X0F000000) == 0X0E000000)
@@ -1989,11 +6618,67 @@ void mySystem(uint opCode) {
         uchar c;
         putRegister(15, getRegister(15, regCurrent) - 8, regCurrent);
         // Bodge PC so that stall looks `correct'
-        while ((!getBuffer(&terminal0Rx, &c)) &&
-               (status != CLIENT_STATE_RESET)) {
-          comm(SWIPoll);
+        bool live = inputNext == inputHistory.size();
+
+        if (!live) {  // Read before, on the way back
+          c = inputHistory[inputNext++];
+        } else if (inputReplay != NULL) {
+          uint steps, input;
+
+          if (fscanf(inputReplay, "%u %u", &steps, &input) != 2) {
+            batchInputEnded = true;  // Stop at the SWI, as batch input
+            status = CLIENT_STATE_STOPPED;
+            stalled = true;
+            break;
+          }
+          if (steps != stepsReset) {
+            fprintf(stderr,
+                    "Replay diverged: input recorded after %u instructions "
+                    "wanted after %u\n",
+                    steps, stepsReset);
+            replayDiverged = true;
+            status = CLIENT_STATE_STOPPED;
+            stalled = true;
+            break;
+          }
+          c = input;
+        } else if (batchMode) {
+          int input = (batchInput == NULL) ? EOF : getc(batchInput);
+
+          if (input == EOF) {  // Stop, stalled, at the SWI
+            batchInputEnded = true;
+            status = CLIENT_STATE_STOPPED;
+            stalled = true;
+            break;
+          }
+          c = input;
+        } else if (inProcess) {
+          if (terminalIn.empty()) {  // Wait at the SWI, to run it again
+            r[15] = lastAddr;
+            stalled = true;
+            break;
+          }
+          c = terminalIn.front();
+          terminalIn.pop_front();
+        } else {
+          waiting = true;
+          while ((!getBuffer(&terminal0Rx, &c)) &&
+                 (status != CLIENT_STATE_RESET)) {
+            comm(SWIPoll);
+          }
+          waiting = false;
         }
 
+        if ((status != CLIENT_STATE_RESET) && live) {
+          if (inputLog != NULL) {  // Kept whole, should the run be killed
+            fprintf(inputLog, "%u %u\n", stepsReset, c);
+            fflush(inputLog);
+          }
+          if (historyInterval != 0) {
+            inputHistory.push_back(c);
+            inputNext++;
+          }
+        }
         if (status != CLIENT_STATE_RESET) {
           putRegister(0, c & 0XFF, regCurrent);
           putRegister(15, getRegister(15, regCurrent),
@@ -2043,8 +6728,7 @@ void mySystem(uint opCode) {
         }
 
         spsr[supMode] = cpsr;
-        cpsr = (cpsr & ~modeMask) | supMode;
-        cpsr = cpsr & ~tfMask;  // Always in ARM mode
+        writeCPSR(((cpsr & ~modeMask) | supMode) & ~tfMask);  // Always ARM
         putRegister(14, getRegister(15, regCurrent) - 4, regCurrent);
         putRegister(15, 8, regCurrent);
         break;
@@ -2055,9 +6739,9 @@ void mySystem(uint opCode) {
 /**
  * @brief This is the breakpoint instruction.
  */
-void breakpoint() {
+void Machine::breakpoint() {
   spsr[abtMode] = cpsr;
-  cpsr = (cpsr & ~modeMask & ~tfMask) | abtMode;
+  writeCPSR((cpsr & ~modeMask & ~tfMask) | abtMode);
   putRegister(14, getRegister(15, regCurrent) - 4, regCurrent);
   putRegister(15, 12, regCurrent);
 }
@@ -2065,42 +6749,55 @@ void breakpoint() {
 /**
  * @brief
  */
-void undefined() {
+void Machine::undefined() {
   spsr[undefMode] = cpsr;
-  cpsr = (cpsr & ~modeMask & ~tfMask) | undefMode;
+  writeCPSR((cpsr & ~modeMask & ~tfMask) | undefMode);
   putRegister(14, getRegister(15, regCurrent) - 4, regCurrent);
   putRegister(15, 4, regCurrent);
 }
 
 /**
- * @brief
- * @param operation
+ * @brief Record an arithmetic operation as the source of the flags; they are
+ * only worked out if something looks at them.
+ * @param operation flagAdd or flagSub
  * @param a
  * @param b
  * @param rd
+ * @param carry Carry in; for subtraction, not borrow.
+ */
+void Machine::setFlags(int operation, int a, int b, int rd, int carry) {
+  flagPending = operation;
+  flagA = a;
+  flagB = b;
+  flagResult = rd;
+  flagCarry = carry;
+}
+
+/**
+ * @brief Record a logical operation as the source of N and Z and, unless
+ * carryPrevious, C. V is left alone.
+ * @param rd
  * @param carry
  */
-void setFlags(int operation, int a, int b, int rd, int carry) {
-  setNZ(rd);
-  setCF(a, rd, carry);
-  switch (operation) {
-    case 1:
-      setVF_ADD(a, b, rd);
-      break;
-    case 2:
-      setVF_SUB(a, b, rd);
-      break;
-    default:
-      fprintf(stderr, "Flag setting error\n");
-      break;
+void Machine::setLogicalFlags(uint rd, int carry) {
+  if ((flagPending == flagAdd) || (flagPending == flagSub)) {
+    resolveFlags();  // Still needed for V
+  } else if ((flagPending == flagLogical) && (carry == carryPrevious)) {
+    carry = flagCarry;
   }
+
+  flagPending = flagLogical;
+  flagResult = rd;
+  flagCarry = carry;
 }
 
 /**
  * @brief
  * @param value
  */
-void setNZ(uint value) {
+void Machine::setNZ(uint value) {
+  resolveFlags();
+
   if (value == 0) {
     cpsr = cpsr | zfMask;
   } else {
@@ -2115,80 +6812,122 @@ void setNZ(uint value) {
 }
 
 /**
- * @brief Two ways result can equal an operand.
- * @param a
- * @param rd
- * @param carry
+ * @brief The current N, Z, C and V flags, in their cpsr positions.
+ * @return uint
  */
-void setCF(uint a, uint rd, int carry) {
-  if ((rd > a) || ((rd == a) && (carry == 0)))
-    cpsr = cpsr & ~cfMask;
-  else
-    cpsr = cpsr | cfMask;
+uint Machine::evaluateFlags() {
+  uint flags = cpsr & (nfMask | zfMask | cfMask | vfMask);
+
+  switch (flagPending) {
+    case flagNone:
+      return flags;
+
+    case flagLogical:
+      flags = flags & vfMask;
+      if (flagCarry == carryPrevious) {
+        flags = flags | (cpsr & cfMask);
+      } else if (flagCarry) {
+        flags = flags | cfMask;
+      }
+      break;
+
+    case flagAdd:
+    case flagSub: {
+      // Two ways result can equal an operand
+      if ((flagResult < flagA) || ((flagResult == flagA) && (flagCarry != 0))) {
+        flags = cfMask;
+      } else {
+        flags = 0;
+      }
+
+      uint overflow = (flagA ^ flagResult) &
+                      ((flagPending == flagAdd) ? ~(flagA ^ flagB)
+                                                : (flagA ^ flagB));
+      if ((overflow & bit31) != 0) {
+        flags = flags | vfMask;
+      }
+    } break;
+  }
+
+  if (flagResult == 0) {
+    flags = flags | zfMask;
+  }
+  if ((flagResult & bit31) != 0) {
+    flags = flags | nfMask;
+  }
+
+  return flags;
 }
 
 /**
- * @brief
- * @param a
- * @param b
- * @param rd
+ * @brief Bring the flags in cpsr up to date. Needed before anything else
+ * reads or writes them directly.
  */
-void setVF_ADD(int a, int b, int rd) {
-  cpsr = cpsr & ~vfMask;  // Clear VF
-  if (((~(a ^ b) & (a ^ rd)) & bit31) != 0) {
-    cpsr = cpsr | vfMask;
+void Machine::resolveFlags() {
+  if (flagPending != flagNone) {
+    cpsr = (cpsr & ~(nfMask | zfMask | cfMask | vfMask)) | evaluateFlags();
+    flagPending = flagNone;
   }
 }
 
 /**
- * @brief
- * @param a
- * @param b
- * @param rd
+ * @brief checks CC against flag status
+ * @param condition
+ * @return true
+ * @return false
+ */
+bool Machine::checkCC(int condition) {
+  return conditionTable[condition & 0XF][evaluateFlags() >> 28];
+}
+
+/**
+ * @brief Fill in the condition table from the rules for each condition.
  */
-void setVF_SUB(int a, int b, int rd) {
-  cpsr = cpsr & ~vfMask;  // Clear VF
-  if ((((a ^ b) & (a ^ rd)) & bit31) != 0) {
-    cpsr = cpsr | vfMask;
+void initConditionTable() {
+  for (uint condition = 0; condition < 16; condition++) {
+    for (uint nzcv = 0; nzcv < 16; nzcv++) {
+      conditionTable[condition][nzcv] = conditionPasses(condition, nzcv << 28);
+    }
   }
 }
 
 /**
- * @brief checks CC against flag status
+ * @brief Evaluates a condition from first principles.
  * @param condition
+ * @param flags NZCV, in their CPSR positions.
  * @return true
  * @return false
  */
-bool checkCC(int condition) {
+bool conditionPasses(uint condition, uint flags) {
   switch (condition & 0XF) {
     case 0X0:
-      return zf(cpsr);
+      return zf(flags);
     case 0X1:
-      return not zf(cpsr);
+      return not zf(flags);
     case 0X2:
-      return cf(cpsr);
+      return cf(flags);
     case 0X3:
-      return not cf(cpsr);
+      return not cf(flags);
     case 0X4:
-      return nf(cpsr);
+      return nf(flags);
     case 0X5:
-      return not nf(cpsr);
+      return not nf(flags);
     case 0X6:
-      return vf(cpsr);
+      return vf(flags);
     case 0X7:
-      return not vf(cpsr);
+      return not vf(flags);
     case 0X8:
-      return cf(cpsr) and not zf(cpsr);
+      return cf(flags) and not zf(flags);
     case 0X9:
-      return (not cf(cpsr)) or zf(cpsr);
+      return (not cf(flags)) or zf(flags);
     case 0XA:
-      return not(nf(cpsr) xor vf(cpsr));
+      return not(nf(flags) xor vf(flags));
     case 0XB:
-      return nf(cpsr) xor vf(cpsr);
+      return nf(flags) xor vf(flags);
     case 0XC:
-      return (not zf(cpsr)) and (not(nf(cpsr) xor vf(cpsr)));
+      return (not zf(flags)) and (not(nf(flags) xor vf(flags)));
     case 0XD:
-      return zf(cpsr) or (nf(cpsr) xor vf(cpsr));
+      return zf(flags) or (nf(flags) xor vf(flags));
     case 0XE:
       return true;
     case 0XF:
@@ -2244,91 +6983,36 @@ constexpr const bool vf(const int cpsr) {
  * @param forceMode
  * @return int
  */
-int getRegister(int regNum, int forceMode) {
-  int mode, value;
-
-  switch (forceMode) {
-    case regCurrent:
-      mode = cpsr & modeMask;
-      break;
-    case regUser:
-      mode = userMode;
-      break;
-    case regSvc:
-      mode = supMode;
-      break;
-    case regFiq:
-      mode = fiqMode;
-      break;
-    case regIrq:
-      mode = irqMode;
-      break;
-    case regAbt:
-      mode = abtMode;
-      break;
-    case regUndef:
-      mode = undefMode;
-      break;
-  }
-
-  if (regNum == 16) {
-    value = cpsr;  // Trap for status registers
-  } else if (regNum == 17) {
-    if ((mode == userMode) || (mode == systemMode)) {
-      value = cpsr;
-    } else {
-      value = spsr[mode];
-    }
-  } else if (regNum != 15) {
-    switch (mode) {
-      case userMode:
-      case systemMode:
-        value = r[regNum];
-        break;
-
-      case fiqMode:
-        if (regNum < 8) {
-          value = r[regNum];
-
-        } else {
-          value = fiqR[regNum - 8];
-        }
-        break;
-
-      case irqMode:
-        if (regNum < 13) {
-          value = r[regNum];
-        } else {
-          value = irqR[regNum - 13];
-        }
-        break;
+int Machine::getRegister(int regNum, int forceMode) {
+  int mode, value;
 
-      case supMode:
-        if (regNum < 13) {
-          value = r[regNum];
+  if (regNum < 15) {
+    if ((regNum < 8) || (forceMode == regCurrent)) {
+      return r[regNum];  // Active register
+    }
 
-        } else {
-          value = supR[regNum - 13];
-        }
-        break;
+    mode = forcedMode(forceMode);
+    int* banked = bankedRegister(mode, regNum);
 
-      case abtMode:
-        if (regNum < 13) {
-          value = r[regNum];
+    if (banked == bankedRegister(cpsr & modeMask, regNum)) {
+      return r[regNum];  // Same bank as the current mode
+    }
+    return *banked;
+  }
 
-        } else {
-          value = abtR[regNum - 13];
-        }
-        break;
+  mode = forcedMode(forceMode);
 
-      case undefMode:
-        if (regNum < 13) {
-          value = r[regNum];
+  if (regNum >= 16) {
+    resolveFlags();
+  }
 
-        } else {
-          value = underR[regNum - 13];
-        }
-        break;
+  if (regNum == 16) {
+    value = cpsr;  // Trap for status registers
+  } else if (regNum == 17) {
+    if ((mode == userMode) || (mode == systemMode)) {
+      value = cpsr;
+    } else {
+      value = spsr[mode];
     }
   } else {
     value = r[15] + instructionLength(cpsr, tfMask);
@@ -2343,7 +7027,7 @@ int getRegister(int regNum, int forceMode) {
  * @param forceMode
  * @return int
  */
-int getRegisterMonitor(int regNum, int forceMode) {
+int Machine::getRegisterMonitor(int regNum, int forceMode) {
   if (regNum != 15) {
     return getRegister(regNum, forceMode);
   } else {
@@ -2357,84 +7041,117 @@ int getRegisterMonitor(int regNum, int forceMode) {
  * @param value
  * @param forceMode
  */
-void putRegister(int regNum, int value, int forceMode) {
+void Machine::putRegister(int regNum, int value, int forceMode) {
   int mode;
 
+  if (regNum < 15) {
+    if ((regNum < 8) || (forceMode == regCurrent)) {
+      r[regNum] = value;  // Active register
+      return;
+    }
+
+    mode = forcedMode(forceMode);
+    int* banked = bankedRegister(mode, regNum);
+
+    if (banked == bankedRegister(cpsr & modeMask, regNum)) {
+      r[regNum] = value;  // Same bank as the current mode
+    } else {
+      *banked = value;
+    }
+    return;
+  }
+
+  mode = forcedMode(forceMode);
+
+  if (regNum >= 16) {
+    resolveFlags();
+  }
+
+  if (regNum == 16)
+    writeCPSR(value); /* Trap for status registers */
+  else if (regNum == 17) {
+    if ((mode == userMode) || (mode == systemMode))
+      writeCPSR(value);
+    else
+      spsr[mode] = value;
+  } else
+    r[15] = value & 0XFFFFFFFE; /* Lose bottom bit, but NOT mode specific! */
+}
+
+/**
+ * @brief The mode selected by a forceMode argument of getRegister etc.
+ * @param forceMode
+ * @return uint
+ */
+uint Machine::forcedMode(int forceMode) {
   switch (forceMode) {
-    case regCurrent:
-      mode = cpsr & modeMask;
-      break;
     case regUser:
-      mode = userMode;
-      break;
+      return userMode;
     case regSvc:
-      mode = supMode;
-      break;
+      return supMode;
     case regFiq:
-      mode = fiqMode;
-      break;
+      return fiqMode;
     case regIrq:
-      mode = irqMode;
-      break;
+      return irqMode;
     case regAbt:
-      mode = abtMode;
-      break;
+      return abtMode;
     case regUndef:
-      mode = undefMode;
-      break;
+      return undefMode;
   }
 
-  if (regNum == 16)
-    cpsr = value; /* Trap for status registers */
-  else if (regNum == 17) {
-    if ((mode == userMode) || (mode == systemMode))
-      cpsr = value;
-    else
-      spsr[mode] = value;
-  } else if (regNum != 15) {
-    switch (mode) {
-      case userMode:
-      case systemMode:
-        r[regNum] = value;
-        break;
+  return cpsr & modeMask;  // regCurrent
+}
 
-      case fiqMode:
-        if (regNum < 8)
-          r[regNum] = value;
-        else
-          fiqR[regNum - 8] = value;
-        break;
+/**
+ * @brief Where a banked register (R8-R14) of a mode is kept while that mode's
+ * bank is not the active one in r[]. Modes sharing a register share a slot.
+ * @param mode
+ * @param regNum
+ * @return int*
+ */
+int* Machine::bankedRegister(uint mode, int regNum) {
+  if (mode == fiqMode) {
+    return &fiqR[regNum - 8];
+  }
 
+  if (regNum >= 13) {
+    switch (mode) {
       case irqMode:
-        if (regNum < 13)
-          r[regNum] = value;
-        else
-          irqR[regNum - 13] = value;
-        break;
-
+        return &irqR[regNum - 13];
       case supMode:
-        if (regNum < 13)
-          r[regNum] = value;
-        else
-          supR[regNum - 13] = value;
-        break;
-
+        return &supR[regNum - 13];
       case abtMode:
-        if (regNum < 13)
-          r[regNum] = value;
-        else
-          abtR[regNum - 13] = value;
-        break;
-
+        return &abtR[regNum - 13];
       case undefMode:
-        if (regNum < 13)
-          r[regNum] = value;
-        else
-          underR[regNum - 13] = value;
-        break;
+        return &underR[regNum - 13];
     }
-  } else
-    r[15] = value & 0XFFFFFFFE; /* Lose bottom bit, but NOT mode specific! */
+  }
+
+  return &userR[regNum - 8];  // User, system (or invalid) mode
+}
+
+/**
+ * @brief Write the CPSR, swapping the banked registers in r[] if the mode
+ * changes bank. All mode changes must come through here.
+ * @param value
+ */
+void Machine::writeCPSR(uint value) {
+  uint oldMode = cpsr & modeMask;
+  uint newMode = value & modeMask;
+
+  if (oldMode != newMode) {
+    for (int i = 8; i < 15; i++) {
+      int* from = bankedRegister(oldMode, i);
+      int* to = bankedRegister(newMode, i);
+
+      if (from != to) {
+        *from = r[i];
+        r[i] = *to;
+      }
+    }
+  }
+
+  cpsr = value;
 }
 
 /**
@@ -2450,33 +7167,89 @@ constexpr const int instructionLength(const int cpsr, const int tfMask) {
 }
 
 /**
- * @brief
- * @return uint
+ * @brief Fetch the next instruction, predecoded.
+ * @return DecodedInstruction*
  */
-uint fetch() {
-  uint opCode = readMemory(
-      (getRegister(15, regCurrent) - instructionLength(cpsr, tfMask)),
-      instructionLength(cpsr, tfMask), false, false, memInstruction);
+DecodedInstruction* Machine::fetch() {
+  uint address = getRegister(15, regCurrent) - instructionLength(cpsr, tfMask);
 
-  for (int i = 0; i < 32; i++) {
-    if (pastOpcAddr[i] ==
-        getRegister(15, regCurrent) - instructionLength(cpsr, tfMask)) {
-      pastCount++;
-      i = 32;  // bodged escape from loop
-    }
+  recordFetch(address);
+  return lookupDecoded(address, (cpsr & tfMask) != 0);
+}
+
+/**
+ * @brief Find an instruction in the decode cache. Op. codes are only read
+ * from memory (and decoded) on a miss.
+ * @param address
+ * @param thumb
+ * @return DecodedInstruction*
+ */
+DecodedInstruction* Machine::lookupDecoded(uint address, bool thumb) {
+  uint tag = address | thumb;
+  DecodedInstruction* decoded =
+      &decodeCache[(address >> 1) & (decodeCacheSize - 1)];
+
+  if (decoded->tag != tag) {
+    decode(decoded,
+           readMemory(address, thumb ? 2 : 4, false, false, memInstruction),
+           thumb);
+    decoded->tag = tag;
   }
 
-  pastOpcAddr[pastOpcPtr++] =
-      getRegister(15, regCurrent) - instructionLength(cpsr, tfMask);
-  pastOpcPtr = pastOpcPtr % pastSize;
+  return decoded;
+}
+
+/**
+ * @brief Note an instruction fetch in the history buffer.
+ * @param address
+ */
+void Machine::recordFetch(uint address) {
+  pastOpcAddr[pastOpcPtr++ & (pastSize - 1)] = address;
+  if (profiler != NULL) {
+    profiler->fetch(address);
+  }
+}
+
+/**
+ * @brief Send the addresses of the most recently fetched instructions, latest
+ * first, preceded by how many there are. The count asked for is limited to
+ * the size of the history and the number of fetches since reset.
+ * @param count The number of addresses wanted.
+ */
+void Machine::sendTrace(uint count) {
+  uint addresses[pastSize];
+
+  count = getTrace(count, addresses);
+  sendNBytes(count, 2);
+  for (uint i = 0; i < count; i++) {
+    sendNBytes(addresses[i], 4);
+  }
+}
 
-  return opCode;
+/**
+ * @brief Copy out the addresses of the most recently fetched instructions.
+ * @param count The most wanted.
+ * @param addresses Room for up to pastSize, most recent first.
+ * @return uint How many there were.
+ */
+uint Machine::getTrace(uint count, uint* addresses) {
+  if (count > pastSize) {
+    count = pastSize;
+  }
+  if (count > pastOpcPtr) {
+    count = pastOpcPtr;
+  }
+
+  for (uint i = 1; i <= count; i++) {
+    addresses[i - 1] = pastOpcAddr[(pastOpcPtr - i) & (pastSize - 1)];
+  }
+  return count;
 }
 
 /**
  * @brief getRegister returns PC+4 for ARM & PC+2 for THUMB.
  */
-void incPC() {
+void Machine::incPC() {
   putRegister(15, getRegister(15, regCurrent), regCurrent);
 }
 
@@ -2485,7 +7258,7 @@ void incPC() {
  * @param start
  * @param end
  */
-void endianSwap(const uint start, const uint end) {
+void Machine::endianSwap(const uint start, const uint end) {
   for (uint i = start; i < end; i++) {
     uint j = getmem32(i);
     setmem32(i, ((j >> 24) & 0X000000FF) | ((j >> 8) & 0X0000FF00) |
@@ -2493,6 +7266,22 @@ void endianSwap(const uint start, const uint end) {
   }
 }
 
+/**
+ * @brief The word containing a misaligned address, rotated so that the
+ * addressed byte is the least significant.
+ * @param address
+ * @return int
+ */
+int Machine::rotatedWord(uint address) {
+  uint data = getmem32(address >> 2);
+  int rotate = 8 * (address & 0X00000003);
+
+  if (rotate == 0) {
+    return data;
+  }
+  return (data >> rotate) | (data << (32 - rotate));
+}
+
 /**
  * @brief
  * @param address
@@ -2502,56 +7291,48 @@ void endianSwap(const uint start, const uint end) {
  * @param source indicates type of read {memSystem, memInstruction, memData}
  * @return int
  */
-int readMemory(uint address, int size, bool sign, bool T, int source) {
-  int data, alignment;
+int Machine::readMemory(uint address, int size, bool sign, bool T, int source) {
+  int data;
 
   if (address < memSize) {
-    alignment = address & 0X00000003;
-    data = getmem32(address >> 2);
-
-    switch (address & 0X00000003) /* Apply rotation */
-    {
-      case 0:
-        break; /* RR  0 */
-      case 1:
-        data = (data << 24) | ((data >> 8) & 0X00FFFFFF);
-        break; /* RR  8 */
-      case 2:
-        data = (data << 16) | ((data >> 16) & 0X0000FFFF);
-        break; /* RR 16 */
-      case 3:
-        data = (data << 8) | ((data >> 24) & 0X000000FF);
-        break; /* RR 24 */
-    }
-
     switch (size) {
       case 0:
         data = 0;
         break; /* A bit silly really */
 
       case 1: /* byte access */
-        if ((sign) && ((data & 0X00000080) != 0))
-          data = data | 0XFFFFFF00;
-        else
-          data = data & 0X000000FF;
+        data = memory[address];
+        if (sign) {
+          data = (signed char)data;
+        }
         break;
 
       case 2: /* half-word access */
-        if ((sign) && ((data & 0X00008000) != 0))
-          data = data | 0XFFFF0000;
-        else
-          data = data & 0X0000FFFF;
+        if ((address & 0X00000001) == 0) {
+          data = getmem16(address);
+        } else {
+          data = rotatedWord(address) & 0X0000FFFF;
+        }
+        if (sign) {
+          data = (short)data;
+        }
         break;
 
-      case 4:
-        break; /* word access */
+      case 4: /* word access */
+        if ((address & 0X00000003) == 0) {
+          data = getmem32(address >> 2);
+        } else {
+          data = rotatedWord(address);
+        }
+        break;
 
       default:
+        data = rotatedWord(address);
         fprintf(stderr, "Illegally sized memory read\n");
     }
 
     /* check watchpoints enabled */
-    if ((runFlags & 0x20) && (source == memData)) {
+    if ((runFlags & 0x20) && (source == memData) && watchedPage(address)) {
       if (checkWatchpoints(address, data, size, 1)) {
         status = CLIENT_STATE_WATCHPOINT;
       }
@@ -2561,6 +7342,10 @@ int readMemory(uint address, int size, bool sign, bool T, int source) {
     printOut = false;
   }
 
+  if ((tracer != NULL) && (source == memData)) {
+    tracer->access(address, data, size, false);
+  }
+
   return data;
 }
 
@@ -2572,8 +7357,11 @@ int readMemory(uint address, int size, bool sign, bool T, int source) {
  * @param T
  * @param source
  */
-void writeMemory(uint address, int data, int size, bool T, int source) {
-  uint mask;
+void Machine::writeMemory(uint address, int data, int size, bool T,
+                          int source) {
+  if ((tracer != NULL) && (source == memData)) {
+    tracer->access(address, data, size, true);
+  }
 
   // Deal with Tube output
   if ((address == tubeAddress) && (tubeAddress != 0)) {
@@ -2596,23 +7384,20 @@ void writeMemory(uint address, int data, int size, bool T, int source) {
       }
     }
   } else {
-    if ((address >> 2) < memSize) {
+    if (address < memSize) {
       switch (size) {
         case 0:
           break; /* A bit silly really */
 
         case 1: /* byte access */
-          mask = 0X000000FF << (8 * (address & 0X00000003));
+          setmem8(address, data);
+          // Watchpoints see the data in its byte lane
           data = data << (8 * (address & 0X00000003));
-          setmem32(address >> 2,
-                   (getmem32(address >> 2) & ~mask) | (data & mask));
           break;
 
         case 2: /* half-word acccess */
-          mask = 0X0000FFFF << (8 * (address & 0X00000002));
+          setmem16(address & ~0X00000001, data);
           data = data << (8 * (address & 0X00000002));
-          setmem32(address >> 2,
-                   (getmem32(address >> 2) & ~mask) | (data & mask));
           break;
 
         case 4: /* word access */
@@ -2627,8 +7412,8 @@ void writeMemory(uint address, int data, int size, bool T, int source) {
       printOut = false;
     }
 
-    if ((runFlags & 0x20) &&
-        (source == memData)) /* check watchpoints enabled */
+    if ((runFlags & 0x20) && (source == memData) &&
+        watchedPage(address)) /* check watchpoints enabled */
     {
       if (checkWatchpoints(address, data, size, 0)) {
         status = CLIENT_STATE_WATCHPOINT;
@@ -2637,6 +7422,56 @@ void writeMemory(uint address, int data, int size, bool T, int source) {
   }
 }
 
+/**
+ * @brief Rebuild the map of pages which active watchpoints might match, so
+ * that only accesses to those pages need a full check. Address ranges are
+ * marked exactly; masks mark every page whose upper address bits agree.
+ */
+void Machine::indexWatchpoints() {
+  uint active = emulWPFlag[0] & emulWPFlag[1];
+  uint pages = 0X100000000ULL >> watchPageShift;
+  uint pageMask = ~((1 << watchPageShift) - 1);
+
+  memset(watchPages, 0, sizeof(watchPages));
+
+  for (int i = 0; i < NO_OF_WATCHPOINTS; i++) {
+    BreakElement* wp = &watchpoints[i];
+    uint addrA = wp->addrA;
+    uint addrB = wp->addrB;
+
+    if (((active & (1 << i)) == 0) || (wp->size == 0) ||
+        ((wp->cond & 0x30) == 0) || ((wp->cond & 0x08) == 0) ||
+        ((wp->cond & 0x02) == 0)) {
+      continue;  // Can never match
+    }
+
+    if ((wp->cond & 0x0C) == 0x08) {
+      for (uint page = addrA >> watchPageShift;
+           (addrA <= addrB) && (page <= addrB >> watchPageShift); page++) {
+        watchPages[page / 32] |= 1 << (page % 32);
+      }
+    } else {
+      for (uint page = 0; page < pages; page++) {
+        if ((((page << watchPageShift) ^ addrA) & addrB & pageMask) == 0) {
+          watchPages[page / 32] |= 1 << (page % 32);
+        }
+      }
+    }
+  }
+}
+
+/**
+ * @brief Whether an access might hit a watchpoint.
+ * @param address
+ * @return true
+ * @return false
+ */
+bool Machine::watchedPage(uint address) {
+  uint page = address >> watchPageShift;
+
+  return (watchPages[page / 32] & (1 << (page % 32))) != 0;
+}
+
 /**
  * @brief
  * @param address
@@ -2645,7 +7480,7 @@ void writeMemory(uint address, int data, int size, bool T, int source) {
  * @param direction
  * @return int
  */
-int checkWatchpoints(uint address, int data, int size, int direction) {
+int Machine::checkWatchpoints(uint address, int data, int size, int direction) {
   bool may_break = false;
 
   for (int i = 0; (i < NO_OF_WATCHPOINTS) && !may_break; i++) {
@@ -2824,593 +7659,584 @@ int asr(int value, int distance, int* cf) {
  * @return int
  */
 int ror(uint value, int distance, int* cf) {
-  int result;
-
-  if (distance != 0) {
-    distance = distance & 0X1F;
-    result = lsr(value, distance, cf) | lsl(value, 32 - distance, cf);
-    /* cf acts as dummy here */
-    *cf = (((value >> (distance - 1)) & bit0) != 0);
-  } else
-    result = value;
-
-  return result;
-}
-
-/**
- * @brief
- * @param opCode
- */
-void data0(uint opCode) {
-  uint op2, result;
-  int cf;
-
-  uint rn =
-      getRegister(((opCode >> 3) & 7), regCurrent);  // Called Rm in shifts
-  uint shift = ((opCode >> 6) & 0X0000001F);         // Extracted speculatively
-
-  // Shifts
-  if ((opCode & 0X1800) != 0X1800) {
-    cf = ((cpsr & cfMask) != 0);  // default
-    switch (opCode & 0X1800) {
-      case 0X0000:
-        result = lsl(rn, shift, &cf);
-        break;      // LSL (1)
-      case 0X0800:  // LSR (1)
-        if (shift == 0) {
-          shift = 32;
-        }
-
-        result = lsr(rn, shift, &cf);
-        break;
-      case 0X1000:  // ASR (1)
-        if (shift == 0) {
-          shift = 32;
-        }
-        result = asr(rn, shift, &cf);
-        break;
-      default:
-        fprintf(stderr, "This compiler is broken\n");
-        break;
-    }
-
-    if (cf) {
-      cpsr = cpsr | cfMask;
-    } else {
-      cpsr = cpsr & ~cfMask;
-    }
-    setNZ(result);
-    putRegister((opCode & 7), result, regCurrent);
-  } else {
-    // ADD(3)/SUB(3)
-    if ((opCode & 0X0400) == 0) {
-      op2 = getRegister((opCode >> 6) & 7, regCurrent);
-    }
-    // ADD(1)/SUB(1)
-    else {
-      op2 = (opCode >> 6) & 7;
-    };
-
-    if ((opCode & 0X0200) == 0) {
-      result = rn + op2;
-      setFlags(flagAdd, rn, op2, result, 0);
-    } else {
-      result = rn - op2;
-      setFlags(flagSub, rn, op2, result, 1);
-    }
-
-    putRegister(opCode & 7, result, regCurrent);
-  }
-}
-
-/**
- * @brief
- * @param opCode
- */
-void data1(uint opCode) {
-  int rd, imm;
-  int result;
-
-  rd = (opCode >> 8) & 7;
-  imm = opCode & 0X00FF;
-
-  switch (opCode & 0X1800) {
-    case 0X0000: /* MOV (1) */
-      result = imm;
-      setNZ(result);
-      putRegister(rd, result, regCurrent);
-      break;
-
-    case 0X0800: /* CMP (1) */
-      result = (getRegister(rd, regCurrent) - imm);
-      setFlags(flagSub, getRegister(rd, regCurrent), imm, result, 1);
-      break;
-
-    case 0X1000: /* ADD (2) */
-      result = (getRegister(rd, regCurrent) + imm);
-      setFlags(flagAdd, getRegister(rd, regCurrent), imm, result, 0);
-      putRegister(rd, result, regCurrent);
-      break;
-
-    case 0X1800: /* SUB (2) */
-      result = (getRegister(rd, regCurrent) - imm);
-      setFlags(flagSub, getRegister(rd, regCurrent), imm, result, 1);
-      putRegister(rd, result, regCurrent);
-      break;
-  }
-}
-
-/**
- * @brief
- * @param opCode
- */
-void dataTransfer(uint opCode) {
-  uint rd, rm;
-  int cf;
-
-  uint address;
-
-  signed int result;
-
-  if ((opCode & 0X1000) == 0) /* NOT load/store */
-  {
-    if ((opCode & 0X0800) == 0) /* NOT load literal pool */
-    {
-      if ((opCode & 0X0400) == 0) /* Data processing */
-      {
-        rd = getRegister((opCode & 7), regCurrent);
-        rm = getRegister(((opCode >> 3) & 7), regCurrent);
-
-        switch (opCode & 0X03C0) /* data processing opcode */
-        {
-          case 0X0000:  // AND
-            result = rd & rm;
-            putRegister(opCode & 7, result, regCurrent);
-            setNZ(result);
-            break;
-
-          case 0X0040: /* EOR */
-            result = rd ^ rm;
-            putRegister(opCode & 7, result, regCurrent);
-            setNZ(result);
-            break;
-
-          case 0X0080:                   /* LSL (2) */
-            cf = ((cpsr & cfMask) != 0); /* default */
-            result = lsl(rd, rm & 0X000000FF, &cf);
-            if (cf)
-              cpsr = cpsr | cfMask;
-            else
-              cpsr = cpsr & ~cfMask;
-            setNZ(result);
-            putRegister(opCode & 7, result, regCurrent);
-            break;
-
-          case 0X00C0:                    // LSR (2)
-            cf = ((cpsr & cfMask) != 0);  // default
-            result = lsr(rd, rm & 0X000000FF, &cf);
-            if (cf) {
-              cpsr = cpsr | cfMask;
-            } else {
-              cpsr = cpsr & ~cfMask;
-            }
-            setNZ(result);
-            putRegister(opCode & 7, result, regCurrent);
-            break;
-
-          case 0X0100:                    // ASR (2)
-            cf = ((cpsr & cfMask) != 0);  // default
-            result = asr(rd, rm & 0X000000FF, &cf);
-            if (cf) {
-              cpsr = cpsr | cfMask;
-            } else {
-              cpsr = cpsr & ~cfMask;
-            }
-            setNZ(result);
-            putRegister(opCode & 7, result, regCurrent);
-            break;
-
-          case 0X0140:  // ADC
-            result = rd + rm;
-            if ((cpsr & cfMask) != 0) {
-              result = result + 1;  // Add CF
-            }
-            setFlags(flagAdd, rd, rm, result, cpsr & cfMask);
-            putRegister(opCode & 7, result, regCurrent);
-            break;
-
-          case 0X0180:  // SBC
-            result = rd - rm - 1;
-            if ((cpsr & cfMask) != 0) {
-              result = result + 1;
-            }
-            setFlags(flagSub, rd, rm, result, cpsr & cfMask);
-            putRegister(opCode & 7, result, regCurrent);
-            break;
-
-          case 0X01C0:                    // ROR
-            cf = ((cpsr & cfMask) != 0);  // default
-            result = ror(rd, rm & 0X000000FF, &cf);
-            if (cf) {
-              cpsr = cpsr | cfMask;
-            } else {
-              cpsr = cpsr & ~cfMask;
-            }
-            setNZ(result);
-            putRegister(opCode & 7, result, regCurrent);
-            break;
-
-          case 0X0200:  // TST
-            setNZ(rd & rm);
-            break;
-
-          case 0X0240:  // NEG
-            result = -rm;
-            putRegister(opCode & 7, result, regCurrent);
-            setFlags(flagSub, 0, rm, result, 1);
-            break;
-
-          case 0X0280: /* CMP (2) */
-            setFlags(flagSub, rd, rm, rd - rm, 1);
-            break;
+  int result;
 
-          case 0X02C0: /* CMN */
-            setFlags(flagAdd, rd, rm, rd + rm, 0);
-            break;
+  if (distance != 0) {
+    distance = distance & 0X1F;
+    result = lsr(value, distance, cf) | lsl(value, 32 - distance, cf);
+    /* cf acts as dummy here */
+    *cf = (((value >> (distance - 1)) & bit0) != 0);
+  } else
+    result = value;
 
-          case 0X0300: /* ORR */
-            result = rd | rm;
-            setNZ(result);
-            putRegister(opCode & 7, result, regCurrent);
-            break;
+  return result;
+}
 
-          case 0X00340: /* MUL */
-            result = rm * rd;
-            setNZ(result);
-            putRegister(opCode & 7, result, regCurrent);
-            break;
+/**
+ * @brief
+ * @param opCode
+ * @param exchange
+ */
+void Machine::thumbBranch1(uint opCode, int exchange) {
+  int offset, lr;
 
-          case 0X0380: /* BIC */
-            result = rd & ~rm;
-            setNZ(result);
-            putRegister(opCode & 7, result, regCurrent);
-            break;
+  lr = getRegister(14, regCurrent); /* Retrieve first part of offset */
+  offset = lr + ((opCode & 0X07FF) << 1);
 
-          case 0X03C0: /* MVN */
-            result = ~rm;
-            setNZ(result);
-            putRegister(opCode & 7, result, regCurrent);
-            break;
-        }    /* End of switch */
-      } else /* special data processing */
-      {      /* NO FLAG UPDATE */
-        switch (opCode & 0X0300) {
-          case 0X0000: /* ADD (4) high registers */
-            rd = ((opCode & 0X0080) >> 4) | (opCode & 7);
-            rm = getRegister(((opCode >> 3) & 15), regCurrent);
-            putRegister(rd, getRegister(rd, regCurrent) + rm, regCurrent);
-            break;
+  lr = getRegister(15, regCurrent) - 2 + 1; /* + 1 to indicate Thumb mode */
 
-          case 0X0100: /* CMP (3) high registers */
-            rd = getRegister((((opCode & 0X0080) >> 4) | (opCode & 7)),
-                             regCurrent);
-            rm = getRegister(((opCode >> 3) & 15), regCurrent);
-            setFlags(flagSub, rd, rm, rd - rm, 1);
-            break;
+  if (exchange == true) {
+    cpsr = cpsr & ~tfMask; /* Change to ARM mode */
+    offset = offset & 0XFFFFFFFC;
+  }
 
-          case 0X0200: /* MOV (2) high registers */
-            rd = ((opCode & 0X0080) >> 4) | (opCode & 7);
-            rm = getRegister(((opCode >> 3) & 15), regCurrent);
+  putRegister(15, offset, regCurrent);
+  putRegister(14, lr, regCurrent);
+  if (profiler != NULL) {
+    profiler->call(lr & ~1);
+  }
+}
 
-            if (rd == 15)
-              rm = rm & 0XFFFFFFFE; /* Tweak mov to PC */
-            putRegister(rd, rm, regCurrent);
-            break;
+/**
+ * @brief LSL, LSR, ASR (1): shift by an immediate, special cases decoded.
+ * @param d
+ */
+template <uint type>
+void Machine::thumbShiftImm(DecodedInstruction* d) {
+  uint rm = getRegister(d->rm, regCurrent);
+  int cf = ((cpsr & cfMask) != 0);  // default
+  uint result;
+
+  if constexpr (type == 0) {
+    result = lsl(rm, d->shiftDistance, &cf);
+  } else if constexpr (type == 1) {
+    result = lsr(rm, d->shiftDistance, &cf);
+  } else {
+    result = asr(rm, d->shiftDistance, &cf);
+  }
 
-          case 0X0300: /* BX/BLX Rm */
-            bx((opCode >> 3) & 0XF, opCode & 0X0080);
-            break;
-        } /* End of switch */
-      }
-    } else /* load from literal pool */
-    {      /* LDR PC */
-      rd = ((opCode >> 8) & 7);
-      address = (((opCode & 0X00FF) << 2)) +
-                (getRegister(15, regCurrent) & 0XFFFFFFFC);
-      putRegister(rd, readMemory(address, 4, false, false, memData),
-                  regCurrent);
-    }
-  } else { /* load/store word, halfword, byte, signed byte */
-    int rm, rn;
-    int data;
+  if (cf) {
+    cpsr = cpsr | cfMask;
+  } else {
+    cpsr = cpsr & ~cfMask;
+  }
+  setNZ(result);
+  putRegister(d->rd, result, regCurrent);
+}
 
-    rd = (opCode & 7);
-    rn = getRegister(((opCode >> 3) & 7), regCurrent);
-    rm = getRegister(((opCode >> 6) & 7), regCurrent);
+/**
+ * @brief ADD/SUB (3) register and ADD/SUB (1) 3-bit immediate.
+ * @param d
+ */
+template <bool subtract, bool immediate>
+void Machine::thumbAddSub(DecodedInstruction* d) {
+  uint rn = getRegister(d->rn, regCurrent);
+  uint op2, result;
 
-    switch (opCode & 0X0E00) {
-      case 0X0000: /* STR (2) register */
-        writeMemory(rn + rm, getRegister(rd, regCurrent), 4, false, memData);
-        break;
+  if constexpr (immediate) {
+    op2 = d->immediate;
+  } else {
+    op2 = getRegister(d->rm, regCurrent);
+  }
 
-      case 0X0200: /* STRH (2) register */
-        writeMemory(rn + rm, getRegister(rd, regCurrent), 2, false, memData);
-        break;
+  if constexpr (subtract) {
+    result = rn - op2;
+    setFlags(flagSub, rn, op2, result, 1);
+  } else {
+    result = rn + op2;
+    setFlags(flagAdd, rn, op2, result, 0);
+  }
 
-      case 0X0400: /* STRB (2) register */
-        writeMemory(rn + rm, getRegister(rd, regCurrent), 1, false, memData);
-        break;
+  putRegister(d->rd, result, regCurrent);
+}
 
-      case 0X0600: /* LDRSB register */
-        data = readMemory(rn + rm, 1, true, false, memData); /* Sign ext. */
-        putRegister(rd, data, regCurrent);
-        break;
+/**
+ * @brief MOV, CMP, ADD, SUB with an 8-bit immediate.
+ * @param d
+ */
+template <uint operation>
+void Machine::thumbImm8(DecodedInstruction* d) {
+  int imm = d->immediate;
+  int rd, result;
+
+  if constexpr (operation == 0) { /* MOV (1) */
+    setNZ(imm);
+    putRegister(d->rd, imm, regCurrent);
+    return;
+  }
 
-      case 0X0800: /* LDR (2) register */
-        data = readMemory(rn + rm, 4, false, false, memData);
-        putRegister(rd, data, regCurrent);
-        break;
+  rd = getRegister(d->rd, regCurrent);
+  if constexpr (operation == 1) { /* CMP (1) */
+    setFlags(flagSub, rd, imm, rd - imm, 1);
+  } else if constexpr (operation == 2) { /* ADD (2) */
+    result = rd + imm;
+    setFlags(flagAdd, rd, imm, result, 0);
+    putRegister(d->rd, result, regCurrent);
+  } else { /* SUB (2) */
+    result = rd - imm;
+    setFlags(flagSub, rd, imm, result, 1);
+    putRegister(d->rd, result, regCurrent);
+  }
+}
 
-      case 0X0A00: /* LDRH (2) register */
-        data = readMemory(rn + rm, 2, false, false, memData); /* Zero ext. */
-        putRegister(rd, data, regCurrent);
-        break;
+/**
+ * @brief The low register data processing operations.
+ * @param d
+ */
+template <uint operation>
+void Machine::thumbAlu(DecodedInstruction* d) {
+  uint rd = getRegister(d->rd, regCurrent);
+  uint rm = getRegister(d->rm, regCurrent);
+  int cf = ((cpsr & cfMask) != 0);  // Shifts' default
+  signed int result;
 
-      case 0X0C00:                                            /* LDRB (2) */
-        data = readMemory(rn + rm, 1, false, false, memData); /* Zero ext. */
-        putRegister(rd, data, regCurrent);
-        break;
+  switch (operation) {
+    case 0X0:  // AND
+      result = rd & rm;
+      break;
+    case 0X1:  // EOR
+      result = rd ^ rm;
+      break;
+    case 0X2:  // LSL (2)
+      result = lsl(rd, rm & 0X000000FF, &cf);
+      break;
+    case 0X3:  // LSR (2)
+      result = lsr(rd, rm & 0X000000FF, &cf);
+      break;
+    case 0X4:  // ASR (2)
+      result = asr(rd, rm & 0X000000FF, &cf);
+      break;
+    case 0X5:  // ADC
+      result = rd + rm + ((cpsr & cfMask) != 0);
+      setFlags(flagAdd, rd, rm, result, cpsr & cfMask);
+      break;
+    case 0X6:  // SBC
+      result = rd - rm - ((cpsr & cfMask) == 0);
+      setFlags(flagSub, rd, rm, result, cpsr & cfMask);
+      break;
+    case 0X7:  // ROR
+      result = ror(rd, rm & 0X000000FF, &cf);
+      break;
+    case 0X8:  // TST
+      setNZ(rd & rm);
+      return;
+    case 0X9:  // NEG
+      result = -rm;
+      setFlags(flagSub, 0, rm, result, 1);
+      break;
+    case 0XA:  // CMP (2)
+      setFlags(flagSub, rd, rm, rd - rm, 1);
+      return;
+    case 0XB:  // CMN
+      setFlags(flagAdd, rd, rm, rd + rm, 0);
+      return;
+    case 0XC:  // ORR
+      result = rd | rm;
+      break;
+    case 0XD:  // MUL
+      result = rm * rd;
+      break;
+    case 0XE:  // BIC
+      result = rd & ~rm;
+      break;
+    case 0XF:  // MVN
+      result = ~rm;
+      break;
+  }
 
-      case 0X0E00:                                           /* LDRSH (2) */
-        data = readMemory(rn + rm, 2, true, false, memData); /* Sign ext. */
-        putRegister(rd, data, regCurrent);
-        break;
+  if constexpr ((operation >= 0X2) && (operation <= 0X7) &&
+                (operation != 0X5) && (operation != 0X6)) {
+    if (cf) {
+      cpsr = cpsr | cfMask;
+    } else {
+      cpsr = cpsr & ~cfMask;
     }
   }
+  if constexpr ((operation != 0X5) && (operation != 0X6) &&
+                (operation != 0X9)) {
+    setNZ(result);
+  }
+  putRegister(d->rd, result, regCurrent);
 }
 
 /**
- * @brief
- * @param opCode
+ * @brief ADD (4) high registers; no flag update.
+ * @param d
  */
-void transfer0(uint opCode) {
-  int rd, rn;
-  int location, data;
+void Machine::thumbHighAdd(DecodedInstruction* d) {
+  uint rm = getRegister(d->rm, regCurrent);
+  putRegister(d->rd, getRegister(d->rd, regCurrent) + rm, regCurrent);
+}
 
-  rn = getRegister(((opCode >> 3) & 7), regCurrent);
+/**
+ * @brief CMP (3) high registers.
+ * @param d
+ */
+void Machine::thumbHighCmp(DecodedInstruction* d) {
+  uint rd = getRegister(d->rd, regCurrent);
+  uint rm = getRegister(d->rm, regCurrent);
+  setFlags(flagSub, rd, rm, rd - rm, 1);
+}
 
-  if ((opCode & 0X0800) == 0) /* STR */
-  {
-    rd = getRegister((opCode & 7), regCurrent);
-    if ((opCode & 0X1000) == 0) /* STR (1) 5-bit imm */
-    {
-      location = rn + ((opCode >> 4) & 0X07C); /* shift twice = *4 */
-      writeMemory(location, rd, 4, false, memData);
-    } else /* STRB (1) */
-    {
-      location = rn + ((opCode >> 6) & 0X1F);
-      writeMemory(location, rd, 1, false, memData);
-    }
-  } else /* LDR (1) */
-  {
-    rd = opCode & 7;
-    if ((opCode & 0X1000) == 0) {
-      location = (rn + ((opCode >> 4) & 0X07C)); /* shift twice = *4 */
-      data = readMemory(location, 4, false, false, memData);
-    } else /* LDRB (1) */
-    {
-      location = (rn + ((opCode >> 6) & 0X1F));
-      data = readMemory(location, 1, false, false, memData); /* Zero extended */
-    }
-    putRegister(rd, data, regCurrent);
+/**
+ * @brief MOV (2) high registers.
+ * @param d
+ */
+void Machine::thumbHighMov(DecodedInstruction* d) {
+  uint rm = getRegister(d->rm, regCurrent);
+
+  if (d->rd == 15) {
+    rm = rm & 0XFFFFFFFE; /* Tweak mov to PC */
   }
+  putRegister(d->rd, rm, regCurrent);
 }
 
 /**
- * @brief
- * @param opCode
+ * @brief BX/BLX Rm
+ * @param d
  */
-void transfer1(uint opCode) {
-  int rd, rn;
-  int data, location;
+void Machine::thumbBx(DecodedInstruction* d) {
+  bx(d->rm, d->opCode & 0X0080);
+}
 
-  switch (opCode & 0X1800) {
-    case 0X0000: /* STRH (1) */
-      rn = getRegister((opCode >> 3) & 7, regCurrent);
-      rd = opCode & 7;
-      data = getRegister(rd, regCurrent);
-      location = rn + ((opCode >> 5) & 0X3E); /* x2 in shift */
-      writeMemory(location, data, 2, false, memData);
-      break;
+/**
+ * @brief LDR (3) from the literal pool.
+ * @param d
+ */
+void Machine::thumbLdrPC(DecodedInstruction* d) {
+  uint address = d->immediate + (getRegister(15, regCurrent) & 0XFFFFFFFC);
+  putRegister(d->rd, readMemory(address, 4, false, false, memData),
+              regCurrent);
+}
 
-    case 0X0800: /* LDRH (1) */
-      rd = opCode & 7;
-      rn = getRegister((opCode >> 3) & 7, regCurrent);
-      location = rn + ((opCode >> 5) & 0X3E);                /* x2 in shift */
-      data = readMemory(location, 2, false, false, memData); /* Zero extended */
-      putRegister(rd, data, regCurrent);
-      break;
+/**
+ * @brief Load/store word, halfword, byte or signed byte with a register
+ * offset.
+ * @param d
+ */
+template <uint operation>
+void Machine::thumbTransferReg(DecodedInstruction* d) {
+  uint address =
+      getRegister(d->rn, regCurrent) + getRegister(d->rm, regCurrent);
 
-    case 0X1000: /* STR (3) -SP */
-      data = getRegister(((opCode >> 8) & 7), regCurrent);
-      rn = getRegister(13, regCurrent); /* SP */
-      location = rn + ((opCode & 0X00FF) * 4);
-      writeMemory(location, data, 4, false, memData);
+  switch (operation) {
+    case 0X0: /* STR (2) register */
+      writeMemory(address, getRegister(d->rd, regCurrent), 4, false, memData);
       break;
-
-    case 0X1800: /* LDR (4) -SP */
-      rd = (opCode >> 8) & 7;
-      rn = getRegister(13, regCurrent);        /* SP */
-      location = rn + ((opCode & 0X00FF) * 4); /* x2 in shift */
-      data = readMemory(location, 4, false, false, memData);
-      putRegister(rd, data, regCurrent);
+    case 0X1: /* STRH (2) register */
+      writeMemory(address, getRegister(d->rd, regCurrent), 2, false, memData);
+      break;
+    case 0X2: /* STRB (2) register */
+      writeMemory(address, getRegister(d->rd, regCurrent), 1, false, memData);
+      break;
+    case 0X3: /* LDRSB register */
+      putRegister(d->rd, readMemory(address, 1, true, false, memData),
+                  regCurrent);
+      break;
+    case 0X4: /* LDR (2) register */
+      putRegister(d->rd, readMemory(address, 4, false, false, memData),
+                  regCurrent);
+      break;
+    case 0X5: /* LDRH (2) register */
+      putRegister(d->rd, readMemory(address, 2, false, false, memData),
+                  regCurrent);
+      break;
+    case 0X6: /* LDRB (2) register */
+      putRegister(d->rd, readMemory(address, 1, false, false, memData),
+                  regCurrent);
+      break;
+    case 0X7: /* LDRSH (2) register */
+      putRegister(d->rd, readMemory(address, 2, true, false, memData),
+                  regCurrent);
       break;
   }
 }
 
 /**
- * @brief
- * @param opCode
+ * @brief Load/store with an immediate offset (pre-scaled) from Rn, or from
+ * the SP when rn is 13.
+ * @param d
  */
-void spPC(uint opCode) {
-  int rd, sp, data;
+template <bool load, int size>
+void Machine::thumbTransferImm(DecodedInstruction* d) {
+  uint address = getRegister(d->rn, regCurrent) + d->immediate;
 
-  if ((opCode & 0X1000) == 0) /* ADD SP or PC */
-  {
-    rd = (opCode >> 8) & 7;
-
-    if ((opCode & 0X0800) == 0) /* ADD(5) -PC */
-      data =
-          (getRegister(15, regCurrent) & 0XFFFFFFFC) + ((opCode & 0X00FF) << 2);
-    /* getRegister supplies PC + 2 */
-    else /* ADD(6) -SP */
-      data = (getRegister(13, regCurrent)) + ((opCode & 0X00FF) << 2);
-    putRegister(rd, data, regCurrent);
-  } else /* Adjust SP */
-  {
-    switch (opCode & 0X0F00) {
-      case 0X0000:
-        if ((opCode & 0X0080) == 0) /* ADD(7) -SP */
-          sp = getRegister(13, regCurrent) + ((opCode & 0X7F) << 2);
-        else /* SUB(4) -SP */
-          sp = getRegister(13, regCurrent) - ((opCode & 0X7F) << 2);
-        putRegister(13, sp, regCurrent);
-        break;
+  if constexpr (load) {
+    putRegister(d->rd, readMemory(address, size, false, false, memData),
+                regCurrent);
+  } else {
+    writeMemory(address, getRegister(d->rd, regCurrent), size, false, memData);
+  }
+}
 
-      case 0X0400:
-      case 0X0500:
-      case 0X0C00:
-      case 0X0D00: {
-        int reg_list;
-
-        reg_list = opCode & 0X000000FF;
-
-        if ((opCode & 0X0800) == 0) /* PUSH */
-        {
-          if ((opCode & 0X0100) != 0)
-            reg_list = reg_list | 0X4000;
-          stm(2, 13, reg_list, 1, 0);
-        } else /* POP */
-        {
-          if ((opCode & 0X0100) != 0)
-            reg_list = reg_list | 0X8000;
-          ldm(1, 13, reg_list, 1, 0);
-        }
-      } break;
+/**
+ * @brief ADD (5), Rd := PC + immediate
+ * @param d
+ */
+void Machine::thumbAddPC(DecodedInstruction* d) {
+  /* getRegister supplies PC + 2 */
+  putRegister(d->rd, (getRegister(15, regCurrent) & 0XFFFFFFFC) + d->immediate,
+              regCurrent);
+}
 
-      case 0X0E00: /* Breakpoint */
-        //      fprintf(stderr, "Breakpoint\n");
-        breakpoint();
-        break;
+/**
+ * @brief ADD (6), Rd := SP + immediate
+ * @param d
+ */
+void Machine::thumbAddSP(DecodedInstruction* d) {
+  putRegister(d->rd, getRegister(13, regCurrent) + d->immediate, regCurrent);
+}
 
-      case 0X0100:
-      case 0X0200:
-      case 0X0300:
-      case 0X0600:
-      case 0X0700:
-      case 0X0800:
-      case 0X0900:
-      case 0X0A00:
-      case 0X0B00:
-      case 0X0F00:
-        //      fprintf(stderr, "Undefined\n");
-        undefined();
-        break;
-    }
-  }
+/**
+ * @brief ADD (7) and SUB (4), adjusting the SP; the immediate is signed.
+ * @param d
+ */
+void Machine::thumbAdjustSP(DecodedInstruction* d) {
+  putRegister(13, getRegister(13, regCurrent) + d->immediate, regCurrent);
 }
 
 /**
- * @brief
- * @param opCode
+ * @brief PUSH, with LR already merged into the register list.
+ * @param d
+ */
+void Machine::thumbPush(DecodedInstruction* d) {
+  stm(2, 13, d->immediate, 1, 0);
+}
+
+/**
+ * @brief POP, with PC already merged into the register list.
+ * @param d
  */
-void lsmB(uint opCode) {
-  uint offset;
+void Machine::thumbPop(DecodedInstruction* d) {
+  ldm(1, 13, d->immediate, 1, 0);
+}
 
-  if ((opCode & 0X1000) == 0) {
-    if ((opCode & 0X0800) == 0) /* STM (IA) */
-      stm(1, (opCode >> 8) & 7, opCode & 0X000000FF, 1, 0);
-    else /* LDM (IA) */
-      ldm(1, (opCode >> 8) & 7, opCode & 0X000000FF, 1, 0);
-  } else /* conditional BRANCH B(1) */
-  {
-    if ((opCode & 0X0F00) != 0X0F00) /* Branch, not a SWI */
-    {
-      if (checkCC(opCode >> 8) == true) {
-        offset = (opCode & 0X00FF) << 1; /* sign extend */
-        if ((opCode & 0X0080) != 0)
-          offset = offset | 0XFFFFFE00;
+void Machine::thumbBreakpoint(DecodedInstruction* d) {
+  breakpoint();
+}
 
-        putRegister(15, getRegister(15, regCurrent) + offset, regCurrent);
-        /* getRegister supplies pc + 2 */
-        /*    fprintf(stderr, "%08X", address + 4 + offset); */
-      }
-    } else /* SWI */
-    {
-      offset = opCode & 0X00FF;
-      /* bodge opCode to pass only SWI No. N.B. no copro in Thumb */
-      mySystem(offset);
-    }
+void Machine::thumbUndefined(DecodedInstruction* d) {
+  undefined();
+}
+
+/**
+ * @brief STMIA and LDMIA
+ * @param d
+ */
+template <bool load>
+void Machine::thumbMultiple(DecodedInstruction* d) {
+  if constexpr (load) {
+    ldm(1, d->rn, d->immediate, 1, 0);
+  } else {
+    stm(1, d->rn, d->immediate, 1, 0);
   }
 }
 
 /**
- * @brief
- * @param opCode
- * @param exchange
+ * @brief Conditional branch B (1); the offset is sign extended.
+ * @param d
  */
-void thumbBranch1(uint opCode, int exchange) {
-  int offset, lr;
+void Machine::thumbBranchCond(DecodedInstruction* d) {
+  if (checkCC(d->cond) == true) {
+    /* getRegister supplies pc + 2 */
+    putRegister(15, getRegister(15, regCurrent) + d->immediate, regCurrent);
+  }
+}
 
-  lr = getRegister(14, regCurrent); /* Retrieve first part of offset */
-  offset = lr + ((opCode & 0X07FF) << 1);
+void Machine::thumbSwi(DecodedInstruction* d) {
+  mySystem(d->immediate); /* N.B. no copro in Thumb */
+}
 
-  lr = getRegister(15, regCurrent) - 2 + 1; /* + 1 to indicate Thumb mode */
+/**
+ * @brief Unconditional branch B (2); the offset is sign extended.
+ * @param d
+ */
+void Machine::thumbBranch(DecodedInstruction* d) {
+  putRegister(15, getRegister(15, regCurrent) + d->immediate, regCurrent);
+}
 
-  if (exchange == true) {
-    cpsr = cpsr & ~tfMask; /* Change to ARM mode */
-    offset = offset & 0XFFFFFFFC;
+/**
+ * @brief BLX suffix
+ * @param d
+ */
+void Machine::thumbBlx(DecodedInstruction* d) {
+  if ((d->opCode & 0X0001) == 0) {
+    thumbBranch1(d->opCode, true);
+  } else {
+    fprintf(stderr, "Undefined\n");
   }
+}
 
-  putRegister(15, offset, regCurrent);
-  putRegister(14, lr, regCurrent);
+/**
+ * @brief BL prefix: LR := PC + the upper part of the offset.
+ * @param d
+ */
+void Machine::thumbBlPrefix(DecodedInstruction* d) {
+  BLPrefix = d->opCode & 0X07FF;
+  putRegister(14, getRegister(15, regCurrent) + d->immediate, regCurrent);
 }
 
 /**
- * @brief
- * @param opCode
+ * @brief BL suffix
+ * @param d
  */
-void thumbBranch(uint opCode) {
-  int offset;
+void Machine::thumbBl(DecodedInstruction* d) {
+  thumbBranch1(d->opCode, false);
+}
 
-  switch (opCode & 0X1800) {
-    case 0X0000: /* B -uncond. B(2)  */
-      offset = (opCode & 0X07FF) << 1;
-      if ((opCode & 0X0400) != 0)
-        offset = offset | 0XFFFFF000; /* sign extend */
-      putRegister(15, (getRegister(15, regCurrent) + offset), regCurrent);
-      break;
+/**
+ * @brief Classify a Thumb op. code by its top ten bits, which is all that
+ * is needed to tell the instructions apart.
+ * @param opCode Bits 15-6 significant.
+ * @return ThumbDecoding
+ */
+ThumbDecoding thumbClassify(uint opCode) {
+  switch (opCode & 0XE000) {
+    case 0X0000:
+      switch (opCode & 0X1E00) {
+        case 0X1800:
+          return {HANDLER(thumbAddSub<false, false>), thumbFieldsAddSub};
+        case 0X1A00:
+          return {HANDLER(thumbAddSub<true, false>), thumbFieldsAddSub};
+        case 0X1C00:
+          return {HANDLER(thumbAddSub<false, true>), thumbFieldsAddSub};
+        case 0X1E00:
+          return {HANDLER(thumbAddSub<true, true>), thumbFieldsAddSub};
+      }
+      switch (opCode & 0X1800) {
+        case 0X0000:
+          return {HANDLER(thumbShiftImm<0>), thumbFieldsShift};
+        case 0X0800:
+          return {HANDLER(thumbShiftImm<1>), thumbFieldsShift};
+        default:
+          return {HANDLER(thumbShiftImm<2>), thumbFieldsShift};
+      }
 
-    case 0X0800: /* BLX */
-      if ((opCode & 0X0001) == 0)
-        thumbBranch1(opCode, true);
-      else
-        fprintf(stderr, "Undefined\n");
-      break;
+    case 0X2000:
+      switch (opCode & 0X1800) {
+        case 0X0000:
+          return {HANDLER(thumbImm8<0>), thumbFieldsImm8};
+        case 0X0800:
+          return {HANDLER(thumbImm8<1>), thumbFieldsImm8};
+        case 0X1000:
+          return {HANDLER(thumbImm8<2>), thumbFieldsImm8};
+        default:
+          return {HANDLER(thumbImm8<3>), thumbFieldsImm8};
+      }
+
+    case 0X4000:
+      if ((opCode & 0X1000) != 0) {
+        static const InstructionHandler transfers[8] = {
+            HANDLER(thumbTransferReg<0>), HANDLER(thumbTransferReg<1>),
+            HANDLER(thumbTransferReg<2>), HANDLER(thumbTransferReg<3>),
+            HANDLER(thumbTransferReg<4>), HANDLER(thumbTransferReg<5>),
+            HANDLER(thumbTransferReg<6>), HANDLER(thumbTransferReg<7>)};
+        return {transfers[(opCode >> 9) & 7], thumbFieldsLow};
+      }
+      if ((opCode & 0X0800) != 0) {
+        return {HANDLER(thumbLdrPC), thumbFieldsImm8Word};
+      }
+      if ((opCode & 0X0400) == 0) {
+        static const InstructionHandler alu[16] = {
+            HANDLER(thumbAlu<0X0>), HANDLER(thumbAlu<0X1>),
+            HANDLER(thumbAlu<0X2>), HANDLER(thumbAlu<0X3>),
+            HANDLER(thumbAlu<0X4>), HANDLER(thumbAlu<0X5>),
+            HANDLER(thumbAlu<0X6>), HANDLER(thumbAlu<0X7>),
+            HANDLER(thumbAlu<0X8>), HANDLER(thumbAlu<0X9>),
+            HANDLER(thumbAlu<0XA>), HANDLER(thumbAlu<0XB>),
+            HANDLER(thumbAlu<0XC>), HANDLER(thumbAlu<0XD>),
+            HANDLER(thumbAlu<0XE>), HANDLER(thumbAlu<0XF>)};
+        return {alu[(opCode >> 6) & 0XF], thumbFieldsAlu};
+      }
+      switch (opCode & 0X0300) {
+        case 0X0000:
+          return {HANDLER(thumbHighAdd), thumbFieldsHigh};
+        case 0X0100:
+          return {HANDLER(thumbHighCmp), thumbFieldsHigh};
+        case 0X0200:
+          return {HANDLER(thumbHighMov), thumbFieldsHigh};
+        default:
+          return {HANDLER(thumbBx), thumbFieldsHigh};
+      }
 
-    case 0X1000: /* BL prefix */
-      BLPrefix = opCode & 0X07FF;
-      offset = BLPrefix << 12;
+    case 0X6000:
+      switch (opCode & 0X1800) {
+        case 0X0000: /* STR (1) */
+          return {HANDLER(thumbTransferImm<false, 4>), thumbFieldsImm5Word};
+        case 0X0800: /* LDR (1) */
+          return {HANDLER(thumbTransferImm<true, 4>), thumbFieldsImm5Word};
+        case 0X1000: /* STRB (1) */
+          return {HANDLER(thumbTransferImm<false, 1>), thumbFieldsImm5Byte};
+        default: /* LDRB (1) */
+          return {HANDLER(thumbTransferImm<true, 1>), thumbFieldsImm5Byte};
+      }
 
-      if ((BLPrefix & 0X0400) != 0)
-        offset = offset | 0XFF800000; /* Sign ext. */
-      offset = getRegister(15, regCurrent) + offset;
-      putRegister(14, offset, regCurrent);
-      break;
+    case 0X8000:
+      switch (opCode & 0X1800) {
+        case 0X0000: /* STRH (1) */
+          return {HANDLER(thumbTransferImm<false, 2>), thumbFieldsImm5Half};
+        case 0X0800: /* LDRH (1) */
+          return {HANDLER(thumbTransferImm<true, 2>), thumbFieldsImm5Half};
+        case 0X1000: /* STR (3) -SP */
+          return {HANDLER(thumbTransferImm<false, 4>), thumbFieldsSP};
+        default: /* LDR (4) -SP */
+          return {HANDLER(thumbTransferImm<true, 4>), thumbFieldsSP};
+      }
 
-    case 0X1800:
-      thumbBranch1(opCode, false);
-      break;
+    case 0XA000:
+      if ((opCode & 0X1000) == 0) {
+        if ((opCode & 0X0800) == 0) {
+          return {HANDLER(thumbAddPC), thumbFieldsImm8Word};
+        }
+        return {HANDLER(thumbAddSP), thumbFieldsImm8Word};
+      }
+      switch (opCode & 0X0F00) {
+        case 0X0000:
+          return {HANDLER(thumbAdjustSP), thumbFieldsAdjustSP};
+        case 0X0400:
+        case 0X0500:
+          return {HANDLER(thumbPush), thumbFieldsPush};
+        case 0X0C00:
+        case 0X0D00:
+          return {HANDLER(thumbPop), thumbFieldsPop};
+        case 0X0E00:
+          return {HANDLER(thumbBreakpoint), thumbFieldsNone};
+        default:
+          return {HANDLER(thumbUndefined), thumbFieldsNone};
+      }
+
+    case 0XC000:
+      if ((opCode & 0X1000) == 0) {
+        if ((opCode & 0X0800) == 0) {
+          return {HANDLER(thumbMultiple<false>), thumbFieldsMultiple};
+        }
+        return {HANDLER(thumbMultiple<true>), thumbFieldsMultiple};
+      }
+      if ((opCode & 0X0F00) == 0X0F00) {
+        return {HANDLER(thumbSwi), thumbFieldsImm8};
+      }
+      return {HANDLER(thumbBranchCond), thumbFieldsBranchCond};
+
+    default:
+      switch (opCode & 0X1800) {
+        case 0X0000:
+          return {HANDLER(thumbBranch), thumbFieldsBranch};
+        case 0X0800:
+          return {HANDLER(thumbBlx), thumbFieldsNone};
+        case 0X1000:
+          return {HANDLER(thumbBlPrefix), thumbFieldsBlPrefix};
+        default:
+          return {HANDLER(thumbBl), thumbFieldsNone};
+      }
+  }
+}
+
+/**
+ * @brief Build the Thumb decode table.
+ */
+void initThumbTable() {
+  for (uint i = 0; i < thumbTableSize; i++) {
+    thumbTable[i] = thumbClassify(i << 6);
   }
 }
 
@@ -3419,10 +8245,16 @@ void thumbBranch(uint opCode) {
  * @param number
  * @return uint
  */
-uint getmem32(int number) {
-  number = number % RAMSIZE;
+uint Machine::getmem32(int number) {
+  number = number & ((memSize >> 2) - 1);
+#ifdef NATIVE_MEMORY
+  uint word;
+  memcpy(&word, &memory[number << 2], 4);
+  return word;
+#else
   return memory[(number << 2)] | memory[(number << 2) + 1] << 8 |
          memory[(number << 2) + 2] << 16 | memory[(number << 2) + 3] << 24;
+#endif
 }
 
 /**
@@ -3430,12 +8262,66 @@ uint getmem32(int number) {
  * @param number
  * @param reg
  */
-void setmem32(int number, uint reg) {
-  number = number & (RAMSIZE - 1);
+void Machine::setmem32(int number, uint reg) {
+  number = number & ((memSize >> 2) - 1);
+  invalidateDecoded(number);
+  markDirty(number);
+#ifdef NATIVE_MEMORY
+  memcpy(&memory[number << 2], &reg, 4);
+#else
   memory[(number << 2) + 0] = (reg >> 0) & 0xff;
   memory[(number << 2) + 1] = (reg >> 8) & 0xff;
   memory[(number << 2) + 2] = (reg >> 16) & 0xff;
   memory[(number << 2) + 3] = (reg >> 24) & 0xff;
+#endif
+}
+
+/**
+ * @brief Read an aligned halfword.
+ * @param address The byte address, which must be even and within memory.
+ * @return uint
+ */
+uint Machine::getmem16(uint address) {
+#ifdef NATIVE_MEMORY
+  unsigned short half;
+  memcpy(&half, &memory[address], 2);
+  return half;
+#else
+  return memory[address] | memory[address + 1] << 8;
+#endif
+}
+
+/**
+ * @brief Write an aligned halfword, wrapping as setmem32 does.
+ * @param address The byte address, which must be even.
+ * @param reg The halfword, in the lower 16 bits.
+ */
+void Machine::setmem16(uint address, uint reg) {
+  uint number = (address >> 2) & ((memSize >> 2) - 1);
+  uchar* pointer = &memory[(number << 2) | (address & 0X00000002)];
+
+  invalidateDecoded(number);
+  markDirty(number);
+#ifdef NATIVE_MEMORY
+  unsigned short half = reg;
+  memcpy(pointer, &half, 2);
+#else
+  pointer[0] = (reg >> 0) & 0xff;
+  pointer[1] = (reg >> 8) & 0xff;
+#endif
+}
+
+/**
+ * @brief Write a single byte, wrapping as setmem32 does.
+ * @param address
+ * @param reg The byte, in the lower 8 bits.
+ */
+void Machine::setmem8(uint address, uint reg) {
+  uint number = (address >> 2) & ((memSize >> 2) - 1);
+
+  invalidateDecoded(number);
+  markDirty(number);
+  memory[(number << 2) | (address & 0X00000003)] = reg & 0xff;
 }
 
 /**
@@ -3494,3 +8380,5 @@ bool getBuffer(ringBuffer* buffer, uchar* c) {
 
   return false;
 }
+
+}  // namespace
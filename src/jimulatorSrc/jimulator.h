@@ -0,0 +1,83 @@
+/**
+ * @file jimulator.h
+ * @brief The emulator as a library: the operations a client such as kcmd
+ * would otherwise send to a separate jimulator process over pipes, made as
+ * function calls on an emulator in the client's own process. Built into
+ * `bin/libjimulator.a`.
+ */
+
+#ifndef JIMULATOR_H
+#define JIMULATOR_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/**
+ * @brief An emulated ARM machine in this process. Calls are not synchronised:
+ * a client using more than one thread must serialise them itself.
+ */
+class Emulator {
+ public:
+  Emulator();
+  ~Emulator();
+
+  // Loading
+
+  bool load(const char* pathToKMD);
+  void readMemory(uint32_t address, unsigned char* data, unsigned int length);
+  void writeMemory(uint32_t address,
+                   const unsigned char* data,
+                   unsigned int length);
+
+  // Running
+
+  void start(unsigned int steps);
+  void stop();
+  void resume();
+  void reset();
+  bool run();
+
+  // State
+
+  unsigned char status();
+  unsigned int stepsSinceReset();
+  uint32_t getRegister(unsigned int number);
+  std::vector<uint32_t> recentPCs(unsigned int count);
+
+  // Breakpoints
+
+  bool setBreakpoint(uint32_t address);
+  bool clearBreakpoint(uint32_t address);
+  std::vector<uint32_t> getBreakpoints();
+
+  // Terminal
+
+  void terminalInput(char c);
+  std::string terminalOutput();
+  bool recordInput(const char* fileName);
+
+  // Snapshots
+
+  std::string snapshot();
+  bool restore(const std::string& blob);
+
+  // Running backwards
+
+  bool stepBack(unsigned int steps);
+  bool reverseContinue();
+  void setCheckpoints(unsigned int interval, size_t budget);
+
+  // Timing
+
+  bool setTiming(const char* core);
+  uint64_t cycles();
+
+ private:
+  class Machine;  // Defined in jimulator.cpp
+  Machine* machine;
+
+  int findBreakpoint(uint32_t address);
+};
+
+#endif
@@ -9,6 +9,7 @@
  */
 
 #include "kcmd.h"
+#include "../jimulatorSrc/jimulator.h"
 #include <ctype.h>
 #include <fcntl.h>
 #include <math.h>
@@ -72,6 +73,12 @@ constexpr int ADDRESS_BUS_WIDTH = 4;
  */
 constexpr int MAX_NUMBER_OF_BREAKPOINTS = 32;
 
+/**
+ * @brief The emulator, when run in this process; NULL when it is a separate
+ * jimulator process (`--remote`), reached through the pipes below.
+ */
+Emulator* emulator = NULL;
+
 // Communication pipes
 int communicationFromJimulator[2];
 int communicationToJimulator[2];
@@ -80,9 +87,13 @@ int writeToJimulator;
 int readFromJimulator;
 int emulator_PID;
 
-std::thread *t1, *t2;
+std::thread *t0, *t1, *t2;
 std::mutex mtx;
 
+// Reported by Jimulator with its status, only if timing a core (`--timing`)
+bool jimulatorTimed = false;
+uint64_t cyclesSinceReset = 0;
+
 /**
  * @brief Contains the information read from Jimulator about a given breakpoint.
  */
@@ -132,6 +143,9 @@ enum class BoardInstruction : unsigned char {
   STOP = 0x21,
   CONTINUE = 0x23,
   RESET = 0x04,
+  TRACE_GET = 0x26,
+  STEP_BACK = 0x27,
+  REVERSE_CONTINUE = 0x28,
 
   // Terminal read/write
   FR_WRITE = 0x12,
@@ -240,17 +254,17 @@ inline const std::string generateMemoryHex(SourceFileLine** src,
                                            const int currentAddressI,
                                            unsigned char (*memdata)[52]);
 
-// Low level sending
+// Low level sending (static, as the emulator library has its own)
 
-inline void sendNBytes(int, int);
-inline void sendChar(unsigned char);
-inline void sendCharArray(int, unsigned char*);
+static inline void sendNBytes(int, int);
+static inline void sendChar(unsigned char);
+static inline void sendCharArray(int, unsigned char*);
 
 // Low level receiving
 
-inline const int getNBytes(int*, int);
-inline const int getChar(unsigned char*);
-inline const int getCharArray(int, unsigned char*);
+static inline const int getNBytes(int*, int);
+static inline const int getChar(unsigned char*);
+static inline const int getCharArray(int, unsigned char*);
 
 // Breakpoints
 
@@ -332,6 +346,10 @@ const bool Jimulator::loadJimulator(const char* const pathToKMD) {
 void Jimulator::startJimulator(const int steps) {
   if (checkBoardState() == ClientState::NORMAL ||
       Jimulator::checkBoardState() == ClientState::BREAKPOINT) {
+    if (emulator != NULL) {
+      emulator->start(steps);
+      return;
+    }
     sendChar(static_cast<unsigned char>(BoardInstruction::START));
     sendNBytes(steps, 4);  // Send step count
   }
@@ -343,14 +361,68 @@ void Jimulator::startJimulator(const int steps) {
 void Jimulator::continueJimulator() {
   if (Jimulator::checkBoardState() == ClientState::NORMAL ||
       Jimulator::checkBoardState() == ClientState::BREAKPOINT) {
+    if (emulator != NULL) {
+      emulator->resume();
+      return;
+    }
     sendChar(static_cast<unsigned char>(BoardInstruction::CONTINUE));
   }
 }
 
+/**
+ * @brief Runs Jimulator backwards, while it is stopped.
+ * @param steps The number of steps to go back.
+ * @return bool true if it went back - perhaps fewer steps, if its history does
+ * not reach that far.
+ */
+const bool Jimulator::stepBackJimulator(const int steps) {
+  if (checkBoardState() == ClientState::NORMAL ||
+      Jimulator::checkBoardState() == ClientState::BREAKPOINT) {
+    if (emulator != NULL) {
+      return emulator->stepBack(steps);
+    }
+    unsigned char res = 0;
+    int stepsSinceReset;
+
+    sendChar(static_cast<unsigned char>(BoardInstruction::STEP_BACK));
+    sendNBytes(steps, 4);           // Send step count
+    return (getChar(&res) == 1) &&       // Read the result
+           (getNBytes(&stepsSinceReset, 4) == 4) && (res != 0);
+  }
+
+  return false;
+}
+
+/**
+ * @brief Runs Jimulator backwards to the last breakpoint hit, while it is
+ * stopped.
+ * @return bool true if it went back.
+ */
+const bool Jimulator::reverseContinueJimulator() {
+  if (checkBoardState() == ClientState::NORMAL ||
+      Jimulator::checkBoardState() == ClientState::BREAKPOINT) {
+    if (emulator != NULL) {
+      return emulator->reverseContinue();
+    }
+    unsigned char res = 0;
+    int stepsSinceReset;
+
+    sendChar(static_cast<unsigned char>(BoardInstruction::REVERSE_CONTINUE));
+    return (getChar(&res) == 1) &&  // Read the result
+           (getNBytes(&stepsSinceReset, 4) == 4) && (res != 0);
+  }
+
+  return false;
+}
+
 /**
  * @brief Pauses the emulator running.
  */
 void Jimulator::pauseJimulator() {
+  if (emulator != NULL) {
+    emulator->stop();
+    return;
+  }
   sendChar(static_cast<unsigned char>(BoardInstruction::STOP));
 }
 
@@ -358,6 +430,10 @@ void Jimulator::pauseJimulator() {
  * @brief Reset the emulators running.
  */
 void Jimulator::resetJimulator() {
+  if (emulator != NULL) {
+    emulator->reset();
+    return;
+  }
   sendChar(static_cast<unsigned char>(BoardInstruction::RESET));
 }
 
@@ -370,6 +446,11 @@ const bool Jimulator::setBreakpoint(const uint32_t addr) {
   unsigned int wordA = 0, wordB = 0;
   unsigned char address[ADDRESS_BUS_WIDTH] = {0};
 
+  // Toggles, as below
+  if (emulator != NULL) {
+    return not emulator->clearBreakpoint(addr) && emulator->setBreakpoint(addr);
+  }
+
   // Unpack address to byte array
   for (int i = 0; i < ADDRESS_BUS_WIDTH; i++) {
     address[i] = getLeastSignificantByte(addr >> (8 * i));
@@ -460,6 +541,36 @@ const std::array<std::string, 16> Jimulator::getJimulatorRegisterValues() {
   return ret;
 }
 
+/**
+ * @brief Reads the addresses of the most recently executed instructions.
+ * @param count The most addresses to read; Jimulator may return fewer.
+ * @return const std::vector<uint32_t> The addresses, most recent first.
+ */
+const std::vector<uint32_t> Jimulator::getRecentPCs(const int count) {
+  std::vector<uint32_t> ret;
+  int available = 0;
+
+  if (emulator != NULL) {
+    return emulator->recentPCs(count);
+  }
+
+  sendChar(static_cast<unsigned char>(BoardInstruction::TRACE_GET));
+  sendNBytes(count, 2);
+  if (getNBytes(&available, 2) != 2) {
+    return ret;
+  }
+
+  for (int i = 0; i < available; i++) {
+    int address;
+    if (getNBytes(&address, 4) != 4) {
+      break;
+    }
+    ret.push_back(static_cast<uint32_t>(address));
+  }
+
+  return ret;
+}
+
 /**
  * @brief Reads for messages from Jimulator, to display in the terminal output.
  * @return const std::string The message to be displayed in the terminal output.
@@ -470,6 +581,10 @@ const std::string Jimulator::getJimulatorTerminalMessages() {
 
   std::string output("");
 
+  if (emulator != NULL) {
+    return emulator->terminalOutput();
+  }
+
   while (length > 0) {
     sendChar(static_cast<unsigned char>(BoardInstruction::FR_READ));
     sendChar(0);  // send the terminal number
@@ -501,6 +616,10 @@ const bool Jimulator::sendTerminalInputToJimulator(const unsigned int val) {
   if (((key_pressed >= ' ') && (key_pressed <= 0x7F)) ||
       (key_pressed == '\n') || (key_pressed == '\b') || (key_pressed == '\t') ||
       (key_pressed == '\a')) {
+    if (emulator != NULL) {
+      emulator->terminalInput(key_pressed);
+      return true;
+    }
     sendChar(static_cast<unsigned char>(
         BoardInstruction::FR_WRITE));  // begins a write
     sendChar(0);                       // tells where to send it
@@ -532,10 +651,15 @@ std::array<Jimulator::MemoryValues, 13> Jimulator::getJimulatorMemoryValues(
 
   // Reading data into arrays!
   unsigned char memdata[bytecount];
-  sendChar(static_cast<unsigned char>(BoardInstruction::GET_MEM));
-  sendCharArray(ADDRESS_BUS_WIDTH, currentAddressS);
-  sendNBytes(count, 2);
-  getCharArray(bytecount, memdata);
+  if (emulator != NULL) {
+    emulator->readMemory(numericStringToInt(ADDRESS_BUS_WIDTH, currentAddressS),
+                         memdata, bytecount);
+  } else {
+    sendChar(static_cast<unsigned char>(BoardInstruction::GET_MEM));
+    sendCharArray(ADDRESS_BUS_WIDTH, currentAddressS);
+    sendNBytes(count, 2);
+    getCharArray(bytecount, memdata);
+  }
 
   SourceFileLine* src = NULL;
   bool firstFlag = false;
@@ -852,7 +976,7 @@ inline void setBreakpointDefinition(unsigned int breakpointIndex,
  * @param length The number of bytes to send from data.
  * @param data An pointer to the data that should be sent.
  */
-inline void sendCharArray(int length, unsigned char* data) {
+static inline void sendCharArray(int length, unsigned char* data) {
   struct pollfd pollfd;
   pollfd.fd = writeToJimulator;
   pollfd.events = POLLOUT;
@@ -872,7 +996,7 @@ inline void sendCharArray(int length, unsigned char* data) {
  * @brief Sends a singular character to Jimulator.
  * @param data The character to send.
  */
-inline void sendChar(unsigned char data) {
+static inline void sendChar(unsigned char data) {
   sendCharArray(1, &data);
 }
 
@@ -881,7 +1005,7 @@ inline void sendChar(unsigned char data) {
  * @param data The data to be written.
  * @param n The number of bytes to write.
  */
-inline void sendNBytes(int data, int n) {
+static inline void sendNBytes(int data, int n) {
   if (n > ADDRESS_BUS_WIDTH) {
     n = ADDRESS_BUS_WIDTH;  // Clip n
   }
@@ -904,7 +1028,7 @@ inline void sendNBytes(int data, int n) {
  * @return int The number of bytes successfully received, up to `length` number
  * of characters.
  */
-inline const int getCharArray(int length, unsigned char* data) {
+static inline const int getCharArray(int length, unsigned char* data) {
   int reply_count;  // Number of chars fetched in latest attempt
   int reply_total = 0;
   struct pollfd pollfd;
@@ -947,7 +1071,7 @@ inline const int getCharArray(int length, unsigned char* data) {
  * @param data A pointer to a memory location where the read data can be stored.
  * @return int The number of bytes successfully received - either 1 or 0.
  */
-inline const int getChar(unsigned char* data) {
+static inline const int getChar(unsigned char* data) {
   return getCharArray(1, data);
 }
 
@@ -960,7 +1084,7 @@ inline const int getChar(unsigned char* data) {
  * @param n The number of bytes to read.
  * @return int The number of bytes received successfully.
  */
-inline const int getNBytes(int* data, int n) {
+static inline const int getNBytes(int* data, int n) {
   if (n > ADDRESS_BUS_WIDTH) {
     n = ADDRESS_BUS_WIDTH;  // Clip, just in case
   }
@@ -984,16 +1108,24 @@ inline const ClientState getBoardStatus() {
   unsigned char clientStatus = 0;
   int stepsSinceReset;
   int leftOfWalk;
+  int cycles[2] = {0, 0};
+
+  if (emulator != NULL) {
+    return static_cast<ClientState>(emulator->status());
+  }
 
   // If the board sends back the wrong the amount of data
   sendChar(static_cast<unsigned char>(BoardInstruction::WOT_U_DO));
 
   if (getChar(&clientStatus) != 1 ||
       getNBytes(&leftOfWalk, 4) != 4 ||       // Steps remaining
-      getNBytes(&stepsSinceReset, 4) != 4) {  // Steps since reset
+      getNBytes(&stepsSinceReset, 4) != 4 ||  // Steps since reset
+      (jimulatorTimed && (getNBytes(&cycles[0], 4) != 4 ||  // Cycles
+                          getNBytes(&cycles[1], 4) != 4))) {
     std::cout << "board not responding\n";
     return ClientState::BROKEN;
   }
+  cyclesSinceReset = (uint64_t)(uint32_t)cycles[1] << 32 | (uint32_t)cycles[0];
 
   // TODO: clientStatus represents what the board is doing and why - can be
   //       reflected in the view? and the same with stepsSinceReset
@@ -1001,6 +1133,19 @@ inline const ClientState getBoardStatus() {
   return static_cast<ClientState>(clientStatus);
 }
 
+/**
+ * @brief Gets the cycles Jimulator estimates have run since reset.
+ * @return const uint64_t 0 unless it is timing a core (`--timing`).
+ */
+const uint64_t Jimulator::getCyclesSinceReset() {
+  if (emulator != NULL) {
+    return emulator->cycles();
+  }
+
+  getBoardStatus();  // Reports the cycles too
+  return cyclesSinceReset;
+}
+
 /**
  * @brief Gets serialized bit data from the board that represents 16 register
  * values - 15 general purpose registers and the PC.
@@ -1010,10 +1155,20 @@ inline const ClientState getBoardStatus() {
 inline const std::array<unsigned char, 64> readRegistersIntoArray() {
   unsigned char data[64];
 
-  sendChar(static_cast<unsigned char>(BoardInstruction::GET_REG));
-  sendNBytes(0, 4);
-  sendNBytes(16, 2);
-  getCharArray(64, data);
+  if (emulator != NULL) {
+    for (int i = 0; i < 16; i++) {
+      uint32_t value = emulator->getRegister(i);
+
+      for (int j = 0; j < 4; j++) {  // Little endian, as from the pipe
+        data[4 * i + j] = getLeastSignificantByte(value >> (8 * j));
+      }
+    }
+  } else {
+    sendChar(static_cast<unsigned char>(BoardInstruction::GET_REG));
+    sendNBytes(0, 4);
+    sendNBytes(16, 2);
+    getCharArray(64, data);
+  }
 
   std::array<unsigned char, 64> ret;
   std::copy(std::begin(data), std::end(data), std::begin(ret));
@@ -1137,6 +1292,13 @@ inline const std::unordered_map<u_int32_t, bool> getAllBreakpoints() {
   unsigned int wordA, wordB;
   bool error = false;
 
+  if (emulator != NULL) {
+    for (u_int32_t addr : emulator->getBreakpoints()) {
+      breakpointAddresses.insert({addr, true});
+    }
+    return breakpointAddresses;
+  }
+
   // If reading the breakpoints was a success, loops through all of the possible
   // breakpoints - if they are active, add them to the map.
   if (getBreakpointStatus(&wordA, &wordB)) {
@@ -1270,6 +1432,11 @@ constexpr const unsigned int boardTranslateMemsize(const int size) {
 inline void boardSetMemory(unsigned char* const address,
                            unsigned char* const value,
                            const int size) {
+  if (emulator != NULL) {
+    emulator->writeMemory(numericStringToInt(ADDRESS_BUS_WIDTH, address), value,
+                          size);
+    return;
+  }
   sendChar(BoardInstruction::SET_MEM | boardTranslateMemsize(size));
   sendCharArray(ADDRESS_BUS_WIDTH, address);  // send address
   sendNBytes(1, 2);                           // send width
@@ -1500,7 +1667,9 @@ char * getKcmdPath() {
 	return dbuf;
 }
 
-void initJimulator(std::string argv0) {
+void initJimulator(std::string argv0,
+                   const char* record,
+                   const char* timing) {
   // sets up the pipes to allow communication between Jimulator and
   // KoMo2 processes.
   if (pipe(communicationFromJimulator) || pipe(communicationToJimulator)) {
@@ -1510,6 +1679,7 @@ void initJimulator(std::string argv0) {
 
   readFromJimulator = communicationFromJimulator[0];
   writeToJimulator = communicationToJimulator[1];
+  jimulatorTimed = timing != NULL;
 
   // Stores the emulator_PID for later.
   emulator_PID = fork();
@@ -1525,7 +1695,16 @@ void initJimulator(std::string argv0) {
     dup2(communicationToJimulator[0], 0);
 
     auto jimulatorPath = argv0.append("/jimulator").c_str();
-    execlp(jimulatorPath, "jimulator", (char*)0);
+    std::vector<const char*> args = {"jimulator"};
+
+    if (record != NULL) {
+      args.insert(args.end(), {"--record", record});
+    }
+    if (timing != NULL) {
+      args.insert(args.end(), {"--timing", timing});
+    }
+    args.push_back(NULL);
+    execvp(jimulatorPath, (char* const*)args.data());
     // should never get here
     _exit(1);
   }
@@ -1544,6 +1723,20 @@ static void initTerm() {
 static void handle_io() {
 	char c;
 
+	// An emulator in this process is run here, a time slice at a time
+	if (emulator != NULL) {
+		t0 = new std::thread([&]() -> void {
+			while(true) {
+				mtx.lock();
+				bool busy = emulator->run();
+				mtx.unlock();
+				if (!busy) {
+					usleep(10000);
+				}
+			}
+		});
+	}
+
 	t1 = new std::thread([&]() -> void {
 		while(true) {
 			usleep(10000);
@@ -1564,18 +1757,52 @@ static void handle_io() {
 }
 
 int main(int argc, char** argv) {
-	if(argc != 2) {
-		std::cout << "usage: " << argv[0] << " <asm file>\n";
+	bool remote = false;
+	char *record = NULL;  // Log of terminal input, for "jimulator --replay"
+	char *timing = NULL;  // Core to estimate cycles for
+	char *source = NULL;
+
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "--remote") == 0) {
+			remote = true;
+		} else if(strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+			record = argv[++i];
+		} else if(strcmp(argv[i], "--timing") == 0 && i + 1 < argc) {
+			timing = argv[++i];
+		} else if(source == NULL) {
+			source = argv[i];
+		} else {
+			source = NULL;
+			break;
+		}
+	}
+
+	if(source == NULL) {
+		std::cout << "usage: " << argv[0]
+		          << " [--remote] [--record <input log>] [--timing <core>]"
+		             " <asm file>\n";
 		return 1;
 	}
 
 	char *kcmd_path = getKcmdPath();
-	char *kmd_path = stokmd(argv[1]);
+	char *kmd_path = stokmd(source);
 
 	*strrchr(kcmd_path, '/') = 0;
-	initJimulator(kcmd_path);
+	if(remote) {
+		initJimulator(kcmd_path, record, timing);
+	} else {
+		emulator = new Emulator();
+		if(record != NULL && !emulator->recordInput(record)) {
+			std::cout << "Cannot write " << record << "\n";
+			return 1;
+		}
+		if(timing != NULL && !emulator->setTiming(timing)) {
+			std::cout << "Cannot time core " << timing << "\n";
+			return 1;
+		}
+	}
 	initTerm();
-	Jimulator::compileJimulator(kcmd_path, argv[1], kmd_path);
+	Jimulator::compileJimulator(kcmd_path, source, kmd_path);
 	
 	Jimulator::loadJimulator(kmd_path);
 	Jimulator::startJimulator(1000000);
@@ -1583,7 +1810,11 @@ int main(int argc, char** argv) {
 
 	free(kmd_path);
 	free(kcmd_path);
-	wait(NULL);
-	kill(emulator_PID, SIGTERM);
+	if(remote) {
+		wait(NULL);
+		kill(emulator_PID, SIGTERM);
+	} else {
+		t0->join();  // Runs until killed, as jimulator would
+	}
 }
 
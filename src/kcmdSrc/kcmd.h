@@ -10,6 +10,7 @@
 
 #include <array>
 #include <string>
+#include <vector>
 
 /**
  * @brief A series of values that represent state information returned from
@@ -74,6 +75,8 @@ const std::array<std::string, 16> getJimulatorRegisterValues();
 std::array<Jimulator::MemoryValues, 13> getJimulatorMemoryValues(
     const uint32_t s_address_int);
 const std::string getJimulatorTerminalMessages();
+const std::vector<uint32_t> getRecentPCs(const int count);
+const uint64_t getCyclesSinceReset();
 
 // ! Loading data
 
@@ -86,6 +89,8 @@ const bool loadJimulator(const char* const pathToKMD);
 
 void startJimulator(const int steps);
 void continueJimulator();
+const bool stepBackJimulator(const int steps);
+const bool reverseContinueJimulator();
 void pauseJimulator();
 void resetJimulator();
 const bool sendTerminalInputToJimulator(const unsigned int val);
@@ -0,0 +1,42 @@
+#!/bin/sh
+# Runs each program given with --batch, with and without --jit, and checks
+# that the terminal output, the exit status and the instruction count agree.
+# Used by "make check"; run from the project root.
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+printf '12\n345\n' >"$work/input"  # Enough for those that read numbers
+failed=0
+
+for source in "$@"; do
+  name=$(basename "$source" .s)
+
+  if ! bin/aasm -lk "$work/$name.kmd" "$source" >/dev/null; then
+    echo "FAIL $name: does not assemble"
+    failed=1
+    continue
+  fi
+
+  for mode in interpreter jit; do
+    flags=""
+    if [ "$mode" = jit ]; then
+      flags=--jit
+    fi
+    bin/jimulator --batch "$work/$name.kmd" --input "$work/input" \
+      --limit 40000000 $flags </dev/null \
+      >"$work/$name.$mode.out" 2>"$work/$name.$mode.err"
+    echo "Exit status $?" >>"$work/$name.$mode.err"
+  done
+
+  if cmp -s "$work/$name.interpreter.out" "$work/$name.jit.out" &&
+    cmp -s "$work/$name.interpreter.err" "$work/$name.jit.err"; then
+    echo "ok   $name: $(head -n 1 "$work/$name.jit.err")"
+  else
+    echo "FAIL $name"
+    diff "$work/$name.interpreter.err" "$work/$name.jit.err"
+    diff "$work/$name.interpreter.out" "$work/$name.jit.out" | head -n 10
+    failed=1
+  fi
+done
+
+exit $failed